@@ -71,10 +71,16 @@ static void usage(void)
 	     "\n"
 	     "Commands for operating on files in a bcachefs filesystem:\n"
 	     "  setattr              Set various per file attributes\n"
+	     "\n"
+	     "Compression:\n"
+	     "  train-dict           Train a zstd dictionary for small extents\n"
+	     "\n"
 	     "Debug:\n"
 	     "These commands work on offline, unmounted filesystems\n"
 	     "  dump                 Dump filesystem metadata to a qcow2 image\n"
 	     "  list                 List filesystem metadata in textual form\n"
+	     "  bench                Run btree microbenchmarks\n"
+	     "  trace                Run another command with tracepoints enabled\n"
 	     "\n"
 	     "Miscellaneous:\n"
 	     "  version              Display the version of the invoked bcachefs tool\n");
@@ -153,6 +159,16 @@ int main(int argc, char *argv[])
 
 	char *cmd = pop_cmd(&argc, argv);
 
+	if (!strcmp(cmd, "trace")) {
+		/* runs the command that follows, with tracing enabled: */
+		int nr = cmd_trace(argc, argv) - 1;
+
+		argv[nr] = argv[0];
+		argc -= nr;
+		argv += nr;
+		cmd = pop_cmd(&argc, argv);
+	}
+
 	if (!strcmp(cmd, "version"))
 		return cmd_version(argc, argv);
 	if (!strcmp(cmd, "format"))
@@ -199,6 +215,11 @@ int main(int argc, char *argv[])
 		return cmd_dump(argc, argv);
 	if (!strcmp(cmd, "list"))
 		return cmd_list(argc, argv);
+	if (!strcmp(cmd, "bench"))
+		return cmd_bench(argc, argv);
+
+	if (!strcmp(cmd, "train-dict"))
+		return cmd_train_dict(argc, argv);
 
 	if (!strcmp(cmd, "setattr"))
 		return cmd_setattr(argc, argv);
@@ -0,0 +1,700 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+#include "tools-util.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/bkey.h"
+#include "libbcachefs/bset.h"
+#include "libbcachefs/checksum.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/tests.h"
+
+#include <crypto/chacha.h>
+#include <crypto/hash.h>
+#include <crypto/poly1305.h>
+#include <crypto/skcipher.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+
+static const char * const bench_default_tests[] = {
+	"rand_insert",
+	"rand_lookup",
+	"rand_mixed",
+	"rand_delete",
+	"seq_insert",
+	"seq_lookup",
+	"seq_overwrite",
+	"seq_delete",
+	NULL
+};
+
+static void bench_usage(void)
+{
+	puts("bcachefs bench - run btree microbenchmarks\n"
+	     "Usage: bcachefs bench [OPTION]... [test]...\n"
+	     "\n"
+	     "Runs the given tests (by default all of rand_insert, rand_lookup,\n"
+	     "rand_mixed, rand_delete, seq_insert, seq_lookup, seq_overwrite and\n"
+	     "seq_delete) on a freshly formatted scratch image, or on an existing\n"
+	     "filesystem. rand_lookup_many is rand_lookup done through batched,\n"
+	     "sorted lookups, 64 keys per iteration.\n"
+	     "\n"
+	     "The crc32c, chacha20 and poly1305 tests instead measure checksum and\n"
+	     "encryption throughput, over nr * 4k bytes per buffer size: crc32c for\n"
+	     "each implementation this CPU supports, chacha20 over contiguous and\n"
+	     "scattered pages, and poly1305 a page at a time and all at once.\n"
+	     "The fused test compares the write path's bounce, encrypt and\n"
+	     "checksum done as separate passes against done in one chunked pass,\n"
+	     "for crc32c and chacha20/poly1305.\n"
+	     "\n"
+	     "bkey_unpack and bkey_cmp measure each packed key unpack and compare\n"
+	     "implementation, on keys typical of the extents, inodes and dirents\n"
+	     "btrees packed with the formats their btree nodes would get.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -n, --nr=nr                 Iterations per test (default 100k)\n"
+	     "  -t, --threads=nr            Number of threads (default 1)\n"
+	     "  -d, --device=device         Use an existing filesystem instead of a scratch\n"
+	     "                              image; test keys are written to it, so this\n"
+	     "                              should be a scratch filesystem too\n"
+	     "  -s, --size=size             Size of the scratch image (default 4G)\n"
+	     "  -j, --json=file             Also write results to file as JSON\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+/* Format a sparse file in $TMPDIR; returns its path, to be unlinked after: */
+static char *bench_scratch_image(u64 size)
+{
+	struct dev_opts dev = dev_opts_default();
+	const char *tmpdir = getenv("TMPDIR") ?: "/tmp";
+	char *path = mprintf("%s/bcachefs-bench.XXXXXX", tmpdir);
+
+	dev.fd = mkstemp(path);
+	if (dev.fd < 0)
+		die("error creating %s: %m", path);
+
+	if (ftruncate(dev.fd, size))
+		die("error resizing %s: %m", path);
+
+	dev.path = path;
+	dev.size = size >> 9;
+
+	/* closes dev.fd: */
+	free(bch2_format((struct bch_opt_strs) { 0 },
+			 bch2_opts_empty(),
+			 format_opts_default(),
+			 &dev, 1));
+	return path;
+}
+
+static const size_t bench_checksum_sizes[] = {
+	64, 512, 4096, 64 << 10, 1 << 20,
+};
+
+/* Tests that don't need a filesystem: */
+static bool bench_is_standalone(const char *test)
+{
+	return !strcmp(test, "crc32c") ||
+		!strcmp(test, "chacha20") ||
+		!strcmp(test, "poly1305") ||
+		!strcmp(test, "fused") ||
+		!strcmp(test, "bkey_unpack") ||
+		!strcmp(test, "bkey_cmp");
+}
+
+static void bench_print_rate(const char *test, const char *impl,
+			     size_t size, u64 bytes, u64 start)
+{
+	u64 time = max_t(u64, local_clock() - start, 1);
+
+	printf("%s %-12s %8zu bytes: %8llu MB/s\n", test, impl, size,
+	       div64_u64(bytes * 1000, time));
+}
+
+static void bench_crc32c(u64 nr)
+{
+	size_t max = bench_checksum_sizes[ARRAY_SIZE(bench_checksum_sizes) - 1];
+	u64 bytes = nr * 4096;
+	const struct crc32c_impl *impl;
+	void *buf = xmalloc(max);
+	unsigned i;
+
+	get_random_bytes(buf, max);
+
+	for (impl = crc32c_impls; impl->name; impl++) {
+		if (impl->supported && !impl->supported()) {
+			printf("crc32c %-12s not supported\n", impl->name);
+			continue;
+		}
+
+		for (i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++) {
+			size_t size = bench_checksum_sizes[i];
+			u64 iters = max_t(u64, bytes / size, 1), j, start;
+			u32 crc = 0;
+
+			if (impl->fn(~0, buf, size) !=
+			    crc32c_impls[0].fn(~0, buf, size))
+				die("crc32c %s: wrong result", impl->name);
+
+			start = local_clock();
+			for (j = 0; j < iters; j++)
+				crc = impl->fn(crc, buf, size);
+			bench_print_rate("crc32c", impl->name, size,
+					 iters * size, start);
+		}
+	}
+
+	free(buf);
+}
+
+/*
+ * Buffers are split into pages, like bios: contiguous pages, or the same pages
+ * in reverse order so that they can't be coalesced and each segment is done
+ * separately:
+ */
+static void bench_sg_init(struct scatterlist *sg, void *buf, size_t size,
+			  bool scattered)
+{
+	unsigned i, nr = DIV_ROUND_UP(size, PAGE_SIZE);
+
+	sg_init_table(sg, nr);
+	for (i = 0; i < nr; i++) {
+		unsigned page = scattered ? nr - 1 - i : i;
+
+		sg_set_buf(&sg[i], buf + page * PAGE_SIZE,
+			   min_t(size_t, size - page * PAGE_SIZE, PAGE_SIZE));
+	}
+}
+
+static void bench_chacha20(u64 nr)
+{
+	size_t max = bench_checksum_sizes[ARRAY_SIZE(bench_checksum_sizes) - 1];
+	struct crypto_sync_skcipher *chacha20 =
+		crypto_alloc_sync_skcipher("chacha20", 0, 0);
+	struct scatterlist *sg = xcalloc(max / PAGE_SIZE, sizeof(*sg));
+	void *buf = xmalloc(max);
+	u8 key[CHACHA_KEY_SIZE], iv[CHACHA_IV_SIZE] = { 0 };
+	unsigned i, scattered;
+
+	if (IS_ERR(chacha20))
+		die("error allocating chacha20: %li", PTR_ERR(chacha20));
+
+	get_random_bytes(key, sizeof(key));
+	if (crypto_skcipher_setkey(&chacha20->base, key, sizeof(key)))
+		die("error setting chacha20 key");
+	get_random_bytes(buf, max);
+
+	for (scattered = 0; scattered < 2; scattered++)
+		for (i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++) {
+			size_t size = bench_checksum_sizes[i];
+			u64 iters = max_t(u64, nr * 4096 / size, 1), j, start;
+			SYNC_SKCIPHER_REQUEST_ON_STACK(req, chacha20);
+
+			bench_sg_init(sg, buf, size, scattered);
+			skcipher_request_set_sync_tfm(req, chacha20);
+			skcipher_request_set_crypt(req, sg, sg, size, iv);
+
+			start = local_clock();
+			for (j = 0; j < iters; j++)
+				BUG_ON(crypto_skcipher_encrypt(req));
+			bench_print_rate("chacha20",
+					 scattered ? "scattered" : "contiguous",
+					 size, iters * size, start);
+		}
+
+	crypto_free_sync_skcipher(chacha20);
+	free(sg);
+	free(buf);
+}
+
+static void bench_poly1305(u64 nr)
+{
+	size_t max = bench_checksum_sizes[ARRAY_SIZE(bench_checksum_sizes) - 1];
+	struct crypto_shash *poly1305 = crypto_alloc_shash("poly1305", 0, 0);
+	void *buf = xmalloc(max);
+	u8 key[POLY1305_KEY_SIZE], digest[POLY1305_DIGEST_SIZE];
+	unsigned i, per_page;
+
+	if (IS_ERR(poly1305))
+		die("error allocating poly1305: %li", PTR_ERR(poly1305));
+
+	get_random_bytes(key, sizeof(key));
+	get_random_bytes(buf, max);
+
+	for (per_page = 0; per_page < 2; per_page++)
+		for (i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++) {
+			size_t size = bench_checksum_sizes[i], k;
+			u64 iters = max_t(u64, nr * 4096 / size, 1), j, start;
+			SHASH_DESC_ON_STACK(desc, poly1305);
+
+			desc->tfm = poly1305;
+
+			start = local_clock();
+			for (j = 0; j < iters; j++) {
+				crypto_shash_init(desc);
+				crypto_shash_update(desc, key, sizeof(key));
+
+				for (k = 0; k < size; k += per_page ? PAGE_SIZE : size)
+					crypto_shash_update(desc, buf + k,
+						min_t(size_t, size - k,
+						      per_page ? PAGE_SIZE : size));
+				crypto_shash_final(desc, digest);
+			}
+			bench_print_rate("poly1305",
+					 per_page ? "per-page" : "whole",
+					 size, iters * size, start);
+		}
+
+	crypto_free_shash(poly1305);
+	free(buf);
+}
+
+static struct bio *bench_bio(void *buf, size_t size)
+{
+	struct bio *bio = bio_kmalloc(GFP_KERNEL, DIV_ROUND_UP(size, PAGE_SIZE));
+
+	bch2_bio_map(bio, buf, size);
+	return bio;
+}
+
+/*
+ * Separate passes stream the data through memory five times when encrypting
+ * (copy, encrypt and checksum) and three times otherwise; fused, each chunk is
+ * read from the source and written to the destination once:
+ */
+static void bench_fused(u64 nr)
+{
+	static const unsigned types[] = {
+		BCH_CSUM_CRC32C,
+		BCH_CSUM_CHACHA20_POLY1305_128,
+	};
+	size_t max = bench_checksum_sizes[ARRAY_SIZE(bench_checksum_sizes) - 1];
+	/* just enough of a filesystem for the checksum code: */
+	struct bch_fs *c = xcalloc(1, sizeof(*c));
+	void *src_buf = xmalloc(max), *dst_buf = xmalloc(max);
+	struct nonce nonce = { 0 };
+	u8 key[CHACHA_KEY_SIZE];
+	unsigned i, t;
+
+	c->chacha20 = crypto_alloc_sync_skcipher("chacha20", 0, 0);
+	if (IS_ERR(c->chacha20))
+		die("error allocating chacha20: %li", PTR_ERR(c->chacha20));
+
+	c->poly1305 = crypto_alloc_shash("poly1305", 0, 0);
+	if (IS_ERR(c->poly1305))
+		die("error allocating poly1305: %li", PTR_ERR(c->poly1305));
+
+	get_random_bytes(key, sizeof(key));
+	if (crypto_skcipher_setkey(&c->chacha20->base, key, sizeof(key)))
+		die("error setting chacha20 key");
+	get_random_bytes(src_buf, max);
+
+	for (t = 0; t < ARRAY_SIZE(types); t++)
+		for (i = 0; i < ARRAY_SIZE(bench_checksum_sizes); i++) {
+			size_t size = bench_checksum_sizes[i];
+			u64 iters = max_t(u64, nr * 4096 / size, 1), j, start;
+			const char *name = bch2_csum_type_is_encryption(types[t])
+				? "chacha20/poly1305" : "crc32c";
+			struct bio *src, *dst;
+			struct bch_csum separate, fused;
+
+			if (size & 511)
+				continue;
+
+			src = bench_bio(src_buf, size);
+			dst = bench_bio(dst_buf, size);
+
+			start = local_clock();
+			for (j = 0; j < iters; j++) {
+				bio_copy_data(dst, src);
+				bch2_encrypt_bio(c, types[t], nonce, dst);
+				separate = bch2_checksum_bio(c, types[t], nonce, dst);
+			}
+			bench_print_rate(name, "separate", size,
+					 iters * size, start);
+
+			start = local_clock();
+			for (j = 0; j < iters; j++)
+				fused = bch2_encrypt_checksum_bio(c, types[t],
+							nonce, dst, src);
+			bench_print_rate(name, "fused", size,
+					 iters * size, start);
+
+			if (bch2_crc_cmp(separate, fused))
+				die("fused %s: wrong result", name);
+
+			bio_put(src);
+			bio_put(dst);
+		}
+
+	crypto_free_shash(c->poly1305);
+	crypto_free_sync_skcipher(c->chacha20);
+	free(dst_buf);
+	free(src_buf);
+	free(c);
+}
+
+#define BENCH_BKEYS		4096
+
+static const char * const bench_bkey_btrees[] = {
+	"extents",
+	"inodes",
+	"dirents",
+};
+
+static void bench_bkey_key(struct bkey *k, unsigned btree, unsigned i)
+{
+	bkey_init(k);
+
+	switch (btree) {
+	case 0:
+		/* a few files, written sequentially: */
+		k->p.inode	= 4096 + i / 1024;
+		k->p.offset	= (i % 1024 + 1) * 128;
+		k->size		= 128;
+		k->version.lo	= i;
+		break;
+	case 1:
+		k->p.inode	= get_random_u64() & U32_MAX;
+		break;
+	case 2:
+		/* offsets are 63 bit hashes: */
+		k->p.inode	= 4096 + i % 16;
+		k->p.offset	= get_random_u64() >> 1;
+		break;
+	}
+}
+
+/* Returns BENCH_BKEYS keys packed with the format bch2_bkey_format_done() picks: */
+static struct bkey_packed **bench_bkeys(unsigned btree, struct bkey_format *f)
+{
+	struct bkey *keys = xcalloc(BENCH_BKEYS, sizeof(*keys));
+	struct bkey_packed **packed = xcalloc(BENCH_BKEYS, sizeof(*packed));
+	struct bkey_format_state s;
+	unsigned i;
+
+	bch2_bkey_format_init(&s);
+	for (i = 0; i < BENCH_BKEYS; i++) {
+		bench_bkey_key(&keys[i], btree, i);
+		bch2_bkey_format_add_key(&s, &keys[i]);
+	}
+	*f = bch2_bkey_format_done(&s);
+
+	for (i = 0; i < BENCH_BKEYS; i++) {
+		packed[i] = xmalloc(sizeof(struct bkey));
+		if (!bch2_bkey_pack_key(packed[i], &keys[i], f))
+			die("error packing key");
+	}
+
+	free(keys);
+	return packed;
+}
+
+static void bench_bkeys_free(struct bkey_packed **packed)
+{
+	unsigned i;
+
+	for (i = 0; i < BENCH_BKEYS; i++)
+		free(packed[i]);
+	free(packed);
+}
+
+static void bench_print_ops(const char *test, const char *btree,
+			    const char *impl, u64 nr, u64 start)
+{
+	u64 time = max_t(u64, local_clock() - start, 1);
+
+	printf("%s %-8s %-8s: %8llu Mops/s\n", test, btree, impl,
+	       div64_u64(nr * 1000, time));
+}
+
+static void bench_bkey_unpack(u64 nr)
+{
+	const struct bkey_unpack_impl *impl;
+	struct bkey_packed **packed;
+	struct bkey_format f;
+	struct bkey k, ref;
+	unsigned btree;
+	u64 j, start;
+
+	for (btree = 0; btree < ARRAY_SIZE(bench_bkey_btrees); btree++) {
+		packed = bench_bkeys(btree, &f);
+
+		for (impl = bch2_bkey_unpack_impls; impl->name; impl++) {
+			if (impl->supported && !impl->supported()) {
+				printf("bkey_unpack %-8s not supported\n", impl->name);
+				continue;
+			}
+
+			for (j = 0; j < BENCH_BKEYS; j++) {
+				k = impl->fn(&f, packed[j]);
+				ref = bch2_bkey_unpack_impls[0].fn(&f, packed[j]);
+				if (memcmp(&k, &ref, sizeof(k)))
+					die("bkey_unpack %s: wrong result",
+					    impl->name);
+			}
+
+			start = local_clock();
+			for (j = 0; j < nr; j++)
+				k = impl->fn(&f, packed[j % BENCH_BKEYS]);
+			bench_print_ops("bkey_unpack", bench_bkey_btrees[btree],
+					impl->name, nr, start);
+		}
+#ifdef HAVE_BCACHEFS_COMPILED_UNPACK
+		{
+			compiled_unpack_fn unpack_fn =
+				__vmalloc(PAGE_SIZE, GFP_KERNEL, PAGE_KERNEL_EXEC);
+
+			if (!unpack_fn)
+				die("error allocating executable memory");
+			bch2_compile_bkey_format(&f, unpack_fn);
+
+			start = local_clock();
+			for (j = 0; j < nr; j++)
+				unpack_fn(&k, packed[j % BENCH_BKEYS]);
+			bench_print_ops("bkey_unpack", bench_bkey_btrees[btree],
+					"jit", nr, start);
+			vfree(unpack_fn);
+		}
+#endif
+		bench_bkeys_free(packed);
+	}
+}
+
+static void bench_bkey_cmp(u64 nr)
+{
+	const struct bkey_cmp_impl *impl, *ref = bch2_bkey_cmp_impls;
+	struct bkey_packed **packed;
+	struct bkey_format f;
+	unsigned btree, nr_key_bits;
+	u64 j, start;
+
+	for (btree = 0; btree < ARRAY_SIZE(bench_bkey_btrees); btree++) {
+		packed = bench_bkeys(btree, &f);
+		nr_key_bits = bkey_format_key_bits(&f);
+
+#define bench_cmp(_impl, _j)						\
+	(_impl)->fn(high_word(&f, packed[(_j) % BENCH_BKEYS]),		\
+		    high_word(&f, packed[((_j) + 1) % BENCH_BKEYS]),	\
+		    nr_key_bits)
+
+		for (impl = bch2_bkey_cmp_impls; impl->name; impl++) {
+			if (impl->supported && !impl->supported()) {
+				printf("bkey_cmp %-8s not supported\n", impl->name);
+				continue;
+			}
+
+			for (j = 0; j < BENCH_BKEYS; j++)
+				if (bench_cmp(impl, j) != bench_cmp(ref, j))
+					die("bkey_cmp %s: wrong result", impl->name);
+
+			start = local_clock();
+			for (j = 0; j < nr; j++)
+				bench_cmp(impl, j);
+			bench_print_ops("bkey_cmp", bench_bkey_btrees[btree],
+					impl->name, nr, start);
+		}
+#undef bench_cmp
+		bench_bkeys_free(packed);
+	}
+}
+
+static void bench_lat_json(FILE *f, const char *name,
+			   struct btree_perf_test_lat *l, bool last)
+{
+	fprintf(f, "        \"%s\": { \"nr\": %llu, \"p50\": %llu, \"p99\": %llu, "
+		"\"p999\": %llu, \"max\": %llu }%s\n",
+		name, l->nr, l->p50, l->p99, l->p999, l->max,
+		last ? "" : ",");
+}
+
+static void bench_print_json(FILE *f, const char *test,
+			     struct btree_perf_test_result *r, bool last)
+{
+	u64 time = max_t(u64, r->time, 1);
+	unsigned i;
+
+	fprintf(f, "    {\n"
+		"      \"test\": \"%s\",\n"
+		"      \"nr\": %llu,\n"
+		"      \"threads\": %u,\n"
+		"      \"time_ns\": %llu,\n"
+		"      \"ops_per_sec\": %llu,\n"
+		"      \"latency_ns\": {\n"
+		"        \"p50\": %llu,\n"
+		"        \"p99\": %llu,\n"
+		"        \"p999\": %llu,\n"
+		"        \"max\": %llu\n"
+		"      },\n",
+		test, r->nr, r->nr_threads, r->time,
+		div64_u64(r->nr * NSEC_PER_SEC, time),
+		r->lat.p50, r->lat.p99, r->lat.p999, r->lat.max);
+
+	fprintf(f, "      \"ops\": {\n");
+	for (i = 0; i < BTREE_PERF_OP_NR; i++)
+		bench_lat_json(f, bch2_btree_perf_ops[i], &r->op[i],
+			       i + 1 == BTREE_PERF_OP_NR);
+	fprintf(f, "      },\n");
+
+	fprintf(f, "      \"phase_time_ns\": {\n");
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++)
+		fprintf(f, "        \"%s\": %llu%s\n",
+			bch2_btree_trans_phases[i], r->phase_time[i],
+			i + 1 == BTREE_TRANS_PHASE_NR ? "" : ",");
+	fprintf(f, "      },\n");
+
+	fprintf(f, "      \"phases\": {\n");
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++)
+		bench_lat_json(f, bch2_btree_trans_phases[i], &r->phase[i],
+			       i + 1 == BTREE_TRANS_PHASE_NR);
+	fprintf(f, "      }\n"
+		"    }%s\n", last ? "" : ",");
+}
+
+static void bench_print(const char *test, struct btree_perf_test_result *r)
+{
+	char buf[4096];
+	struct printbuf out = PBUF(buf);
+
+	bch2_btree_perf_test_to_text(&out, test, r);
+	bch2_btree_perf_test_lat_to_text(&out, r);
+	fputs(buf, stdout);
+}
+
+int cmd_bench(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "nr",			required_argument,	NULL, 'n' },
+		{ "threads",		required_argument,	NULL, 't' },
+		{ "device",		required_argument,	NULL, 'd' },
+		{ "size",		required_argument,	NULL, 's' },
+		{ "json",		required_argument,	NULL, 'j' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	const char * const *tests = bench_default_tests;
+	char *dev_path = NULL, *scratch = NULL, *json_path = NULL;
+	struct bch_fs *c = NULL;
+	FILE *json = NULL;
+	u64 nr = 100000, size = 4ULL << 30;
+	unsigned nr_threads = 1, i, nr_tests, nr_btree_tests = 0, nr_done = 0;
+	int opt, ret;
+
+	while ((opt = getopt_long(argc, argv, "n:t:d:s:j:h",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'n':
+			if (bch2_strtoull_h(optarg, &nr) || !nr)
+				die("invalid number of iterations");
+			break;
+		case 't':
+			if (kstrtouint(optarg, 10, &nr_threads) || !nr_threads)
+				die("invalid number of threads");
+			break;
+		case 'd':
+			dev_path = optarg;
+			break;
+		case 's':
+			if (bch2_strtoull_h(optarg, &size))
+				die("invalid image size");
+			break;
+		case 'j':
+			json_path = optarg;
+			break;
+		case 'h':
+			bench_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			exit(EXIT_FAILURE);
+		}
+	args_shift(optind);
+
+	if (argc)
+		tests = (const char * const *) argv;
+	for (nr_tests = 0; tests[nr_tests]; nr_tests++)
+		nr_btree_tests += !bench_is_standalone(tests[nr_tests]);
+
+	/*
+	 * Kernel messages go to stdout too, so JSON goes to its own file to
+	 * stay parseable:
+	 */
+	if (json_path) {
+		json = fopen(json_path, "w");
+		if (!json)
+			die("error opening %s: %m", json_path);
+	}
+
+	if (nr_btree_tests) {
+		if (!dev_path)
+			dev_path = scratch = bench_scratch_image(size);
+
+		c = bch2_fs_open(&dev_path, 1, bch2_opts_empty());
+		if (IS_ERR(c))
+			die("error opening %s: %s", dev_path, strerror(-PTR_ERR(c)));
+	}
+
+	if (json)
+		fprintf(json, "{\n  \"results\": [\n");
+
+	for (i = 0; i < nr_tests; i++) {
+		struct btree_perf_test_result r;
+
+		if (!strcmp(tests[i], "crc32c")) {
+			bench_crc32c(nr);
+			continue;
+		}
+		if (!strcmp(tests[i], "chacha20")) {
+			bench_chacha20(nr);
+			continue;
+		}
+		if (!strcmp(tests[i], "poly1305")) {
+			bench_poly1305(nr);
+			continue;
+		}
+		if (!strcmp(tests[i], "fused")) {
+			bench_fused(nr);
+			continue;
+		}
+		if (!strcmp(tests[i], "bkey_unpack")) {
+			bench_bkey_unpack(nr);
+			continue;
+		}
+		if (!strcmp(tests[i], "bkey_cmp")) {
+			bench_bkey_cmp(nr);
+			continue;
+		}
+
+		ret = bch2_btree_perf_test(c, tests[i], nr, nr_threads, &r);
+		if (ret)
+			die("error running %s: %s", tests[i], strerror(-ret));
+
+		bench_print(tests[i], &r);
+		if (json)
+			bench_print_json(json, tests[i], &r,
+					 ++nr_done == nr_btree_tests);
+	}
+
+	if (json) {
+		fprintf(json, "  ]\n}\n");
+		fclose(json);
+	}
+
+	if (c)
+		bch2_fs_stop(c);
+
+	if (scratch) {
+		unlink(scratch);
+		free(scratch);
+	}
+
+	return 0;
+}
@@ -0,0 +1,238 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <zdict.h>
+
+#include "cmds.h"
+#include "libbcachefs.h"
+
+#include "libbcachefs/bcachefs.h"
+#include "libbcachefs/btree_iter.h"
+#include "libbcachefs/compress.h"
+#include "libbcachefs/error.h"
+#include "libbcachefs/extents.h"
+#include "libbcachefs/super.h"
+#include "libbcachefs/super-io.h"
+
+static void train_dict_usage(void)
+{
+	puts("bcachefs train-dict - train a zstd dictionary for small extents\n"
+	     "Usage: bcachefs train-dict [OPTION]... <devices>\n"
+	     "\n"
+	     "Samples existing small extents, and stores a zstd dictionary trained\n"
+	     "from them in the superblock; extents written afterwards that are no\n"
+	     "bigger than 32k are compressed against it, when using zstd.\n"
+	     "\n"
+	     "The dictionary can't be changed once set, since existing data depends\n"
+	     "on it.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -s, --size=size             Dictionary size (default 16k, max 16k)\n"
+	     "  -m, --max-samples=size      Maximum amount of data to sample (default 8M)\n"
+	     "  -n, --dry-run               Train the dictionary, but don't store it\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+struct dict_samples {
+	char		*buf;
+	size_t		bytes;
+	size_t		max_bytes;
+
+	size_t		*sizes;
+	size_t		nr;
+	size_t		size;
+};
+
+static void dict_sample_add(struct dict_samples *s, size_t len)
+{
+	if (s->nr == s->size) {
+		s->size = max_t(size_t, s->size * 2, 1024);
+		s->sizes = realloc(s->sizes, s->size * sizeof(s->sizes[0]));
+		if (!s->sizes)
+			die("insufficient memory");
+	}
+
+	s->sizes[s->nr++] = len;
+	s->bytes += len;
+}
+
+static struct bio *bio_map_buf(void *buf, size_t len)
+{
+	/* buf needn't be page aligned: */
+	struct bio *bio = bio_kmalloc(GFP_KERNEL,
+				      DIV_ROUND_UP(len, PAGE_SIZE) + 1);
+
+	bch2_bio_map(bio, buf, len);
+	return bio;
+}
+
+/* Read the live part of an extent, decompressing it if necessary: */
+static bool dict_sample_read(struct bch_fs *c, struct extent_ptr_decoded p,
+			     void *dst)
+{
+	struct bch_dev *ca = bch_dev_bkey_exists(c, p.ptr.dev);
+	size_t live_bytes = p.crc.live_size << 9;
+	struct bio *src_bio, *dst_bio;
+	void *src;
+	bool ret;
+
+	if (!ca->disk_sb.bdev)
+		return false;
+
+	if (!p.crc.compression_type) {
+		xpread(ca->disk_sb.bdev->bd_fd, dst, live_bytes,
+		       (p.ptr.offset + p.crc.offset) << 9);
+		return true;
+	}
+
+	src = xmalloc(p.crc.compressed_size << 9);
+	xpread(ca->disk_sb.bdev->bd_fd, src,
+	       p.crc.compressed_size << 9, p.ptr.offset << 9);
+
+	src_bio = bio_map_buf(src, p.crc.compressed_size << 9);
+	dst_bio = bio_map_buf(dst, live_bytes);
+
+	ret = !bch2_bio_uncompress(c, src_bio, dst_bio, dst_bio->bi_iter, p.crc);
+
+	bio_put(dst_bio);
+	bio_put(src_bio);
+	free(src);
+	return ret;
+}
+
+static void dict_samples_get(struct bch_fs *c, struct dict_samples *s)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	s->buf = xmalloc(s->max_bytes + BCH_COMPRESSION_DICT_MAX_EXTENT);
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	for_each_btree_key(&trans, iter, BTREE_ID_EXTENTS, POS_MIN,
+			   BTREE_ITER_PREFETCH, k, ret) {
+		struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(k);
+		const union bch_extent_entry *entry;
+		struct extent_ptr_decoded p;
+
+		if (s->bytes >= s->max_bytes)
+			break;
+
+		if (k.k->type != KEY_TYPE_extent ||
+		    (k.k->size << 9) > BCH_COMPRESSION_DICT_MAX_EXTENT)
+			continue;
+
+		bkey_for_each_ptr_decode(k.k, ptrs, p, entry) {
+			if (p.ptr.cached ||
+			    bch2_csum_type_is_encryption(p.crc.csum_type))
+				continue;
+
+			if (dict_sample_read(c, p, s->buf + s->bytes))
+				dict_sample_add(s, p.crc.live_size << 9);
+			break;
+		}
+	}
+	ret = bch2_trans_exit(&trans) ?: ret;
+	if (ret)
+		die("error reading extents: %s", strerror(-ret));
+}
+
+int cmd_train_dict(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "size",		required_argument,	NULL, 's' },
+		{ "max-samples",	required_argument,	NULL, 'm' },
+		{ "dry-run",		no_argument,		NULL, 'n' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	struct bch_opts opts = bch2_opts_empty();
+	struct dict_samples samples = { .max_bytes = 8 << 20 };
+	size_t dict_size = BCH_COMPRESSION_DICT_MAX_SIZE;
+	bool dry_run = false;
+	struct bch_fs *c;
+	void *dict;
+	unsigned long long v;
+	size_t ret;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "s:m:nh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 's':
+			if (bch2_strtoull_h(optarg, &v) ||
+			    v > BCH_COMPRESSION_DICT_MAX_SIZE)
+				die("invalid dictionary size %s", optarg);
+			dict_size = v;
+			break;
+		case 'm':
+			if (bch2_strtoull_h(optarg, &v) || !v)
+				die("invalid sample size %s", optarg);
+			samples.max_bytes = v;
+			break;
+		case 'n':
+			dry_run = true;
+			break;
+		case 'h':
+			train_dict_usage();
+			exit(EXIT_SUCCESS);
+		}
+	args_shift(optind);
+
+	if (!argc)
+		die("Please supply device(s)");
+
+	opt_set(opts, nochanges,	true);
+	opt_set(opts, norecovery,	true);
+	opt_set(opts, degraded,		true);
+	opt_set(opts, errors,		BCH_ON_ERROR_CONTINUE);
+
+	c = bch2_fs_open(argv, argc, opts);
+	if (IS_ERR(c))
+		die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+
+	if (bch2_sb_get_compression_dict(c->disk_sb.sb))
+		die("Filesystem already has a compression dictionary");
+
+	dict_samples_get(c, &samples);
+	bch2_fs_stop(c);
+
+	printf("sampled %zu extents, %zu bytes\n", samples.nr, samples.bytes);
+
+	dict = xmalloc(dict_size);
+	ret = ZDICT_trainFromBuffer(dict, dict_size, samples.buf,
+				    samples.sizes, samples.nr);
+	if (ZDICT_isError(ret))
+		die("error training dictionary: %s", ZDICT_getErrorName(ret));
+	dict_size = ret;
+
+	printf("trained dictionary %u, %zu bytes\n",
+	       ZDICT_getDictID(dict, dict_size), dict_size);
+
+	if (!dry_run) {
+		int err;
+
+		opts = bch2_opts_empty();
+		opt_set(opts, nostart, true);
+
+		c = bch2_fs_open(argv, argc, opts);
+		if (IS_ERR(c))
+			die("error opening %s: %s", argv[0], strerror(-PTR_ERR(c)));
+
+		err = bch2_set_compression_dict(c, dict, dict_size);
+		if (err)
+			die("error storing dictionary: %s", strerror(-err));
+
+		bch2_fs_stop(c);
+	}
+
+	free(dict);
+	free(samples.sizes);
+	free(samples.buf);
+	return 0;
+}
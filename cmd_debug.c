@@ -164,7 +164,7 @@ static void list_keys(struct bch_fs *c, enum btree_id btree_id,
 	bch2_trans_init(&trans, c, 0, 0);
 
 	for_each_btree_key(&trans, iter, btree_id, start,
-			   BTREE_ITER_PREFETCH, k, ret) {
+			   BTREE_ITER_PREFETCH|BTREE_ITER_SCAN, k, ret) {
 		if (bkey_cmp(k.k->p, end) > 0)
 			break;
 
@@ -184,7 +184,8 @@ static void list_btree_formats(struct bch_fs *c, enum btree_id btree_id,
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_node(&trans, iter, btree_id, start, 0, b) {
+	for_each_btree_node(&trans, iter, btree_id, start,
+			    BTREE_ITER_SCAN, b) {
 		if (bkey_cmp(b->key.k.p, end) > 0)
 			break;
 
@@ -207,7 +208,8 @@ static void list_nodes_keys(struct bch_fs *c, enum btree_id btree_id,
 
 	bch2_trans_init(&trans, c, 0, 0);
 
-	for_each_btree_node(&trans, iter, btree_id, start, 0, b) {
+	for_each_btree_node(&trans, iter, btree_id, start,
+			    BTREE_ITER_SCAN, b) {
 		if (bkey_cmp(b->key.k.p, end) > 0)
 			break;
 
@@ -1,6 +1,7 @@
 #include <errno.h>
 #include <float.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <sys/statvfs.h>
 
@@ -13,6 +14,7 @@
 #include "libbcachefs/bcachefs.h"
 #include "libbcachefs/alloc_foreground.h"
 #include "libbcachefs/btree_iter.h"
+#include "libbcachefs/btree_update.h"
 #include "libbcachefs/buckets.h"
 #include "libbcachefs/dirent.h"
 #include "libbcachefs/error.h"
@@ -26,6 +28,9 @@
 #include "libbcachefs/fs.h"
 
 #include <linux/dcache.h>
+#include <linux/rhashtable.h>
+#include <linux/shrinker.h>
+#include <linux/sort.h>
 
 /* XXX cut and pasted from fsck.c */
 #define QSTR(n) { { { .len = strlen(n) } }, .name = n }
@@ -40,6 +45,422 @@ static inline u64 unmap_root_ino(u64 ino)
 	return ino == 4096 ? 1 : ino;
 }
 
+/*
+ * Page aligned IO buffers, for requests that can't be done in place: big
+ * enough for any request with the default max_read/max_write plus the
+ * partial blocks at either end. They're registered with the block layer (so
+ * io_uring can use them as fixed buffers) and thus never freed: a thread's
+ * buffers go back to bf_spare_bufs when it exits.
+ */
+#define BF_BUF_SIZE		(256U << 10)
+#define BF_BUFS_PER_THREAD	4
+#define BF_BUFS_MAX		64
+
+static DEFINE_MUTEX(bf_bufs_lock);
+static void *bf_spare_bufs[BF_BUFS_MAX];
+static unsigned bf_nr_spare_bufs;
+static unsigned bf_nr_bufs;
+
+/*
+ * Per thread state: with the multithreaded session loop each libfuse worker
+ * keeps its own btree_trans - and the iterators and memory it has grown - plus
+ * a pool of IO buffers, across requests.
+ *
+ * Only libfuse threads get one: IO completions and work items run on threads
+ * that have their own task_struct and lifetime, and use a local btree_trans.
+ */
+struct bf_thread {
+	struct btree_trans	trans;
+	/* trans was torn down by bcachefs_fuse_destroy(): */
+	bool			dead;
+	/* we allocated this thread's current, and must free it: */
+	bool			own_current;
+	unsigned		nr_bufs;
+	void			*bufs[BF_BUFS_PER_THREAD];
+	struct list_head	list;
+};
+
+static pthread_key_t bf_thread_key;
+static __thread struct bf_thread *bf_thread;
+static DEFINE_MUTEX(bf_threads_lock);
+static LIST_HEAD(bf_threads);
+
+/*
+ * Readahead is invalidated by any write that completes after it was issued;
+ * coarse, but cheap:
+ */
+static atomic64_t bf_write_seq;
+
+/* Called with bf_threads_lock held: */
+static void bf_thread_kill(struct bf_thread *t)
+{
+	if (t->dead)
+		return;
+
+	bch2_trans_exit(&t->trans);
+
+	mutex_lock(&bf_bufs_lock);
+	while (t->nr_bufs)
+		bf_spare_bufs[bf_nr_spare_bufs++] = t->bufs[--t->nr_bufs];
+	mutex_unlock(&bf_bufs_lock);
+
+	t->dead = true;
+}
+
+/* pthread key destructor, called when a libfuse worker exits: */
+static void bf_thread_exit(void *p)
+{
+	struct bf_thread *t = p;
+	bool own_current = t->own_current;
+
+	mutex_lock(&bf_threads_lock);
+	bf_thread_kill(t);
+	list_del(&t->list);
+	mutex_unlock(&bf_threads_lock);
+
+	free(t);
+
+	if (own_current)
+		sched_thread_exit();
+}
+
+static struct bf_thread *bf_thread_get(struct bch_fs *c)
+{
+	struct bf_thread *t = bf_thread;
+
+	if (likely(t))
+		return t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		die("malloc error");
+
+	t->own_current = !current;
+	sched_thread_init();
+
+	bch2_trans_init(&t->trans, c, 0, 0);
+
+	mutex_lock(&bf_threads_lock);
+	list_add(&t->list, &bf_threads);
+	mutex_unlock(&bf_threads_lock);
+
+	pthread_setspecific(bf_thread_key, t);
+	bf_thread = t;
+	return t;
+}
+
+static inline struct btree_trans *bf_trans(struct bch_fs *c)
+{
+	return &bf_thread_get(c)->trans;
+}
+
+static void *bf_buf_alloc(void)
+{
+	void *buf = NULL;
+
+	mutex_lock(&bf_bufs_lock);
+	if (bf_nr_spare_bufs) {
+		buf = bf_spare_bufs[--bf_nr_spare_bufs];
+	} else if (bf_nr_bufs < BF_BUFS_MAX) {
+		buf = aligned_alloc(PAGE_SIZE, BF_BUF_SIZE);
+		if (buf) {
+			struct iovec iov = {
+				.iov_base	= buf,
+				.iov_len	= BF_BUF_SIZE,
+			};
+
+			blkdev_register_buffers(&iov, 1);
+			bf_nr_bufs++;
+		}
+	}
+	mutex_unlock(&bf_bufs_lock);
+
+	return buf;
+}
+
+struct bf_buf {
+	void			*p;
+	bool			pooled;
+};
+
+/*
+ * Returns a page aligned buffer of at least @size bytes, from the current
+ * thread's pool if possible, else freshly allocated; release with
+ * bf_buf_put(). On allocation failure buf.p is NULL.
+ */
+static struct bf_buf bf_buf_get(struct bch_fs *c, size_t size)
+{
+	struct bf_thread *t = bf_thread;
+	struct bf_buf buf = { NULL };
+
+	if (size <= BF_BUF_SIZE) {
+		buf.p = t && t->nr_bufs
+			? t->bufs[--t->nr_bufs]
+			: bf_buf_alloc();
+		buf.pooled = buf.p != NULL;
+	}
+
+	if (!buf.p)
+		buf.p = aligned_alloc(PAGE_SIZE, round_up(size, PAGE_SIZE));
+	return buf;
+}
+
+/* May be called from IO completion context, i.e. not a libfuse thread: */
+static void bf_buf_put(struct bch_fs *c, struct bf_buf buf)
+{
+	struct bf_thread *t = bf_thread;
+
+	if (!buf.pooled) {
+		free(buf.p);
+	} else if (t && !t->dead && t->nr_bufs < ARRAY_SIZE(t->bufs)) {
+		t->bufs[t->nr_bufs++] = buf.p;
+	} else {
+		mutex_lock(&bf_bufs_lock);
+		bf_spare_bufs[bf_nr_spare_bufs++] = buf.p;
+		mutex_unlock(&bf_bufs_lock);
+	}
+}
+
+/*
+ * Like bch2_trans_do(), but runs @_do in the current thread's btree_trans;
+ * locks are dropped before returning so other threads aren't blocked between
+ * requests:
+ */
+#define bf_trans_do(_c, _flags, _do)					\
+({									\
+	struct btree_trans *trans = bf_trans(_c);			\
+	int _ret;							\
+									\
+	do {								\
+		bch2_trans_begin(trans);				\
+									\
+		_ret = (_do) ?:	bch2_trans_commit(trans, NULL,		\
+						  NULL, (_flags));	\
+	} while (_ret == -EINTR);					\
+									\
+	bch2_trans_unlock(trans);					\
+	_ret;								\
+})
+
+/*
+ * Inode cache:
+ *
+ * Every request starts by looking up an inode; unpacked inodes are cached
+ * here, keyed by inum, so that stat() heavy workloads don't have to go to the
+ * btree each time. Entries are dropped by everything in this file that writes
+ * inodes - data writes included, since they update i_size and i_sectors - and
+ * trimmed in LRU order by a shrinker.
+ *
+ * Fills race with invalidations: icache.seq is bumped on every invalidation,
+ * and a fill only goes in if no invalidation happened since its btree lookup
+ * started.
+ */
+
+#define BF_ICACHE_MAX		(1U << 16)
+
+struct bf_inode {
+	struct rhash_head	hash;
+	u64			inum;
+	struct list_head	lru;
+	struct bch_inode_unpacked inode;
+};
+
+static const struct rhashtable_params bf_icache_params = {
+	.head_offset	= offsetof(struct bf_inode, hash),
+	.key_offset	= offsetof(struct bf_inode, inum),
+	.key_len	= sizeof(u64),
+};
+
+static struct {
+	struct rhashtable	table;
+	struct mutex		lock;
+	struct list_head	lru;
+	unsigned		nr;
+	u64			seq;
+	struct shrinker		shrink;
+} icache = {
+	.lock	= { .lock = PTHREAD_MUTEX_INITIALIZER },
+	.lru	= LIST_HEAD_INIT(icache.lru),
+};
+
+/* Called with icache.lock held: */
+static void bf_icache_free(struct bf_inode *i)
+{
+	rhashtable_remove_fast(&icache.table, &i->hash, bf_icache_params);
+	list_del(&i->lru);
+	icache.nr--;
+	free(i);
+}
+
+static bool bf_icache_lookup(u64 inum, struct bch_inode_unpacked *bi)
+{
+	struct bf_inode *i;
+
+	mutex_lock(&icache.lock);
+	i = rhashtable_lookup_fast(&icache.table, &inum, bf_icache_params);
+	if (i) {
+		list_move(&i->lru, &icache.lru);
+		*bi = i->inode;
+	}
+	mutex_unlock(&icache.lock);
+
+	return i != NULL;
+}
+
+static void bf_icache_insert(const struct bch_inode_unpacked *bi, u64 seq)
+{
+	struct bf_inode *i = malloc(sizeof(*i)), *old;
+
+	if (!i)
+		return;
+
+	i->inum		= bi->bi_inum;
+	i->inode	= *bi;
+
+	mutex_lock(&icache.lock);
+	if (seq != icache.seq)
+		goto free;
+
+	old = rhashtable_lookup_fast(&icache.table, &i->inum, bf_icache_params);
+	if (old)
+		bf_icache_free(old);
+
+	if (rhashtable_lookup_insert_fast(&icache.table, &i->hash,
+					  bf_icache_params))
+		goto free;
+
+	list_add(&i->lru, &icache.lru);
+	icache.nr++;
+
+	while (icache.nr > BF_ICACHE_MAX)
+		bf_icache_free(list_last_entry(&icache.lru,
+					       struct bf_inode, lru));
+	mutex_unlock(&icache.lock);
+	return;
+free:
+	mutex_unlock(&icache.lock);
+	free(i);
+}
+
+/* Sample before a btree lookup, for bf_icache_insert(): */
+static u64 bf_icache_seq(void)
+{
+	u64 seq;
+
+	mutex_lock(&icache.lock);
+	seq = icache.seq;
+	mutex_unlock(&icache.lock);
+
+	return seq;
+}
+
+static void bf_icache_invalidate(u64 inum)
+{
+	struct bf_inode *i;
+
+	mutex_lock(&icache.lock);
+	icache.seq++;
+	i = rhashtable_lookup_fast(&icache.table, &inum, bf_icache_params);
+	if (i)
+		bf_icache_free(i);
+	mutex_unlock(&icache.lock);
+}
+
+static unsigned long bf_icache_count(struct shrinker *shrink,
+				     struct shrink_control *sc)
+{
+	return icache.nr;
+}
+
+static unsigned long bf_icache_scan(struct shrinker *shrink,
+				    struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+
+	/* we may be called from an allocation with icache.lock held: */
+	if (!mutex_trylock(&icache.lock))
+		return SHRINK_STOP;
+
+	while (freed < sc->nr_to_scan && !list_empty(&icache.lru)) {
+		bf_icache_free(list_last_entry(&icache.lru,
+					       struct bf_inode, lru));
+		freed++;
+	}
+	mutex_unlock(&icache.lock);
+
+	return freed;
+}
+
+static int bf_icache_init(void)
+{
+	int ret = rhashtable_init(&icache.table, &bf_icache_params);
+	if (ret)
+		return ret;
+
+	icache.shrink.count_objects	= bf_icache_count;
+	icache.shrink.scan_objects	= bf_icache_scan;
+	icache.shrink.seeks		= 1;
+	return register_shrinker(&icache.shrink);
+}
+
+static void bf_icache_exit(void)
+{
+	unregister_shrinker(&icache.shrink);
+
+	mutex_lock(&icache.lock);
+	while (!list_empty(&icache.lru))
+		bf_icache_free(list_first_entry(&icache.lru,
+						struct bf_inode, lru));
+	mutex_unlock(&icache.lock);
+
+	rhashtable_destroy(&icache.table);
+}
+
+static int bf_inode_find(struct bch_fs *c, u64 inum,
+			 struct bch_inode_unpacked *bi)
+{
+	u64 seq;
+	int ret;
+
+	/* the cache uses rcu, so this thread must be registered: */
+	bf_thread_get(c);
+
+	if (bf_icache_lookup(inum, bi))
+		return 0;
+
+	seq = bf_icache_seq();
+
+	ret = bf_trans_do(c, 0,
+		bch2_inode_find_by_inum_trans(trans, inum, bi));
+	if (!ret)
+		bf_icache_insert(bi, seq);
+	return ret;
+}
+
+static int bf_dirent_lookup_trans(struct btree_trans *trans, u64 dir,
+				  const struct bch_hash_info *hash_info,
+				  const struct qstr *name, u64 *inum)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	int ret;
+
+	*inum = 0;
+
+	iter = __bch2_dirent_lookup_trans(trans, dir, hash_info, name, 0);
+	ret = PTR_ERR_OR_ZERO(iter);
+	if (ret)
+		return ret == -ENOENT ? 0 : ret;
+
+	k = bch2_btree_iter_peek_slot(iter);
+	ret = bkey_err(k);
+	if (!ret)
+		*inum = le64_to_cpu(bkey_s_c_to_dirent(k).v->d_inum);
+
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
 static struct stat inode_to_stat(struct bch_fs *c,
 				 struct bch_inode_unpacked *bi)
 {
@@ -79,13 +500,34 @@ static void bcachefs_fuse_init(void *arg, struct fuse_conn_info *conn)
 	} else
 		fuse_log(FUSE_LOG_DEBUG, "fuse_init: writeback not capable\n");
 
+	/*
+	 * Reads are replied to with fuse_reply_data(), writes come in through
+	 * write_buf: let libfuse use splice for both if the kernel supports it
+	 */
+	if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+		conn->want |= FUSE_CAP_SPLICE_WRITE;
+	if (conn->capable & FUSE_CAP_SPLICE_READ)
+		conn->want |= FUSE_CAP_SPLICE_READ;
+
 	//conn->want |= FUSE_CAP_POSIX_ACL;
 }
 
 static void bcachefs_fuse_destroy(void *arg)
 {
 	struct bch_fs *c = arg;
+	struct bf_thread *t;
+
+	/*
+	 * Transactions must be torn down before the filesystem is - but other
+	 * threads may still point to their bf_thread, so it's only freed by
+	 * that thread's destructor:
+	 */
+	mutex_lock(&bf_threads_lock);
+	list_for_each_entry(t, &bf_threads, list)
+		bf_thread_kill(t);
+	mutex_unlock(&bf_threads_lock);
 
+	bf_icache_exit();
 	bch2_fs_stop(c);
 }
 
@@ -103,7 +545,7 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	ret = bf_inode_find(c, dir, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
@@ -111,7 +553,11 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 
 	struct bch_hash_info hash_info = bch2_hash_info_init(c, &bi);
 
-	inum = bch2_dirent_lookup(c, dir, &hash_info, &qstr);
+	ret = bf_trans_do(c, 0,
+		bf_dirent_lookup_trans(trans, dir, &hash_info, &qstr, &inum));
+	if (ret)
+		goto err;
+
 	if (!inum) {
 		struct fuse_entry_param e = {
 			.attr_timeout	= DBL_MAX,
@@ -121,7 +567,7 @@ static void bcachefs_fuse_lookup(fuse_req_t req, fuse_ino_t dir,
 		return;
 	}
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret = bf_inode_find(c, inum, &bi);
 	if (ret)
 		goto err;
 
@@ -149,7 +595,7 @@ static void bcachefs_fuse_getattr(fuse_req_t req, fuse_ino_t inum,
 
 	inum = map_root_ino(inum);
 
-	ret = bch2_inode_find_by_inum(c, inum, &bi);
+	ret = bf_inode_find(c, inum, &bi);
 	if (ret) {
 		fuse_log(FUSE_LOG_DEBUG, "fuse_getattr error %i\n", ret);
 		fuse_reply_err(req, -ret);
@@ -168,7 +614,7 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 {
 	struct bch_fs *c = fuse_req_userdata(req);
 	struct bch_inode_unpacked inode_u;
-	struct btree_trans trans;
+	struct btree_trans *trans = bf_trans(c);
 	struct btree_iter *iter;
 	u64 now;
 	int ret;
@@ -177,13 +623,11 @@ static void bcachefs_fuse_setattr(fuse_req_t req, fuse_ino_t inum,
 		 inum, to_set);
 
 	inum = map_root_ino(inum);
-
-	bch2_trans_init(&trans, c, 0, 0);
 retry:
-	bch2_trans_begin(&trans);
+	bch2_trans_begin(trans);
 	now = bch2_current_time(c);
 
-	iter = bch2_inode_peek(&trans, &inode_u, inum, BTREE_ITER_INTENT);
+	iter = bch2_inode_peek(trans, &inode_u, inum, BTREE_ITER_INTENT);
 	ret = PTR_ERR_OR_ZERO(iter);
 	if (ret)
 		goto err;
@@ -206,15 +650,20 @@ retry:
 		inode_u.bi_mtime = now;
 	/* TODO: CTIME? */
 
-	ret   = bch2_inode_write(&trans, iter, &inode_u) ?:
-		bch2_trans_commit(&trans, NULL, NULL,
+	ret   = bch2_inode_write(trans, iter, &inode_u) ?:
+		bch2_trans_commit(trans, NULL, NULL,
 				  BTREE_INSERT_ATOMIC|
 				  BTREE_INSERT_NOFAIL);
 err:
 	if (ret == -EINTR)
 		goto retry;
 
-	bch2_trans_exit(&trans);
+	bch2_trans_unlock(trans);
+
+	bf_icache_invalidate(inum);
+
+	if (to_set & FUSE_SET_ATTR_SIZE)
+		atomic64_inc(&bf_write_seq);
 
 	if (!ret) {
 		*attr = inode_to_stat(c, &inode_u);
@@ -230,16 +679,20 @@ static int do_create(struct bch_fs *c, u64 dir,
 {
 	struct qstr qstr = QSTR(name);
 	struct bch_inode_unpacked dir_u;
+	int ret;
 
 	dir = map_root_ino(dir);
 
 	bch2_inode_init_early(c, new_inode);
 
-	return bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
-			bch2_create_trans(&trans,
+	ret = bf_trans_do(c, BTREE_INSERT_ATOMIC,
+			bch2_create_trans(trans,
 				dir, &dir_u,
 				new_inode, &qstr,
 				0, 0, mode, rdev, NULL, NULL));
+
+	bf_icache_invalidate(dir);
+	return ret;
 }
 
 static void bcachefs_fuse_mknod(fuse_req_t req, fuse_ino_t dir,
@@ -287,10 +740,14 @@ static void bcachefs_fuse_unlink(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC|BTREE_INSERT_NOFAIL,
-			    bch2_unlink_trans(&trans, dir, &dir_u,
+	ret = bf_trans_do(c, BTREE_INSERT_ATOMIC|BTREE_INSERT_NOFAIL,
+			  bch2_unlink_trans(trans, dir, &dir_u,
 					      &inode_u, &qstr));
 
+	bf_icache_invalidate(dir);
+	if (!ret)
+		bf_icache_invalidate(inode_u.bi_inum);
+
 	fuse_reply_err(req, -ret);
 }
 
@@ -324,14 +781,19 @@ static void bcachefs_fuse_rename(fuse_req_t req,
 	dst_dir = map_root_ino(dst_dir);
 
 	/* XXX handle overwrites */
-	ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
-		bch2_rename_trans(&trans,
+	ret = bf_trans_do(c, BTREE_INSERT_ATOMIC,
+		bch2_rename_trans(trans,
 				  src_dir, &src_dir_u,
 				  dst_dir, &dst_dir_u,
 				  &src_inode_u, &dst_inode_u,
 				  &src_name, &dst_name,
 				  BCH_RENAME));
 
+	bf_icache_invalidate(src_dir);
+	bf_icache_invalidate(dst_dir);
+	if (!ret)
+		bf_icache_invalidate(src_inode_u.bi_inum);
+
 	fuse_reply_err(req, -ret);
 }
 
@@ -348,10 +810,12 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 
 	newparent = map_root_ino(newparent);
 
-	ret = bch2_trans_do(c, NULL, BTREE_INSERT_ATOMIC,
-			    bch2_link_trans(&trans, newparent,
+	ret = bf_trans_do(c, BTREE_INSERT_ATOMIC,
+			  bch2_link_trans(trans, newparent,
 					    inum, &inode_u, &qstr));
 
+	bf_icache_invalidate(inum);
+
 	if (!ret) {
 		struct fuse_entry_param e = inode_to_entry(c, &inode_u);
 		fuse_reply_entry(req, &e);
@@ -360,16 +824,6 @@ static void bcachefs_fuse_link(fuse_req_t req, fuse_ino_t inum,
 	}
 }
 
-static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
-			       struct fuse_file_info *fi)
-{
-	fi->direct_io		= false;
-	fi->keep_cache		= true;
-	fi->cache_readdir	= true;
-
-	fuse_reply_open(req, fi);
-}
-
 static void userbio_init(struct bio *bio, struct bio_vec *bv,
 			 void *buf, size_t size)
 {
@@ -384,7 +838,7 @@ static int get_inode_io_opts(struct bch_fs *c, u64 inum,
 			     struct bch_io_opts *opts)
 {
 	struct bch_inode_unpacked inode;
-	if (bch2_inode_find_by_inum(c, inum, &inode))
+	if (bf_inode_find(c, inum, &inode))
 		return -EINVAL;
 
 	*opts = bch2_opts_to_inode_opts(c->opts);
@@ -459,7 +913,7 @@ static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 	struct bch_read_bio rbio;
 	struct bio_vec bv;
 	userbio_init(&rbio.bio, &bv, buf, aligned_size);
-	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, REQ_SYNC);
+	bio_set_op_attrs(&rbio.bio, REQ_OP_READ, 0);
 	rbio.bio.bi_iter.bi_sector	= aligned_offset >> 9;
 
 	struct closure cl;
@@ -469,11 +923,368 @@ static int read_aligned(struct bch_fs *c, fuse_ino_t inum, size_t aligned_size,
 	rbio.bio.bi_end_io		= bcachefs_fuse_read_endio;
 	rbio.bio.bi_private		= &cl;
 
+	/* reads spanning several extents get submitted as one batch: */
+	struct blk_plug plug;
+	blk_start_plug(&plug);
 	bch2_read(c, rbio_init(&rbio.bio, io_opts), inum);
+	blk_finish_plug(&plug);
+
+	closure_sync(&cl);
+
+	return blk_status_to_errno(rbio.bio.bi_status);
+}
+
+/*
+ * Asynchronous reads:
+ *
+ * Reads are submitted from the libfuse thread and replied to from the bio
+ * completion, so one thread can keep many reads in flight. Open files also do
+ * readahead: when reads are sequential, the next BF_RA_SLOTS windows are read
+ * before they're asked for, and later requests that land in a readahead window
+ * are answered from it - or queued on it, if it's still in flight.
+ */
+
+#define BF_RA_SLOTS		2
+#define BF_RA_MAX_WAITING	8
+
+struct bf_file;
+
+struct bf_read_waiter {
+	fuse_req_t		req;
+	off_t			offset;
+	size_t			size;
+};
+
+struct bf_read {
+	struct bch_fs		*c;
+	struct bf_file		*f;		/* only set for readahead */
+	fuse_req_t		req;		/* NULL for readahead */
+	u64			inum;
+	struct bch_io_opts	io_opts;
+	off_t			start;		/* aligned */
+	size_t			aligned_size;
+	size_t			pad_start;
+	size_t			size;
+	u64			write_seq;
+	struct bf_buf		buf;
+	struct work_struct	work;
+
+	/* readahead: */
+	bool			done;
+	int			err;
+	unsigned		nr_waiting;
+	struct bf_read_waiter	waiting[BF_RA_MAX_WAITING];
+
+	struct bio_vec		bv;
+	/* Must be last: */
+	struct bch_read_bio	rbio;
+};
+
+/* Per open file handle, in fi->fh: */
+struct bf_file {
+	struct mutex		lock;
+	unsigned		ref;
+	u64			inum;
+	off_t			next_offset;
+	size_t			ra_size;
+	struct bf_read		*ra[BF_RA_SLOTS];
+};
+
+static void bf_read_submit(struct bf_read *);
+
+static void bf_read_free(struct bf_read *rd)
+{
+	bf_buf_put(rd->c, rd->buf);
+	free(rd);
+}
+
+static void bf_file_put(struct bf_file *f)
+{
+	unsigned i;
+
+	if (--f->ref) {
+		mutex_unlock(&f->lock);
+		return;
+	}
+
+	mutex_unlock(&f->lock);
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++)
+		if (f->ra[i])
+			bf_read_free(f->ra[i]);
+	free(f);
+}
+
+static void bf_reply_data(fuse_req_t req, void *buf, size_t size)
+{
+	/*
+	 * With FUSE_CAP_SPLICE_WRITE libfuse vmsplice()s this straight to the
+	 * fuse device instead of copying it into its own buffer; the pipe has
+	 * been drained by the time this returns, so the buffer can be reused:
+	 */
+	struct fuse_bufvec data = FUSE_BUFVEC_INIT(size);
+
+	data.buf[0].mem = buf;
+	fuse_reply_data(req, &data, 0);
+}
+
+static struct bf_read *bf_read_alloc(struct bch_fs *c, u64 inum,
+				     struct bch_io_opts io_opts,
+				     off_t offset, size_t size)
+{
+	struct fuse_align_io align = align_io(c, size, offset);
+	struct bf_read *rd = calloc(1, sizeof(*rd));
+
+	if (!rd)
+		return NULL;
+
+	rd->c		= c;
+	rd->inum	= inum;
+	rd->io_opts	= io_opts;
+	rd->start	= align.start;
+	rd->aligned_size = align.size;
+	rd->pad_start	= align.pad_start;
+	rd->size	= size;
+	rd->write_seq	= atomic64_read(&bf_write_seq);
+	rd->buf		= bf_buf_get(c, align.size);
+	if (!rd->buf.p) {
+		free(rd);
+		return NULL;
+	}
+
+	return rd;
+}
+
+/*
+ * Called from the completion of a readahead read that can't satisfy its
+ * waiters (error, or raced with a write): they're resubmitted as normal reads
+ * from process context, since bch2_read() may block on btree node reads that
+ * need the IO completion thread.
+ */
+static void bf_read_resubmit_work(struct work_struct *work)
+{
+	struct bf_read *rd = container_of(work, struct bf_read, work);
+
+	bf_read_submit(rd);
+}
+
+static void bf_read_waiter_resubmit(struct bf_read *ra,
+				    struct bf_read_waiter *w)
+{
+	struct bf_read *rd = bf_read_alloc(ra->c, ra->inum, ra->io_opts,
+					   w->offset, w->size);
+
+	if (!rd) {
+		fuse_reply_err(w->req, ENOMEM);
+		return;
+	}
+
+	rd->req = w->req;
+	INIT_WORK(&rd->work, bf_read_resubmit_work);
+	queue_work(system_wq, &rd->work);
+}
+
+static void bf_readahead_done(struct bf_read *ra)
+{
+	struct bf_file *f = ra->f;
+	bool valid = !ra->err &&
+		ra->write_seq == atomic64_read(&bf_write_seq);
+	unsigned i;
+
+	mutex_lock(&f->lock);
+	ra->done = true;
+
+	for (i = 0; i < ra->nr_waiting; i++) {
+		struct bf_read_waiter *w = &ra->waiting[i];
+
+		if (valid)
+			bf_reply_data(w->req, ra->buf.p +
+				      (w->offset - ra->start), w->size);
+		else
+			bf_read_waiter_resubmit(ra, w);
+	}
+	ra->nr_waiting = 0;
+
+	bf_file_put(f);
+}
+
+static void bf_read_endio(struct bio *bio)
+{
+	struct bf_read *rd = container_of(bio, struct bf_read, rbio.bio);
+	int ret = blk_status_to_errno(bio->bi_status);
+
+	if (!rd->req) {
+		rd->err = ret;
+		bf_readahead_done(rd);
+		return;
+	}
+
+	if (!ret)
+		bf_reply_data(rd->req, rd->buf.p + rd->pad_start, rd->size);
+	else
+		fuse_reply_err(rd->req, -ret);
+
+	bf_read_free(rd);
+}
+
+static void bf_read_submit(struct bf_read *rd)
+{
+	struct bio *bio = &rd->rbio.bio;
+	struct blk_plug plug;
+
+	userbio_init(bio, &rd->bv, rd->buf.p, rd->aligned_size);
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+	bio->bi_iter.bi_sector	= rd->start >> 9;
+	bio->bi_end_io		= bf_read_endio;
+
+	/* reads spanning several extents get submitted as one batch: */
+	blk_start_plug(&plug);
+	bch2_read(rd->c, rbio_init(bio, rd->io_opts), rd->inum);
+	blk_finish_plug(&plug);
+}
+
+/*
+ * Try to answer a read from readahead; returns true if the request was
+ * answered or queued. Called with f->lock held.
+ */
+static bool bf_readahead_lookup(struct bf_file *f, fuse_req_t req,
+				off_t offset, size_t size)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++) {
+		struct bf_read *ra = f->ra[i];
+
+		if (!ra ||
+		    offset < ra->start ||
+		    offset + size > ra->start + ra->aligned_size)
+			continue;
+
+		if (!ra->done) {
+			if (ra->nr_waiting == ARRAY_SIZE(ra->waiting))
+				return false;
+
+			ra->waiting[ra->nr_waiting++] = (struct bf_read_waiter) {
+				.req	= req,
+				.offset	= offset,
+				.size	= size,
+			};
+			return true;
+		}
+
+		if (ra->err ||
+		    ra->write_seq != atomic64_read(&bf_write_seq)) {
+			f->ra[i] = NULL;
+			bf_read_free(ra);
+			return false;
+		}
+
+		bf_reply_data(req, ra->buf.p + (offset - ra->start), size);
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * Called with f->lock held; new readahead reads are returned in @issue, to be
+ * submitted after dropping the lock - bch2_read() can block on btree node
+ * reads, whose completion may be stuck behind a readahead completion waiting
+ * on f->lock:
+ */
+static unsigned bf_readahead(struct bch_fs *c, struct bf_file *f,
+			     struct bch_io_opts io_opts, u64 i_size,
+			     off_t offset, size_t size,
+			     struct bf_read **issue)
+{
+	unsigned nr = 0;
+
+	off_t ra_start = round_up(offset + size, block_bytes(c));
+	unsigned i;
+
+	/* Drop completed windows we've read past: */
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++) {
+		struct bf_read *ra = f->ra[i];
+
+		if (ra && ra->done &&
+		    ra->start + ra->aligned_size <= offset) {
+			f->ra[i] = NULL;
+			bf_read_free(ra);
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++)
+		if (f->ra[i])
+			ra_start = max_t(off_t, ra_start, f->ra[i]->start +
+					 f->ra[i]->aligned_size);
+
+	f->ra_size = min_t(size_t, BF_BUF_SIZE,
+			   max_t(size_t, f->ra_size * 2,
+				 round_up(size, block_bytes(c)) * 2));
+
+	for (i = 0; i < ARRAY_SIZE(f->ra); i++) {
+		struct bf_read *ra;
+
+		if (f->ra[i])
+			continue;
+
+		if (ra_start >= i_size)
+			break;
+
+		ra = bf_read_alloc(c, f->inum, io_opts, ra_start,
+				   min_t(u64, f->ra_size, i_size - ra_start));
+		if (!ra)
+			break;
+
+		ra->f = f;
+		f->ref++;
+		f->ra[i] = ra;
+		ra_start += ra->aligned_size;
+
+		issue[nr++] = ra;
+	}
+
+	return nr;
+}
+
+static struct bf_file *bf_file_alloc(u64 inum)
+{
+	struct bf_file *f = calloc(1, sizeof(*f));
+
+	if (f) {
+		mutex_init(&f->lock);
+		f->ref	= 1;
+		f->inum	= inum;
+	}
+
+	return f;
+}
+
+static void bcachefs_fuse_open(fuse_req_t req, fuse_ino_t inum,
+			       struct fuse_file_info *fi)
+{
+	fi->direct_io		= false;
+	fi->keep_cache		= true;
+	fi->cache_readdir	= true;
+
+	/* readahead state; reads work without it, so failure isn't fatal: */
+	fi->fh = (unsigned long) bf_file_alloc(inum);
+
+	fuse_reply_open(req, fi);
+}
+
+static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
+				  struct fuse_file_info *fi)
+{
+	struct bf_file *f = (void *) (unsigned long) fi->fh;
 
-	closure_sync(&cl);
+	/* readahead in flight holds refs, and frees it on completion: */
+	if (f) {
+		mutex_lock(&f->lock);
+		bf_file_put(f);
+	}
 
-	return -blk_status_to_errno(rbio.bio.bi_status);
+	fuse_reply_err(req, 0);
 }
 
 static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
@@ -481,13 +1292,16 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 			       struct fuse_file_info *fi)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
+	struct bf_file *f = (void *) (unsigned long) fi->fh;
+	struct bch_io_opts io_opts;
+	struct bf_read *rd;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_read(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	/* Check inode size. */
 	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_inode_find(c, inum, &bi);
 	if (ret) {
 		fuse_reply_err(req, -ret);
 		return;
@@ -500,38 +1314,56 @@ static void bcachefs_fuse_read(fuse_req_t req, fuse_ino_t inum,
 	}
 	size = end - offset;
 
-	struct fuse_align_io align = align_io(c, size, offset);
+	io_opts = bch2_opts_to_inode_opts(c->opts);
+	bch2_io_opts_apply(&io_opts, bch2_inode_opts_get(&bi));
+
+	if (f) {
+		struct bf_read *issue[BF_RA_SLOTS];
+		unsigned i, nr = 0;
+		bool sequential, done;
 
-	void *buf = aligned_alloc(PAGE_SIZE, align.size);
-	if (!buf) {
+		mutex_lock(&f->lock);
+		done = bf_readahead_lookup(f, req, offset, size);
+
+		sequential = offset == f->next_offset;
+		f->next_offset = offset + size;
+
+		if (sequential)
+			nr = bf_readahead(c, f, io_opts, bi.bi_size,
+					  offset, size, issue);
+		else
+			f->ra_size = 0;
+		mutex_unlock(&f->lock);
+
+		for (i = 0; i < nr; i++)
+			bf_read_submit(issue[i]);
+
+		if (done)
+			return;
+	}
+
+	rd = bf_read_alloc(c, inum, io_opts, offset, size);
+	if (!rd) {
 		fuse_reply_err(req, ENOMEM);
 		return;
 	}
 
-	ret = read_aligned(c, inum, align.size, align.start, buf);
-
-	if (likely(!ret))
-		fuse_reply_buf(req, buf + align.pad_start, size);
-	else
-		fuse_reply_err(req, -ret);
-
-	free(buf);
+	rd->req = req;
+	bf_read_submit(rd);
 }
 
-static int inode_update_times(struct bch_fs *c, fuse_ino_t inum)
+static int inode_update_times(struct btree_trans *trans, fuse_ino_t inum)
 {
-	struct btree_trans trans;
+	struct bch_fs *c = trans->c;
 	struct btree_iter *iter;
 	struct bch_inode_unpacked inode_u;
 	int ret = 0;
 	u64 now;
-
-	bch2_trans_init(&trans, c, 0, 0);
 retry:
-	bch2_trans_begin(&trans);
+	bch2_trans_begin(trans);
 	now = bch2_current_time(c);
 
-	iter = bch2_inode_peek(&trans, &inode_u, inum, BTREE_ITER_INTENT);
+	iter = bch2_inode_peek(trans, &inode_u, inum, BTREE_ITER_INTENT);
 	ret = PTR_ERR_OR_ZERO(iter);
 	if (ret)
 		goto err;
@@ -539,21 +1371,51 @@ retry:
 	inode_u.bi_mtime = now;
 	inode_u.bi_ctime = now;
 
-	ret = bch2_inode_write(&trans, iter, &inode_u);
+	ret = bch2_inode_write(trans, iter, &inode_u);
 	if (ret)
 		goto err;
 
-	ret = bch2_trans_commit(&trans, NULL, NULL,
+	ret = bch2_trans_commit(trans, NULL, NULL,
 				BTREE_INSERT_ATOMIC|BTREE_INSERT_NOFAIL);
 
 err:
 	if (ret == -EINTR)
 		goto retry;
 
-	bch2_trans_exit(&trans);
+	bch2_trans_unlock(trans);
+
+	bf_icache_invalidate(inum);
 	return ret;
 }
 
+static int write_op_init(struct bch_fs *c, struct bch_write_op *op,
+			 struct bio_vec *bv, fuse_ino_t inum,
+			 struct bch_io_opts io_opts, void *buf,
+			 size_t aligned_size, off_t aligned_offset,
+			 off_t new_i_size)
+{
+	BUG_ON(aligned_size & (block_bytes(c) - 1));
+	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+
+	bch2_write_op_init(op, c, io_opts); /* XXX reads from op?! */
+	op->write_point	= writepoint_hashed(0);
+	op->nr_replicas	= io_opts.data_replicas;
+	op->target	= io_opts.foreground_target;
+	op->pos		= POS(inum, aligned_offset >> 9);
+	op->new_i_size	= new_i_size;
+
+	userbio_init(&op->wbio.bio, bv, buf, aligned_size);
+	bio_set_op_attrs(&op->wbio.bio, REQ_OP_WRITE, REQ_SYNC);
+
+	if (bch2_disk_reservation_get(c, &op->res, aligned_size >> 9,
+				      op->nr_replicas, 0)) {
+		/* XXX: use check_range_allocated like dio write path */
+		return -ENOSPC;
+	}
+
+	return 0;
+}
+
 static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 			 struct bch_io_opts io_opts, void *buf,
 			 size_t aligned_size, off_t aligned_offset,
@@ -562,61 +1424,159 @@ static int write_aligned(struct bch_fs *c, fuse_ino_t inum,
 	struct bch_write_op	op = { 0 };
 	struct bio_vec		bv;
 	struct closure		cl;
-
-	BUG_ON(aligned_size & (block_bytes(c) - 1));
-	BUG_ON(aligned_offset & (block_bytes(c) - 1));
+	int			ret;
 
 	*written_out = 0;
 
 	closure_init_stack(&cl);
 
-	bch2_write_op_init(&op, c, io_opts); /* XXX reads from op?! */
-	op.write_point	= writepoint_hashed(0);
-	op.nr_replicas	= io_opts.data_replicas;
-	op.target	= io_opts.foreground_target;
-	op.pos		= POS(inum, aligned_offset >> 9);
-	op.new_i_size	= new_i_size;
-
-	userbio_init(&op.wbio.bio, &bv, buf, aligned_size);
-	bio_set_op_attrs(&op.wbio.bio, REQ_OP_WRITE, REQ_SYNC);
-
-	if (bch2_disk_reservation_get(c, &op.res, aligned_size >> 9,
-				      op.nr_replicas, 0)) {
-		/* XXX: use check_range_allocated like dio write path */
-		return -ENOSPC;
-	}
+	ret = write_op_init(c, &op, &bv, inum, io_opts, buf,
+			    aligned_size, aligned_offset, new_i_size);
+	if (ret)
+		return ret;
 
 	closure_call(&op.cl, bch2_write, NULL, &cl);
 	closure_sync(&cl);
 
+	/* readahead issued before this point may have stale data: */
+	atomic64_inc(&bf_write_seq);
+
 	if (!op.error)
 		*written_out = op.written << 9;
 
 	return op.error;
 }
 
-static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
-				const char *buf, size_t size,
-				off_t offset,
-				struct fuse_file_info *fi)
+static void bf_write_reply(struct btree_trans *trans, fuse_req_t req,
+			   fuse_ino_t inum,
+			   const struct fuse_align_io *align, size_t size,
+			   size_t aligned_written, int ret)
+{
+	/* Figure out how many unaligned bytes were written. */
+	size_t written = align_fix_up_bytes(align, aligned_written);
+	BUG_ON(written > size);
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_buf: wrote %zd bytes\n",
+		 written);
+
+	if (written > 0)
+		ret = 0;
+
+	/* The write updated i_size and i_sectors, even if it failed partway: */
+	bf_icache_invalidate(inum);
+
+	/*
+	 * Update inode times.
+	 * TODO: Integrate with bch2_extent_update()
+	 */
+	if (!ret)
+		ret = inode_update_times(trans, inum);
+
+	if (!ret) {
+		BUG_ON(written == 0);
+		fuse_reply_write(req, written);
+	} else {
+		fuse_reply_err(req, -ret);
+	}
+}
+
+/*
+ * Writes from our own buffers are asynchronous: the request is answered from
+ * the write's completion, and the libfuse thread goes on to the next request.
+ */
+struct bf_write {
+	struct closure		cl;
+	struct bch_fs		*c;
+	fuse_req_t		req;
+	fuse_ino_t		inum;
+	struct fuse_align_io	align;
+	size_t			size;
+	struct bf_buf		buf;
+	struct bio_vec		bv;
+	/* Must be last: */
+	struct bch_write_op	op;
+};
+
+/* Runs out of system_wq, since updating the inode needs a btree_trans: */
+static void bf_write_done(struct closure *cl)
+{
+	struct bf_write *w = container_of(cl, struct bf_write, cl);
+	struct btree_trans trans;
+
+	atomic64_inc(&bf_write_seq);
+
+	bch2_trans_init(&trans, w->c, 0, 0);
+	bf_write_reply(&trans, w->req, w->inum, &w->align, w->size,
+		       !w->op.error ? w->op.written << 9 : 0,
+		       w->op.error);
+	bch2_trans_exit(&trans);
+
+	bf_buf_put(w->c, w->buf);
+	free(w);
+}
+
+/*
+ * A request that covers whole blocks, in one buffer that's suitably aligned for
+ * O_DIRECT, is written straight from libfuse's buffer:
+ */
+static bool write_buf_in_place(struct bch_fs *c, struct fuse_bufvec *bufv,
+			       const struct fuse_align_io *align)
+{
+	struct fuse_buf *b = &bufv->buf[bufv->idx];
+
+	return !align->pad_start &&
+		!align->pad_end &&
+		bufv->count - bufv->idx == 1 &&
+		!(b->flags & FUSE_BUF_IS_FD) &&
+		IS_ALIGNED((unsigned long) (b->mem + bufv->off),
+			   block_bytes(c));
+}
+
+static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
+				    struct fuse_bufvec *bufv, off_t offset,
+				    struct fuse_file_info *fi)
 {
 	struct bch_fs *c	= fuse_req_userdata(req);
 	struct bch_io_opts	io_opts;
+	struct bf_buf		buf = { NULL };
+	void			*aligned_buf;
+	size_t			size = fuse_buf_size(bufv);
 	size_t			aligned_written;
+	ssize_t			copied;
 	int			ret = 0;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write(%llu, %zd, %lld)\n",
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write_buf(%llu, %zd, %lld)\n",
 		 inum, size, offset);
 
 	struct fuse_align_io align = align_io(c, size, offset);
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
 
 	if (get_inode_io_opts(c, inum, &io_opts)) {
 		ret = -ENOENT;
 		goto err;
 	}
 
+	/*
+	 * libfuse reuses its buffer as soon as we return, so writes done in
+	 * place have to be synchronous:
+	 */
+	if (write_buf_in_place(c, bufv, &align)) {
+		aligned_buf = bufv->buf[bufv->idx].mem + bufv->off;
+
+		ret = write_aligned(c, inum, io_opts, aligned_buf,
+				    align.size, align.start,
+				    offset + size, &aligned_written);
+		bf_write_reply(bf_trans(c), req, inum, &align, size,
+			       aligned_written, ret);
+		return;
+	}
+
+	buf = bf_buf_get(c, align.size);
+	aligned_buf = buf.p;
+	if (!aligned_buf) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
 	/* Realign the data and read in start and end, if needed */
 
 	/* Read partial start data. */
@@ -646,41 +1606,50 @@ static void bcachefs_fuse_write(fuse_req_t req, fuse_ino_t inum,
 			goto err;
 	}
 
-	/* Overlay what we want to write. */
-	memcpy(aligned_buf + align.pad_start, buf, size);
-
-	/* Actually write. */
-	ret = write_aligned(c, inum, io_opts, aligned_buf,
-			    align.size, align.start,
-			    offset + size, &aligned_written);
-
-	/* Figure out how many unaligned bytes were written. */
-	size_t written = align_fix_up_bytes(&align, aligned_written);
-	BUG_ON(written > size);
+	/*
+	 * Overlay what we want to write - if libfuse spliced the request into
+	 * a pipe, this is the only copy of the data that's made:
+	 */
+	struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+	dst.buf[0].mem = aligned_buf + align.pad_start;
 
-	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_write: wrote %zd bytes\n",
-		 written);
+	copied = fuse_buf_copy(&dst, bufv, 0);
+	if (copied < 0) {
+		ret = copied;
+		goto err;
+	}
+	if (copied != size) {
+		ret = -EIO;
+		goto err;
+	}
 
-	if (written > 0)
-		ret = 0;
+	/* Actually write. */
+	struct bf_write *w = calloc(1, sizeof(*w));
+	if (!w) {
+		ret = -ENOMEM;
+		goto err;
+	}
 
-	/*
-	 * Update inode times.
-	 * TODO: Integrate with bch2_extent_update()
-	 */
-	if (!ret)
-		ret = inode_update_times(c, inum);
+	w->c		= c;
+	w->req		= req;
+	w->inum		= inum;
+	w->align	= align;
+	w->size		= size;
+	w->buf		= buf;
 
-	if (!ret) {
-		BUG_ON(written == 0);
-		fuse_reply_write(req, written);
-		free(aligned_buf);
-		return;
+	ret = write_op_init(c, &w->op, &w->bv, inum, io_opts, aligned_buf,
+			    align.size, align.start, offset + size);
+	if (ret) {
+		free(w);
+		goto err;
 	}
 
+	closure_init(&w->cl, NULL);
+	closure_call(&w->op.cl, bch2_write, NULL, &w->cl);
+	continue_at(&w->cl, bf_write_done, system_wq);
 err:
 	fuse_reply_err(req, -ret);
-	free(aligned_buf);
+	bf_buf_put(c, buf);
 }
 
 static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
@@ -707,17 +1676,19 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 
 	struct fuse_align_io align = align_io(c, link_len + 1, 0);
 
-	void *aligned_buf = aligned_alloc(PAGE_SIZE, align.size);
-	BUG_ON(!aligned_buf);
+	struct bf_buf aligned_buf = bf_buf_get(c, align.size);
+	ret = -ENOMEM;
+	if (!aligned_buf.p)
+		goto err;
 
-	memset(aligned_buf, 0, align.size);
-	memcpy(aligned_buf, link, link_len); /* already terminated */
+	memset(aligned_buf.p, 0, align.size);
+	memcpy(aligned_buf.p, link, link_len); /* already terminated */
 
 	size_t aligned_written;
-	ret = write_aligned(c, new_inode.bi_inum, io_opts, aligned_buf,
+	ret = write_aligned(c, new_inode.bi_inum, io_opts, aligned_buf.p,
 			    align.size, align.start, link_len + 1,
 			    &aligned_written);
-	free(aligned_buf);
+	bf_buf_put(c, aligned_buf);
 
 	if (ret)
 		goto err;
@@ -725,7 +1696,7 @@ static void bcachefs_fuse_symlink(fuse_req_t req, const char *link,
 	size_t written = align_fix_up_bytes(&align, aligned_written);
 	BUG_ON(written != link_len + 1); // TODO: handle short
 
-	ret = inode_update_times(c, new_inode.bi_inum);
+	ret = inode_update_times(bf_trans(c), new_inode.bi_inum);
 	if (ret)
 		goto err;
 
@@ -742,19 +1713,21 @@ err:
 static void bcachefs_fuse_readlink(fuse_req_t req, fuse_ino_t inum)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
-	char *buf = NULL;
+	struct bf_buf b = { NULL };
+	char *buf;
 
 	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readlink(%llu)\n", inum);
 
 	struct bch_inode_unpacked bi;
-	int ret = bch2_inode_find_by_inum(c, inum, &bi);
+	int ret = bf_inode_find(c, inum, &bi);
 	if (ret)
 		goto err;
 
 	struct fuse_align_io align = align_io(c, bi.bi_size, 0);
 
 	ret = -ENOMEM;
-	buf = aligned_alloc(PAGE_SIZE, align.size);
+	b = bf_buf_get(c, align.size);
+	buf = b.p;
 	if (!buf)
 		goto err;
 
@@ -770,7 +1743,7 @@ err:
 	if (ret)
 		fuse_reply_err(req, -ret);
 
-	free(buf);
+	bf_buf_put(c, b);
 }
 
 #if 0
@@ -787,12 +1760,6 @@ static void bcachefs_fuse_flush(fuse_req_t req, fuse_ino_t inum,
 	struct bch_fs *c = fuse_req_userdata(req);
 }
 
-static void bcachefs_fuse_release(fuse_req_t req, fuse_ino_t inum,
-				  struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fsync(fuse_req_t req, fuse_ino_t inum, int datasync,
 				struct fuse_file_info *fi)
 {
@@ -877,20 +1844,19 @@ static int fuse_filldir(struct dir_context *_ctx,
 	return 0;
 }
 
-static bool handle_dots(struct fuse_dir_context *ctx, fuse_ino_t dir)
+static bool handle_dots(struct dir_context *ctx, fuse_ino_t dir)
 {
-	if (ctx->ctx.pos == 0) {
-		if (fuse_filldir(&ctx->ctx, ".", 1, ctx->ctx.pos,
-				 dir, DT_DIR) < 0)
+	if (ctx->pos == 0) {
+		if (ctx->actor(ctx, ".", 1, ctx->pos, dir, DT_DIR) < 0)
 			return false;
-		ctx->ctx.pos = 1;
+		ctx->pos = 1;
 	}
 
-	if (ctx->ctx.pos == 1) {
-		if (fuse_filldir(&ctx->ctx, "..", 2, ctx->ctx.pos,
-				 /*TODO: parent*/ 1, DT_DIR) < 0)
+	if (ctx->pos == 1) {
+		if (ctx->actor(ctx, "..", 2, ctx->pos,
+			       /*TODO: parent*/ 1, DT_DIR) < 0)
 			return false;
-		ctx->ctx.pos = 2;
+		ctx->pos = 2;
 	}
 
 	return true;
@@ -917,7 +1883,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 
 	dir = map_root_ino(dir);
 
-	ret = bch2_inode_find_by_inum(c, dir, &bi);
+	ret = bf_inode_find(c, dir, &bi);
 	if (ret)
 		goto reply;
 
@@ -926,7 +1892,7 @@ static void bcachefs_fuse_readdir(fuse_req_t req, fuse_ino_t dir,
 		goto reply;
 	}
 
-	if (!handle_dots(&ctx, dir))
+	if (!handle_dots(&ctx.ctx, dir))
 		goto reply;
 
 	ret = bch2_readdir(c, dir, &ctx.ctx);
@@ -942,14 +1908,219 @@ reply:
 	free(buf);
 }
 
-#if 0
+/*
+ * readdirplus:
+ *
+ * Dirents are first collected from bch2_readdir(), as many as will fit in the
+ * reply; then the inodes they point to that aren't in the inode cache are
+ * looked up in a single pass over the inodes btree, in inum order, so that
+ * neighbouring inodes come out of the same leaf node.
+ */
+
+struct bf_dirent {
+	u64			inum;
+	off_t			pos;
+	const char		*name;
+	unsigned		type;
+	bool			found;
+	struct bch_inode_unpacked inode;
+};
+
+struct bf_dirplus_context {
+	struct dir_context	ctx;
+	fuse_req_t		req;
+	size_t			bufsize;
+	char			*names;
+	size_t			names_used;
+	unsigned		nr, size;
+	struct bf_dirent	*d;
+};
+
+static int bf_dirplus_filldir(struct dir_context *_ctx,
+			      const char *name, int namelen,
+			      loff_t pos, u64 ino, unsigned type)
+{
+	struct bf_dirplus_context *ctx =
+		container_of(_ctx, struct bf_dirplus_context, ctx);
+	struct bf_dirent *d;
+	size_t len;
+
+	if (ctx->nr == ctx->size)
+		return -1;
+
+	/*
+	 * With a NULL buffer, this just returns the entry size - of an entry
+	 * with an empty name, since @name isn't nul terminated:
+	 */
+	len = FUSE_DIRENT_ALIGN(fuse_add_direntry_plus(ctx->req, NULL, 0,
+						       "", NULL, 0) + namelen);
+	if (len > ctx->bufsize)
+		return -1;
+	ctx->bufsize -= len;
+
+	d = &ctx->d[ctx->nr++];
+	d->inum	= ino;
+	d->pos	= pos;
+	d->name	= ctx->names + ctx->names_used;
+	d->type	= type;
+	d->found = false;
+
+	memcpy(ctx->names + ctx->names_used, name, namelen);
+	ctx->names[ctx->names_used + namelen] = '\0';
+	ctx->names_used += namelen + 1;
+
+	return 0;
+}
+
+static int bf_dirent_inum_cmp(const void *_l, const void *_r)
+{
+	const struct bf_dirent *l = *((const struct bf_dirent **) _l);
+	const struct bf_dirent *r = *((const struct bf_dirent **) _r);
+
+	return cmp_int(l->inum, r->inum);
+}
+
+static int bf_inodes_get_trans(struct btree_trans *trans,
+			       struct bf_dirent **d, unsigned nr)
+{
+	struct btree_iter *iter;
+	struct bkey_s_c k;
+	unsigned i;
+	int ret = 0;
+
+	iter = bch2_trans_get_iter(trans, BTREE_ID_INODES,
+				   POS(d[0]->inum, 0), BTREE_ITER_SLOTS);
+	if (IS_ERR(iter))
+		return PTR_ERR(iter);
+
+	for (i = 0; i < nr; i++) {
+		bch2_btree_iter_set_pos(iter, POS(d[i]->inum, 0));
+
+		k = bch2_btree_iter_peek_slot(iter);
+		ret = bkey_err(k);
+		if (ret)
+			break;
+
+		/* not found: raced with unlink, the dirent goes out bare */
+		d[i]->found = k.k->type == KEY_TYPE_inode &&
+			!bch2_inode_unpack(bkey_s_c_to_inode(k), &d[i]->inode);
+	}
+
+	bch2_trans_iter_put(trans, iter);
+	return ret;
+}
+
+static int bf_dirents_get_inodes(struct bch_fs *c,
+				 struct bf_dirent *d, unsigned nr)
+{
+	struct bf_dirent **sorted = calloc(nr, sizeof(*sorted));
+	unsigned i, nr_sorted = 0;
+	u64 seq = bf_icache_seq();
+	int ret = 0;
+
+	if (!sorted)
+		return -ENOMEM;
+
+	/* . and .. (pos 0 and 1) are ignored by the kernel: */
+	for (i = 0; i < nr; i++)
+		if (d[i].pos > 1) {
+			d[i].found = bf_icache_lookup(d[i].inum, &d[i].inode);
+			if (!d[i].found)
+				sorted[nr_sorted++] = &d[i];
+		}
+
+	if (nr_sorted) {
+		sort(sorted, nr_sorted, sizeof(sorted[0]),
+		     bf_dirent_inum_cmp, NULL);
+
+		ret = bf_trans_do(c, 0,
+			bf_inodes_get_trans(trans, sorted, nr_sorted));
+
+		for (i = 0; i < nr_sorted && !ret; i++)
+			if (sorted[i]->found)
+				bf_icache_insert(&sorted[i]->inode, seq);
+	}
+
+	free(sorted);
+	return ret;
+}
+
 static void bcachefs_fuse_readdirplus(fuse_req_t req, fuse_ino_t dir,
 				      size_t size, off_t off,
 				      struct fuse_file_info *fi)
 {
+	struct bch_fs *c = fuse_req_userdata(req);
+	struct bch_inode_unpacked bi;
+	size_t min_entry = fuse_add_direntry_plus(req, NULL, 0, "", NULL, 0);
+	struct bf_dirplus_context ctx = {
+		.ctx.actor	= bf_dirplus_filldir,
+		.ctx.pos	= off,
+		.req		= req,
+		.bufsize	= size,
+		.size		= size / min_entry + 1,
+	};
+	char *buf = calloc(size, 1), *p = buf;
+	unsigned i;
+	int ret = 0;
+
+	fuse_log(FUSE_LOG_DEBUG, "bcachefs_fuse_readdirplus(dir=%llu, size=%zu, "
+		 "off=%lld)\n", dir, size, off);
+
+	ctx.names	= malloc(size);
+	ctx.d		= calloc(ctx.size, sizeof(ctx.d[0]));
+	if (!buf || !ctx.names || !ctx.d) {
+		ret = -ENOMEM;
+		goto reply;
+	}
+
+	dir = map_root_ino(dir);
+
+	ret = bf_inode_find(c, dir, &bi);
+	if (ret)
+		goto reply;
+
+	if (!S_ISDIR(bi.bi_mode)) {
+		ret = -ENOTDIR;
+		goto reply;
+	}
+
+	if (handle_dots(&ctx.ctx, dir))
+		ret = bch2_readdir(c, dir, &ctx.ctx);
+
+	ret = ret ?: bf_dirents_get_inodes(c, ctx.d, ctx.nr);
+	if (ret)
+		goto reply;
+
+	for (i = 0; i < ctx.nr; i++) {
+		struct bf_dirent *d = &ctx.d[i];
+		/*
+		 * Entries with ino 0 are just dirents, the kernel doesn't
+		 * instantiate (or take a lookup ref on) them:
+		 */
+		struct fuse_entry_param e = {
+			.attr.st_ino	= unmap_root_ino(d->inum),
+			.attr.st_mode	= d->type << 12,
+		};
+
+		if (d->found)
+			e = inode_to_entry(c, &d->inode);
+
+		p += fuse_add_direntry_plus(req, p, size - (p - buf),
+					    d->name, &e, d->pos + 1);
+	}
+reply:
+	if (!ret)
+		fuse_reply_buf(req, buf, p - buf);
+	else
+		fuse_reply_err(req, -ret);
 
+	free(ctx.d);
+	free(ctx.names);
+	free(buf);
 }
 
+#if 0
+
 static void bcachefs_fuse_releasedir(fuse_req_t req, fuse_ino_t inum,
 				     struct fuse_file_info *fi)
 {
@@ -966,8 +2137,14 @@ static void bcachefs_fuse_fsyncdir(fuse_req_t req, fuse_ino_t inum, int datasync
 static void bcachefs_fuse_statfs(fuse_req_t req, fuse_ino_t inum)
 {
 	struct bch_fs *c = fuse_req_userdata(req);
-	struct bch_fs_usage_short usage = bch2_fs_usage_read_short(c);
+	struct bch_fs_usage_short usage;
 	unsigned shift = c->block_bits;
+
+	/* sets up current and rcu for this thread, if needed: */
+	bf_thread_get(c);
+
+	usage = bch2_fs_usage_read_short(c);
+
 	struct statvfs statbuf = {
 		.f_bsize	= block_bytes(c),
 		.f_frsize	= block_bytes(c),
@@ -1025,6 +2202,8 @@ static void bcachefs_fuse_create(fuse_req_t req, fuse_ino_t dir,
 	if (ret)
 		goto err;
 
+	fi->fh = (unsigned long) bf_file_alloc(new_inode.bi_inum);
+
 	struct fuse_entry_param e = inode_to_entry(c, &new_inode);
 	fuse_reply_create(req, &e, fi);
 	return;
@@ -1034,13 +2213,6 @@ err:
 }
 
 #if 0
-static void bcachefs_fuse_write_buf(fuse_req_t req, fuse_ino_t inum,
-				    struct fuse_bufvec *bufv, off_t off,
-				    struct fuse_file_info *fi)
-{
-	struct bch_fs *c = fuse_req_userdata(req);
-}
-
 static void bcachefs_fuse_fallocate(fuse_req_t req, fuse_ino_t inum, int mode,
 				    off_t offset, off_t length,
 				    struct fuse_file_info *fi)
@@ -1065,13 +2237,13 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.link		= bcachefs_fuse_link,
 	.open		= bcachefs_fuse_open,
 	.read		= bcachefs_fuse_read,
-	.write		= bcachefs_fuse_write,
+	.write_buf	= bcachefs_fuse_write_buf,
 	//.flush	= bcachefs_fuse_flush,
-	//.release	= bcachefs_fuse_release,
+	.release	= bcachefs_fuse_release,
 	//.fsync	= bcachefs_fuse_fsync,
 	//.opendir	= bcachefs_fuse_opendir,
 	.readdir	= bcachefs_fuse_readdir,
-	//.readdirplus	= bcachefs_fuse_readdirplus,
+	.readdirplus	= bcachefs_fuse_readdirplus,
 	//.releasedir	= bcachefs_fuse_releasedir,
 	//.fsyncdir	= bcachefs_fuse_fsyncdir,
 	.statfs		= bcachefs_fuse_statfs,
@@ -1086,7 +2258,6 @@ static const struct fuse_lowlevel_ops bcachefs_fuse_ops = {
 	.getlk		= bcachefs_fuse_getlk,
 	.setlk		= bcachefs_fuse_setlk,
 #endif
-	//.write_buf	= bcachefs_fuse_write_buf,
 	//.fallocate	= bcachefs_fuse_fallocate,
 
 };
@@ -1099,6 +2270,7 @@ struct bf_context {
 	char            *devices_str;
 	char            **devices;
 	int             nr_devices;
+	int		multithread;
 };
 
 static void bf_context_free(struct bf_context *ctx)
@@ -1112,6 +2284,7 @@ static void bf_context_free(struct bf_context *ctx)
 }
 
 static struct fuse_opt bf_opts[] = {
+	{ "multithread", offsetof(struct bf_context, multithread), 1 },
 	FUSE_OPT_END
 };
 
@@ -1173,7 +2346,13 @@ static void usage(char *argv[])
 {
 	printf("Usage: %s fusemount [options] <dev>[:dev2:...] <mountpoint>\n",
 	       argv[0]);
-	printf("\n");
+	printf("\n"
+	       "bcachefs options:\n"
+	       "    -o multithread         handle requests on multiple threads; libfuse\n"
+	       "                           starts them as needed, and\n"
+	       "                           -o max_idle_threads=N caps how many are\n"
+	       "                           kept around when idle\n"
+	       "\n");
 }
 
 int cmd_fusemount(int argc, char *argv[])
@@ -1230,6 +2409,9 @@ int cmd_fusemount(int argc, char *argv[])
 		die("error opening %s: %s", ctx.devices_str,
 		    strerror(-PTR_ERR(c)));
 
+	if (bf_icache_init())
+		die("error initializing inode cache");
+
 	/* Fuse */
 	struct fuse_session *se =
 		fuse_session_new(&args, &bcachefs_fuse_ops,
@@ -1248,7 +2430,23 @@ int cmd_fusemount(int argc, char *argv[])
 
 	fuse_daemonize(fuse_opts.foreground);
 
-	ret = fuse_session_loop(se);
+	if (pthread_key_create(&bf_thread_key, bf_thread_exit))
+		die("pthread_key_create err: %m");
+
+	/*
+	 * libfuse has no limit on the number of worker threads, only on how
+	 * many it keeps when they're idle:
+	 */
+	if (ctx.multithread && !fuse_opts.singlethread) {
+		struct fuse_loop_config loop_config = {
+			.clone_fd		= fuse_opts.clone_fd,
+			.max_idle_threads	= fuse_opts.max_idle_threads,
+		};
+
+		ret = fuse_session_loop_mt(se, &loop_config);
+	} else {
+		ret = fuse_session_loop(se);
+	}
 
 	/* Cleanup */
 	fuse_session_unmount(se);
@@ -0,0 +1,103 @@
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <linux/tracepoint.h>
+
+#include "cmds.h"
+#include "tools-util.h"
+
+static FILE *trace_out;
+
+static void trace_usage(void)
+{
+	puts("bcachefs trace - run a command with tracepoints enabled\n"
+	     "Usage: bcachefs trace [OPTION]... <command> [<args>]\n"
+	     "\n"
+	     "Events are recorded into per thread ring buffers while the command\n"
+	     "runs, and printed in timestamp order when it exits; only the most\n"
+	     "recent events are kept.\n"
+	     "\n"
+	     "Options:\n"
+	     "  -e, --events=events         Comma separated list of events to enable;\n"
+	     "                              globs are allowed (default all)\n"
+	     "  -o, --output=file           Write events to file instead of stderr\n"
+	     "  -l, --list                  List available events and exit\n"
+	     "  -h, --help                  Display this help and exit\n"
+	     "\n"
+	     "Report bugs to <linux-bcache@vger.kernel.org>");
+}
+
+static void trace_exit(void)
+{
+	trace_events_dump(trace_out);
+	fflush(trace_out);
+}
+
+/*
+ * Returns the index in argv of the command to run, which main() then
+ * dispatches as usual:
+ */
+int cmd_trace(int argc, char *argv[])
+{
+	static const struct option longopts[] = {
+		{ "events",		required_argument,	NULL, 'e' },
+		{ "output",		required_argument,	NULL, 'o' },
+		{ "list",		no_argument,		NULL, 'l' },
+		{ "help",		no_argument,		NULL, 'h' },
+		{ NULL }
+	};
+	char *events = NULL, *event, *output = NULL;
+	int opt, ret;
+
+	/* '+': stop at the command to run, its options aren't ours: */
+	while ((opt = getopt_long(argc, argv, "+e:o:lh",
+				  longopts, NULL)) != -1)
+		switch (opt) {
+		case 'e':
+			events = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'l':
+			trace_events_list(stdout);
+			exit(EXIT_SUCCESS);
+		case 'h':
+			trace_usage();
+			exit(EXIT_SUCCESS);
+		default:
+			exit(EXIT_FAILURE);
+		}
+
+	if (optind >= argc) {
+		trace_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	trace_out = stderr;
+	if (output) {
+		trace_out = fopen(output, "w");
+		if (!trace_out)
+			die("error opening %s: %m", output);
+	}
+
+	if (!events)
+		events = "all";
+
+	while ((event = strsep(&events, ",")))
+		if (*event && !trace_events_enable(event, true))
+			die("no events matching %s", event);
+
+	atexit(trace_exit);
+
+	ret = optind;
+	/*
+	 * the traced command parses its own options: optind = 0 makes glibc
+	 * reinitialize getopt completely, including the ordering mode "+" set:
+	 */
+	optind = 0;
+	return ret;
+}
@@ -47,6 +47,11 @@ int cmd_version(int argc, char *argv[]);
 
 int cmd_setattr(int argc, char *argv[]);
 
+int cmd_train_dict(int argc, char *argv[]);
+
 int cmd_fusemount(int argc, char *argv[]);
 
+int cmd_bench(int argc, char *argv[]);
+int cmd_trace(int argc, char *argv[]);
+
 #endif /* _CMDS_H */
@@ -12,6 +12,8 @@ typedef unsigned fmode_t;
 
 struct bio;
 struct user_namespace;
+struct blkdev_ring;
+struct iovec;
 
 #define MINORBITS	20
 #define MINORMASK	((1U << MINORBITS) - 1)
@@ -82,8 +84,10 @@ struct block_device {
 	struct hd_struct	*bd_part;
 	struct gendisk		*bd_disk;
 	struct gendisk		__bd_disk;
+	dev_t			bd_dev;
 	int			bd_fd;
 	int			bd_sync_fd;
+	struct blkdev_ring	*bd_ring;	/* NULL: use libaio */
 
 	struct backing_dev_info	*bd_bdi;
 	struct backing_dev_info	__bd_bdi;
@@ -92,6 +96,23 @@ struct block_device {
 void generic_make_request(struct bio *);
 int submit_bio_wait(struct bio *);
 
+/*
+ * While a plug is held, bios submitted by the current thread are queued on
+ * their device's io_uring and only handed to the kernel by blk_finish_plug() -
+ * except REQ_SYNC bios, which someone is about to wait on:
+ */
+#define BLK_PLUG_MAX_RINGS	8
+
+struct blk_plug {
+	unsigned		nr;
+	struct blkdev_ring	*rings[BLK_PLUG_MAX_RINGS];
+};
+
+void blk_start_plug(struct blk_plug *);
+void blk_finish_plug(struct blk_plug *);
+
+int blkdev_register_buffers(const struct iovec *, unsigned);
+
 static inline void submit_bio(struct bio *bio)
 {
 	generic_make_request(bio);
@@ -172,6 +193,13 @@ static inline const char *bdevname(struct block_device *bdev, char *buf)
 	return buf;
 }
 
+static inline dev_t bio_dev(struct bio *bio)
+{
+	return bio->bi_bdev->bd_dev;
+}
+
+void blk_fill_rwbs(char *, unsigned int, int);
+
 static inline bool op_is_write(unsigned int op)
 {
 	return op == REQ_OP_READ ? false : true;
@@ -8,4 +8,6 @@
 #include <linux/types.h>
 
 u64 __pure crc64_be(u64 crc, const void *p, size_t len);
+u64 __pure crc64_be_shift(u64 crc, size_t len);
+u64 __pure crc64_be_combine(u64 crc1, u64 crc2, size_t len2);
 #endif /* _LINUX_CRC64_H */
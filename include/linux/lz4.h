@@ -1,5 +1,12 @@
 #include <lz4.h>
+#include <lz4hc.h>
 
 #define LZ4_compress_destSize(src, dst, srclen, dstlen, workspace)	\
 	LZ4_compress_destSize(src, dst, srclen, dstlen)
 #define LZ4_MEM_COMPRESS 0
+
+#define LZ4_compress_HC(src, dst, srclen, dstlen, level, workspace)	\
+	LZ4_compress_HC_extStateHC(workspace, src, dst, srclen, dstlen, level)
+#define LZ4HC_MEM_COMPRESS	LZ4_sizeofStateHC()
+#define LZ4HC_MIN_CLEVEL	LZ4HC_CLEVEL_MIN
+#define LZ4HC_MAX_CLEVEL	LZ4HC_CLEVEL_MAX
@@ -86,6 +86,7 @@ struct task_struct {
 	bool			on_cpu;
 	char			comm[TASK_COMM_LEN];
 	struct bio_list		*bio_list;
+	struct blk_plug		*plug;
 };
 
 extern __thread struct task_struct *current;
@@ -129,6 +130,13 @@ static inline long io_schedule_timeout(long timeout)
 
 int wake_up_process(struct task_struct *);
 
+/*
+ * For threads not created by kthread_create() (e.g. libfuse worker threads):
+ * gives them a task_struct and registers them with urcu:
+ */
+void sched_thread_init(void);
+void sched_thread_exit(void);
+
 static inline u64 ktime_get_seconds(void)
 {
 	struct timespec ts;
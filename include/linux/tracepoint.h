@@ -1,6 +1,39 @@
 #ifndef __TOOLS_LINUX_TRACEPOINT_H
 #define __TOOLS_LINUX_TRACEPOINT_H
 
+#include <errno.h>
+#include <stdio.h>
+
+#include <linux/compiler.h>
+#include <linux/types.h>
+
+/*
+ * Userspace tracepoints:
+ *
+ * Events are defined with the usual TRACE_EVENT()/DEFINE_EVENT() macros; the
+ * .c file that defines CREATE_TRACE_POINTS gets the record and print functions
+ * generated for it by <trace/define_trace.h>. When an event is enabled it's
+ * recorded into a per thread ring buffer (see linux/tracepoint.c), and
+ * formatted only when the buffers are dumped - a disabled event costs a single
+ * predictable branch.
+ */
+
+struct trace_event_call {
+	const char	*name;
+	bool		enabled;
+	unsigned	size;
+	void		(*print)(char *, size_t, const void *);
+};
+
+void *trace_event_reserve(struct trace_event_call *, unsigned);
+void trace_event_commit(void *);
+
+int trace_snprintf(char *, size_t, const char *, ...);
+
+int trace_events_enable(const char *, bool);
+void trace_events_list(FILE *);
+void trace_events_dump(FILE *);
+
 #define PARAMS(args...) args
 
 #define TP_PROTO(args...)	args
@@ -8,10 +41,17 @@
 #define TP_CONDITION(args...)	args
 
 #define __DECLARE_TRACE(name, proto, args, cond, data_proto, data_args) \
+	extern struct trace_event_call event_##name;			\
+	void __trace_##name(proto);					\
 	static inline void trace_##name(proto)				\
-	{ }								\
+	{								\
+		if (unlikely(READ_ONCE(event_##name.enabled)))		\
+			__trace_##name(args);				\
+	}								\
 	static inline void trace_##name##_rcuidle(proto)		\
-	{ }								\
+	{								\
+		trace_##name(args);					\
+	}								\
 	static inline int						\
 	register_trace_##name(void (*probe)(data_proto),		\
 			      void *data)				\
@@ -30,7 +70,7 @@
 	static inline bool						\
 	trace_##name##_enabled(void)					\
 	{								\
-		return false;						\
+		return READ_ONCE(event_##name.enabled);			\
 	}
 
 #define DEFINE_TRACE_FN(name, reg, unreg)
@@ -8,6 +8,7 @@
 
 #define zlib_inflateInit2	inflateInit2
 #define zlib_inflate		inflate
+#define zlib_inflateEnd		inflateEnd
 
 #define zlib_deflateInit2	deflateInit2
 #define zlib_deflate		deflate
@@ -1,10 +1,42 @@
+#ifndef __TOOLS_LINUX_ZSTD_H
+#define __TOOLS_LINUX_ZSTD_H
+
 #include <zstd.h>
 
 #define ZSTD_initDCtx(w, s)	ZSTD_initStaticDCtx(w, s)
 #define ZSTD_initCCtx(w, s)	ZSTD_initStaticCCtx(w, s)
 
 #define ZSTD_compressCCtx(w, dst, d_len, src, src_len, params)	\
-	ZSTD_compressCCtx(w, dst, d_len, src, src_len, 0)
+	ZSTD_compress_advanced(w, dst, d_len, src, src_len, NULL, 0, params)
 
-#define ZSTD_CCtxWorkspaceBound(p)	ZSTD_estimateCCtxSize(0)
+#define ZSTD_CCtxWorkspaceBound(p)	ZSTD_estimateCCtxSize_usingCParams(p)
 #define ZSTD_DCtxWorkspaceBound()	ZSTD_estimateDCtxSize()
+
+#define ZSTD_CDictWorkspaceBound(p)					\
+	ZSTD_estimateCDictSize_advanced(0, p, ZSTD_dlm_byRef)
+#define ZSTD_DDictWorkspaceBound()					\
+	ZSTD_estimateDDictSize(0, ZSTD_dlm_byRef)
+
+#define ZSTD_initCDict(dict, len, params, w, s)				\
+	ZSTD_initStaticCDict(w, s, dict, len, ZSTD_dlm_byRef,		\
+			     ZSTD_dct_auto, (params).cParams)
+#define ZSTD_initDDict(dict, len, w, s)					\
+	ZSTD_initStaticDDict(w, s, dict, len, ZSTD_dlm_byRef, ZSTD_dct_auto)
+
+#define ZSTD_DStreamWorkspaceBound(w)	ZSTD_estimateDStreamSize(w)
+#define ZSTD_initDStream(w_size, w, s)	ZSTD_initStaticDStream(w, s)
+
+static inline ZSTD_DStream *
+zstd_init_dstream_ddict(const ZSTD_DDict *ddict, void *workspace, size_t size)
+{
+	ZSTD_DStream *ds = ZSTD_initStaticDStream(workspace, size);
+
+	if (ds && ZSTD_isError(ZSTD_DCtx_refDDict(ds, ddict)))
+		ds = NULL;
+	return ds;
+}
+
+#define ZSTD_initDStream_usingDDict(w_size, d, w, s)			\
+	zstd_init_dstream_ddict(d, w, s)
+
+#endif /* __TOOLS_LINUX_ZSTD_H */
@@ -0,0 +1,103 @@
+/*
+ * Included at the end of a trace events header: in the one .c file that
+ * defines CREATE_TRACE_POINTS, reads the header a second time to generate the
+ * event definitions - for each event class a struct for its ring buffer
+ * record, an assign function and a print function, and for each event its
+ * struct trace_event_call and the out of line __trace_<event>() that records
+ * it.
+ *
+ * Events are found at runtime via the _ftrace_events section.
+ */
+
+#ifdef CREATE_TRACE_POINTS
+
+#undef CREATE_TRACE_POINTS
+
+#define TRACE_HEADER_MULTI_READ
+
+#undef __field
+#define __field(type, item)		type	item;
+
+#undef __array
+#define __array(type, item, len)	type	item[len];
+
+#undef TP_STRUCT__entry
+#define TP_STRUCT__entry(args...)	args
+
+#undef TP_fast_assign
+#define TP_fast_assign(args...)		args
+
+#undef TP_printk
+#define TP_printk(fmt, args...)		fmt, ##args
+
+#undef DECLARE_EVENT_CLASS
+#define DECLARE_EVENT_CLASS(call, proto, args, tstruct, assign, print)	\
+struct trace_event_raw_##call {						\
+	tstruct								\
+};									\
+									\
+static inline void							\
+trace_event_assign_##call(struct trace_event_raw_##call *__entry, proto)\
+{									\
+	assign								\
+}									\
+									\
+static void trace_event_print_##call(char *buf, size_t size,		\
+				     const void *entry)			\
+{									\
+	const struct trace_event_raw_##call *__entry = entry;		\
+									\
+	trace_snprintf(buf, size, print);				\
+}
+
+#undef DEFINE_EVENT
+#define DEFINE_EVENT(template, call, proto, args)			\
+struct trace_event_call event_##call = {				\
+	.name	= #call,						\
+	.size	= sizeof(struct trace_event_raw_##template),		\
+	.print	= trace_event_print_##template,				\
+};									\
+									\
+static struct trace_event_call * const __event_##call			\
+	__used __attribute__((section("_ftrace_events"))) = &event_##call;\
+									\
+void __trace_##call(proto)						\
+{									\
+	struct trace_event_raw_##template *__entry =			\
+		trace_event_reserve(&event_##call, sizeof(*__entry));	\
+									\
+	if (__entry) {							\
+		trace_event_assign_##template(__entry, args);		\
+		trace_event_commit(__entry);				\
+	}								\
+}
+
+#undef DEFINE_EVENT_FN
+#define DEFINE_EVENT_FN(template, name, proto, args, reg, unreg)	\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+/* Per event print formats aren't supported, the class's is used: */
+#undef DEFINE_EVENT_PRINT
+#define DEFINE_EVENT_PRINT(template, name, proto, args, print)		\
+	DEFINE_EVENT(template, name, PARAMS(proto), PARAMS(args))
+
+#undef TRACE_EVENT
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print)		\
+	DECLARE_EVENT_CLASS(name, PARAMS(proto), PARAMS(args),		\
+			    PARAMS(tstruct), PARAMS(assign), PARAMS(print))\
+	DEFINE_EVENT(name, name, PARAMS(proto), PARAMS(args))
+
+#ifndef TRACE_INCLUDE_FILE
+# define TRACE_INCLUDE_FILE TRACE_SYSTEM
+#endif
+
+#define __TRACE_INCLUDE(system) <trace/events/system.h>
+#define TRACE_INCLUDE(system) __TRACE_INCLUDE(system)
+
+#include TRACE_INCLUDE(TRACE_INCLUDE_FILE)
+
+#undef TRACE_INCLUDE
+#undef __TRACE_INCLUDE
+#undef TRACE_HEADER_MULTI_READ
+
+#endif /* CREATE_TRACE_POINTS */
@@ -626,6 +626,17 @@ static void bch2_sb_print_journal_seq_blacklist(struct bch_sb *sb, struct bch_sb
 {
 }
 
+static void bch2_sb_print_compression_dict(struct bch_sb *sb, struct bch_sb_field *f,
+				enum units units)
+{
+	struct bch_sb_field_compression_dict *dict = field_to_type(f, compression_dict);
+
+	printf("  Dictionary id:		%u\n"
+	       "  Size:			%u bytes\n",
+	       le32_to_cpu(dict->dict_id),
+	       le32_to_cpu(dict->dict_len));
+}
+
 typedef void (*sb_field_print_fn)(struct bch_sb *, struct bch_sb_field *, enum units);
 
 struct bch_sb_field_toolops {
@@ -724,6 +735,9 @@ void bch2_sb_print(struct bch_sb *sb, bool print_layout,
 	       "Metadata checksum type:		%s (%llu)\n"
 	       "Data checksum type:		%s (%llu)\n"
 	       "Compression type:		%s (%llu)\n"
+	       "Compression level:		%llu\n"
+	       "Background compression type:	%s (%llu)\n"
+	       "Background compression level:	%llu\n"
 
 	       "Foreground write target:	%s\n"
 	       "Background write target:	%s\n"
@@ -768,6 +782,13 @@ void bch2_sb_print(struct bch_sb *sb, bool print_layout,
 	       ? bch2_compression_types[BCH_SB_COMPRESSION_TYPE(sb)]
 	       : "unknown",
 	       BCH_SB_COMPRESSION_TYPE(sb),
+	       BCH_SB_COMPRESSION_LEVEL(sb),
+
+	       BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb) < BCH_COMPRESSION_OPT_NR
+	       ? bch2_compression_types[BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb)]
+	       : "unknown",
+	       BCH_SB_BACKGROUND_COMPRESSION_TYPE(sb),
+	       BCH_SB_BACKGROUND_COMPRESSION_LEVEL(sb),
 
 	       foreground_str,
 	       background_str,
@@ -319,6 +319,61 @@ enum bch_time_stats {
 	BCH_TIME_STAT_NR
 };
 
+/*
+ * Stats for the incompressible data predictor: skipped_checked counts extents
+ * we predicted wouldn't compress but compressed anyway, to check the predictor,
+ * and skipped_wrong how many of those did compress; tried_failed counts
+ * extents we predicted would compress that didn't:
+ */
+#define BCH_COMPRESS_PREDICT_STATS()	\
+	x(skipped)			\
+	x(skipped_checked)		\
+	x(skipped_wrong)		\
+	x(tried)			\
+	x(tried_failed)
+
+enum bch_compress_predict_stat {
+#define x(n)	BCH_COMPRESS_PREDICT_##n,
+	BCH_COMPRESS_PREDICT_STATS()
+#undef x
+	BCH_COMPRESS_PREDICT_NR
+};
+
+/*
+ * Bytes of compressed or uncompressed data copied through bounce buffers, and
+ * bytes we read or wrote in place that used to need a bounce buffer or vmap:
+ */
+#define BCH_COMPRESS_BOUNCE_STATS()	\
+	x(bounced)			\
+	x(avoided)
+
+enum bch_compress_bounce_stat {
+#define x(n)	BCH_COMPRESS_BOUNCE_##n,
+	BCH_COMPRESS_BOUNCE_STATS()
+#undef x
+	BCH_COMPRESS_BOUNCE_NR
+};
+
+#define BCH_WORKSPACE_CACHE_SLOTS	32
+
+/*
+ * Compression workspaces: idle workspaces are cached in slots picked by hashing
+ * the current task, so each thread normally reuses its own without taking any
+ * locks; the mempool is only a reserve for when allocating a new one fails:
+ */
+struct bch_workspace_pool {
+	size_t			size;
+	void			*cache[BCH_WORKSPACE_CACHE_SLOTS];
+	mempool_t		reserve;
+};
+
+struct bch_workspace {
+	void			*p;
+	bool			reserve;
+};
+
+struct bch_compression_dict;
+
 #include "alloc_types.h"
 #include "btree_types.h"
 #include "buckets_types.h"
@@ -500,6 +555,7 @@ enum {
 	BCH_FS_ALLOC_WRITTEN,
 	BCH_FS_REBUILD_REPLICAS,
 	BCH_FS_HOLD_BTREE_WRITES,
+	BCH_FS_GC_DEFERRED,
 };
 
 struct btree_debug {
@@ -706,6 +762,12 @@ struct bch_fs {
 	 */
 	struct rw_semaphore	gc_lock;
 
+	/*
+	 * Btrees with a bulk load in progress (bitmask of btree ids): gc is
+	 * deferred until they finish. Changed with gc_lock held for read.
+	 */
+	unsigned long		btree_bulk_loading;
+
 	/* IO PATH */
 	struct bio_set		bio_read;
 	struct bio_set		bio_read_split;
@@ -715,9 +777,13 @@ struct bch_fs {
 	struct rhashtable	promote_table;
 
 	mempool_t		compression_bounce[2];
-	mempool_t		compress_workspace[BCH_COMPRESSION_NR];
-	mempool_t		decompress_workspace;
-	ZSTD_parameters		zstd_params;
+	struct bch_workspace_pool compress_workspace[BCH_COMPRESSION_NR];
+	struct bch_workspace_pool decompress_workspace;
+	struct bch_compression_dict *compression_dict;
+	struct workqueue_struct	*compress_wq;
+	atomic64_t		compress_inflight;
+	atomic64_t		compress_predict[BCH_COMPRESS_PREDICT_NR];
+	atomic64_t		compress_bounce[BCH_COMPRESS_BOUNCE_NR];
 
 	struct crypto_shash	*sha256;
 	struct crypto_sync_skcipher *chacha20;
@@ -714,7 +714,9 @@ struct bch_inode_generation {
 	x(bi_foreground_target,		16)	\
 	x(bi_background_target,		16)	\
 	x(bi_erasure_code,		16)	\
-	x(bi_fields_set,		16)
+	x(bi_fields_set,		16)	\
+	x(bi_compression_level,		8)	\
+	x(bi_background_compression_level, 8)
 
 /* subset of BCH_INODE_FIELDS */
 #define BCH_INODE_OPTS()			\
@@ -726,7 +728,9 @@ struct bch_inode_generation {
 	x(promote_target,		16)	\
 	x(foreground_target,		16)	\
 	x(background_target,		16)	\
-	x(erasure_code,			16)
+	x(erasure_code,			16)	\
+	x(compression_level,		8)	\
+	x(background_compression_level,	8)
 
 enum inode_opt_id {
 #define x(name, ...)				\
@@ -936,7 +940,8 @@ struct bch_sb_field {
 	x(disk_groups,	5)	\
 	x(clean,	6)	\
 	x(replicas,	7)	\
-	x(journal_seq_blacklist, 8)
+	x(journal_seq_blacklist, 8)	\
+	x(compression_dict, 9)
 
 enum bch_sb_field_type {
 #define x(f, nr)	BCH_SB_FIELD_##f = nr,
@@ -1165,6 +1170,23 @@ struct bch_sb_field_journal_seq_blacklist {
 	};
 };
 
+/*
+ * Trained zstd dictionary: small extents are compressed against it, and
+ * identify it by the dictionary id in their zstd frame header. Since existing
+ * extents may reference it, it can't be changed once set:
+ */
+struct bch_sb_field_compression_dict {
+	struct bch_sb_field	field;
+
+	__le32			dict_id;
+	__le32			dict_len;
+	__u8			data[];
+};
+
+#define BCH_COMPRESSION_DICT_MAX_SIZE	(16U << 10)
+/* extents bigger than this compress fine without a dictionary: */
+#define BCH_COMPRESSION_DICT_MAX_EXTENT	(32U << 10)
+
 /* Superblock: */
 
 /*
@@ -1312,6 +1334,9 @@ LE64_BITMASK(BCH_SB_BACKGROUND_COMPRESSION_TYPE,
 LE64_BITMASK(BCH_SB_GC_RESERVE_BYTES,	struct bch_sb, flags[2],  4, 64);
 
 LE64_BITMASK(BCH_SB_ERASURE_CODE,	struct bch_sb, flags[3],  0, 16);
+LE64_BITMASK(BCH_SB_COMPRESSION_LEVEL,	struct bch_sb, flags[3], 16, 21);
+LE64_BITMASK(BCH_SB_BACKGROUND_COMPRESSION_LEVEL,
+					struct bch_sb, flags[3], 21, 26);
 
 /* Features: */
 enum bch_sb_features {
@@ -1324,6 +1349,7 @@ enum bch_sb_features {
 	BCH_FEATURE_REFLINK		= 6,
 	BCH_FEATURE_NEW_SIPHASH		= 7,
 	BCH_FEATURE_INLINE_DATA		= 8,
+	BCH_FEATURE_ZSTD_DICT		= 9,
 	BCH_FEATURE_NR,
 };
 
@@ -1378,6 +1404,13 @@ enum bch_compression_opts {
 	BCH_COMPRESSION_OPT_NR
 };
 
+/*
+ * Compression levels don't change the on disk format - any level of a given
+ * compression type is decompressed the same way - so they're only options, not
+ * recorded in extents:
+ */
+#define BCH_COMPRESSION_LEVEL_MAX	22
+
 /*
  * Magic numbers
  *
@@ -6,6 +6,14 @@
 #include "bset.h"
 #include "util.h"
 
+/*
+ * Runtime CPU feature detection here is userspace only - the kernel would use
+ * alternatives:
+ */
+#if defined(CONFIG_X86_64) && !defined(__KERNEL__)
+#define BKEY_HAVE_BMI2
+#endif
+
 #undef EBUG_ON
 
 #ifdef DEBUG_BKEYS
@@ -16,8 +24,8 @@
 
 const struct bkey_format bch2_bkey_format_current = BKEY_FORMAT_CURRENT;
 
-struct bkey __bch2_bkey_unpack_key(const struct bkey_format *,
-			      const struct bkey_packed *);
+static struct bkey __bch2_bkey_unpack_key_ref(const struct bkey_format *,
+					      const struct bkey_packed *);
 
 void bch2_to_binary(char *out, const u64 *p, unsigned nr_bits)
 {
@@ -54,7 +62,7 @@ static void bch2_bkey_pack_verify(const struct bkey_packed *packed,
 
 	BUG_ON(packed->u64s < bkeyp_key_u64s(format, packed));
 
-	tmp = __bch2_bkey_unpack_key(format, packed);
+	tmp = __bch2_bkey_unpack_key_ref(format, packed);
 
 	if (memcmp(&tmp, unpacked, sizeof(struct bkey))) {
 		char buf1[160], buf2[160];
@@ -242,10 +250,10 @@ bool bch2_bkey_transform(const struct bkey_format *out_f,
 	x(BKEY_FIELD_VERSION_HI,	version.hi)			\
 	x(BKEY_FIELD_VERSION_LO,	version.lo)
 
-struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
-			      const struct bkey_packed *in)
+__always_inline
+static struct bkey unpack_key_header(const struct bkey_format *format,
+				     const struct bkey_packed *in)
 {
-	struct unpack_state state = unpack_state_init(format, in);
 	struct bkey out;
 
 	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
@@ -259,6 +267,19 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 	out.type	= in->type;
 	out.pad[0]	= 0;
 
+	return out;
+}
+
+/*
+ * Reference implementation, one field at a time - the other unpack kernels are
+ * checked against this one:
+ */
+static struct bkey __bch2_bkey_unpack_key_ref(const struct bkey_format *format,
+					      const struct bkey_packed *in)
+{
+	struct unpack_state state = unpack_state_init(format, in);
+	struct bkey out = unpack_key_header(format, in);
+
 #define x(id, field)	out.field = get_inc_field(&state, id);
 	bkey_fields()
 #undef x
@@ -266,12 +287,113 @@ struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
 	return out;
 }
 
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+
+/*
+ * Unlike get_inc_field(), each field is extracted straight from the word(s) it
+ * lives in, so there's no dependency from one field to the next - @end is the
+ * bit position of the low bit of the field:
+ */
+__always_inline
+static u64 unpack_field(const struct bkey_format *format,
+			const struct bkey_packed *in,
+			unsigned field, unsigned end)
+{
+	const u64 *p = in->_data + end / 64;
+	unsigned bits = format->bits_per_field[field];
+	unsigned shift = end % 64;
+	u64 v, offset = le64_to_cpu(format->field_offset[field]);
+
+	/* @p may be past the end of the key: */
+	if (!bits)
+		return offset;
+
+	v = p[0] >> shift;
+	if (shift + bits > 64)
+		v |= p[1] << (64 - shift);
+	if (bits < 64)
+		v &= ~(~0ULL << bits);
+
+	return v + offset;
+}
+
+__always_inline
+static struct bkey __bkey_unpack_key_words(const struct bkey_format *format,
+					   const struct bkey_packed *in)
+{
+	struct bkey out = unpack_key_header(format, in);
+	unsigned end = format->key_u64s * 64;
+
+#define x(id, field)							\
+	end -= format->bits_per_field[id];				\
+	out.field = unpack_field(format, in, id, end);
+	bkey_fields()
+#undef x
+
+	return out;
+}
+
+static struct bkey __bch2_bkey_unpack_key_words(const struct bkey_format *format,
+						const struct bkey_packed *in)
+{
+	return __bkey_unpack_key_words(format, in);
+}
+
+#ifdef BKEY_HAVE_BMI2
+/* Same as above, but with shrx/bzhi: */
+__attribute__((target("bmi2")))
+static struct bkey __bch2_bkey_unpack_key_bmi2(const struct bkey_format *format,
+					       const struct bkey_packed *in)
+{
+	return __bkey_unpack_key_words(format, in);
+}
+#endif
+
+#endif /* __ORDER_LITTLE_ENDIAN__ */
+
+#ifdef BKEY_HAVE_BMI2
+static bool bkey_unpack_bmi2 __read_mostly;
+
+static bool bkey_bmi2_supported(void)
+{
+	return __builtin_cpu_supports("bmi2");
+}
+#endif
+
+struct bkey __bch2_bkey_unpack_key(const struct bkey_format *format,
+				   const struct bkey_packed *in)
+{
+#ifdef BKEY_HAVE_BMI2
+	if (bkey_unpack_bmi2)
+		return __bch2_bkey_unpack_key_bmi2(format, in);
+#endif
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	return __bch2_bkey_unpack_key_words(format, in);
+#else
+	return __bch2_bkey_unpack_key_ref(format, in);
+#endif
+}
+
 #ifndef HAVE_BCACHEFS_COMPILED_UNPACK
 struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 				     const struct bkey_packed *in)
 {
-	struct unpack_state state = unpack_state_init(format, in);
 	struct bpos out;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	unsigned end = format->key_u64s * 64;
+
+	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
+	EBUG_ON(in->u64s < format->key_u64s);
+	EBUG_ON(in->format != KEY_FORMAT_LOCAL_BTREE);
+
+	end -= format->bits_per_field[BKEY_FIELD_INODE];
+	out.inode	= unpack_field(format, in, BKEY_FIELD_INODE, end);
+	end -= format->bits_per_field[BKEY_FIELD_OFFSET];
+	out.offset	= unpack_field(format, in, BKEY_FIELD_OFFSET, end);
+	end -= format->bits_per_field[BKEY_FIELD_SNAPSHOT];
+	out.snapshot	= unpack_field(format, in, BKEY_FIELD_SNAPSHOT, end);
+#else
+	struct unpack_state state = unpack_state_init(format, in);
 
 	EBUG_ON(format->nr_fields != BKEY_NR_FIELDS);
 	EBUG_ON(in->u64s < format->key_u64s);
@@ -280,7 +402,7 @@ struct bpos __bkey_unpack_pos(const struct bkey_format *format,
 	out.inode	= get_inc_field(&state, BKEY_FIELD_INODE);
 	out.offset	= get_inc_field(&state, BKEY_FIELD_OFFSET);
 	out.snapshot	= get_inc_field(&state, BKEY_FIELD_SNAPSHOT);
-
+#endif
 	return out;
 }
 #endif
@@ -713,10 +835,49 @@ unsigned bch2_bkey_ffs(const struct btree *b, const struct bkey_packed *k)
 	return 0;
 }
 
+/*
+ * Reference implementation: compares a word at a time, from the most
+ * significant word down:
+ */
+static inline int __bkey_cmp_bits_ref(const u64 *l, const u64 *r,
+				      unsigned nr_key_bits)
+{
+	u64 l_v, r_v;
+
+	if (!nr_key_bits)
+		return 0;
+
+	/* for big endian, skip past header */
+	nr_key_bits += high_bit_offset;
+	l_v = *l & (~0ULL >> high_bit_offset);
+	r_v = *r & (~0ULL >> high_bit_offset);
+
+	while (1) {
+		if (nr_key_bits < 64) {
+			l_v >>= 64 - nr_key_bits;
+			r_v >>= 64 - nr_key_bits;
+			nr_key_bits = 0;
+		} else {
+			nr_key_bits -= 64;
+		}
+
+		if (!nr_key_bits || l_v != r_v)
+			break;
+
+		l = next_word(l);
+		r = next_word(r);
+
+		l_v = *l;
+		r_v = *r;
+	}
+
+	return cmp_int(l_v, r_v);
+}
+
 #ifdef CONFIG_X86_64
 
-static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
-				  unsigned nr_key_bits)
+static inline int __bkey_cmp_bits_asm(const u64 *l, const u64 *r,
+				      unsigned nr_key_bits)
 {
 	long d0, d1, d2, d3;
 	int cmp;
@@ -988,42 +1149,45 @@ int bch2_compile_bkey_format(const struct bkey_format *format, void *_out)
 	return (void *) out - _out;
 }
 
-#else
+#endif
+
 static inline int __bkey_cmp_bits(const u64 *l, const u64 *r,
 				  unsigned nr_key_bits)
 {
-	u64 l_v, r_v;
-
-	if (!nr_key_bits)
-		return 0;
-
-	/* for big endian, skip past header */
-	nr_key_bits += high_bit_offset;
-	l_v = *l & (~0ULL >> high_bit_offset);
-	r_v = *r & (~0ULL >> high_bit_offset);
-
-	while (1) {
-		if (nr_key_bits < 64) {
-			l_v >>= 64 - nr_key_bits;
-			r_v >>= 64 - nr_key_bits;
-			nr_key_bits = 0;
-		} else {
-			nr_key_bits -= 64;
-		}
+#ifdef CONFIG_X86_64
+	return __bkey_cmp_bits_asm(l, r, nr_key_bits);
+#else
+	return __bkey_cmp_bits_ref(l, r, nr_key_bits);
+#endif
+}
 
-		if (!nr_key_bits || l_v != r_v)
-			break;
+const struct bkey_unpack_impl bch2_bkey_unpack_impls[] = {
+	{ "ref",	__bch2_bkey_unpack_key_ref },
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	{ "words",	__bch2_bkey_unpack_key_words },
+#endif
+#ifdef BKEY_HAVE_BMI2
+	{ "bmi2",	__bch2_bkey_unpack_key_bmi2,	bkey_bmi2_supported },
+#endif
+	{ NULL }
+};
 
-		l = next_word(l);
-		r = next_word(r);
+const struct bkey_cmp_impl bch2_bkey_cmp_impls[] = {
+	{ "ref",	__bkey_cmp_bits_ref },
+#ifdef CONFIG_X86_64
+	{ "asm",	__bkey_cmp_bits_asm },
+#endif
+	{ NULL }
+};
 
-		l_v = *l;
-		r_v = *r;
-	}
+void bch2_bkey_init(void)
+{
+#ifdef BKEY_HAVE_BMI2
+	__builtin_cpu_init();
 
-	return cmp_int(l_v, r_v);
-}
+	bkey_unpack_bmi2 = bkey_bmi2_supported();
 #endif
+}
 
 __pure
 int __bch2_bkey_cmp_packed_format_checked(const struct bkey_packed *l,
@@ -1112,10 +1276,37 @@ void bch2_bkey_swab_key(const struct bkey_format *_f, struct bkey_packed *k)
 }
 
 #ifdef CONFIG_BCACHEFS_DEBUG
+/* Check that every supported kernel agrees with the reference: */
+static void bch2_bkey_impls_test(const struct bkey_format *f,
+				 const struct bkey_packed *l,
+				 const struct bkey_packed *r)
+{
+	const struct bkey_unpack_impl *u;
+	const struct bkey_cmp_impl *c;
+	unsigned nr_key_bits = bkey_format_key_bits(f);
+	struct bkey ref = bch2_bkey_unpack_impls[0].fn(f, l);
+	int cmp = bch2_bkey_cmp_impls[0].fn(high_word(f, l), high_word(f, r),
+					    nr_key_bits);
+
+	for (u = bch2_bkey_unpack_impls + 1; u->name; u++)
+		if (!u->supported || u->supported()) {
+			struct bkey k = u->fn(f, l);
+
+			if (memcmp(&k, &ref, sizeof(k)))
+				panic("bkey unpack %s: wrong result\n", u->name);
+		}
+
+	for (c = bch2_bkey_cmp_impls + 1; c->name; c++)
+		if ((!c->supported || c->supported()) &&
+		    c->fn(high_word(f, l), high_word(f, r), nr_key_bits) != cmp)
+			panic("bkey cmp %s: wrong result\n", c->name);
+}
+
 void bch2_bkey_pack_test(void)
 {
 	struct bkey t = KEY(4134ULL, 1250629070527416633ULL, 0);
-	struct bkey_packed p;
+	struct bkey t2 = KEY(4134ULL, 1250629070527416634ULL, 0);
+	struct bkey_packed p, p2;
 
 	struct bkey_format test_format = {
 		.key_u64s	= 2,
@@ -1150,5 +1341,10 @@ void bch2_bkey_pack_test(void)
 	}
 
 	BUG_ON(!bch2_bkey_pack_key(&p, &t, &test_format));
+	BUG_ON(!bch2_bkey_pack_key(&p2, &t2, &test_format));
+
+	bch2_bkey_impls_test(&test_format, &p, &p2);
+	bch2_bkey_impls_test(&test_format, &p2, &p);
+	bch2_bkey_impls_test(&test_format, &p, &p);
 }
 #endif
@@ -354,6 +354,31 @@ struct bpos __bkey_unpack_pos(const struct bkey_format *,
 			      const struct bkey_packed *);
 #endif
 
+/*
+ * Unpack and compare kernels, selected at runtime by bch2_bkey_init(); the
+ * first entry of each table is the reference implementation. Exported for
+ * testing and benchmarking:
+ */
+struct bkey_unpack_impl {
+	const char	*name;
+	struct bkey	(*fn)(const struct bkey_format *,
+			      const struct bkey_packed *);
+	/* NULL: always supported */
+	bool		(*supported)(void);
+};
+
+struct bkey_cmp_impl {
+	const char	*name;
+	/* high words of two packed keys, and the number of key bits: */
+	int		(*fn)(const u64 *, const u64 *, unsigned);
+	bool		(*supported)(void);
+};
+
+extern const struct bkey_unpack_impl bch2_bkey_unpack_impls[];
+extern const struct bkey_cmp_impl bch2_bkey_cmp_impls[];
+
+void bch2_bkey_init(void);
+
 bool bch2_bkey_pack_key(struct bkey_packed *, const struct bkey *,
 		   const struct bkey_format *);
 
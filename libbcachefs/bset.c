@@ -1288,6 +1288,59 @@ static inline bool bkey_mantissa_bits_dropped(const struct btree *b,
 #endif
 }
 
+/*
+ * Search four levels of the tree in one step: the 15 nodes of the subtree
+ * rooted at @n are all loaded and compared against the search key up front,
+ * then we walk the path through them using the resulting bitmasks.
+ *
+ * None of the loads depend on the result of a previous comparison, so their
+ * cache misses overlap - instead of taking one dependent miss per level as
+ * the node at a time search does.
+ *
+ * Returns the node four levels down we would have recursed to - or, if a node
+ * on the path needs a full key comparison (failed bfloat, or mantissas equal
+ * with key bits dropped), that node, with *slowpath set so the caller can
+ * finish the search one level at a time:
+ */
+static __always_inline unsigned bset_search_tree_wide(const struct btree *b,
+				struct ro_aux_tree *base,
+				const struct bkey_packed *packed_search,
+				unsigned n, bool *slowpath)
+{
+	unsigned go_right = 0, slow = 0, level, i, j;
+
+	for (level = 0; level < 4; level++)
+		for (i = 1U << level; i < 2U << level; i++) {
+			const struct bkey_float *f;
+			unsigned l, r;
+
+			j = (n << level) + i - (1U << level);
+			f = &base->f[j];
+
+			/*
+			 * For a failed bfloat this reads garbage (from within
+			 * the search key) that we then ignore:
+			 */
+			l = f->mantissa;
+			r = bkey_mantissa(packed_search, f, j);
+
+			go_right |= (l < r) << i;
+			slow	 |= (f->exponent >= BFLOAT_FAILED ||
+				     (l == r && bkey_mantissa_bits_dropped(b, f, j))) << i;
+		}
+
+	for (level = 0, i = 1; level < 4; level++) {
+		if (unlikely(slow & (1U << i))) {
+			*slowpath = true;
+			return (n << level) + i - (1U << level);
+		}
+
+		i = i * 2 + ((go_right >> i) & 1);
+	}
+
+	return (n << 4) + i - 16;
+}
+
 __flatten
 static struct bkey_packed *bset_search_tree(const struct btree *b,
 				struct bset_tree *t,
@@ -1298,9 +1351,19 @@ static struct bkey_packed *bset_search_tree(const struct btree *b,
 	struct bkey_float *f;
 	struct bkey_packed *k;
 	unsigned inorder, n = 1, l, r;
+	bool slowpath = false;
 	int cmp;
 
-	do {
+	if (likely(packed_search))
+		while (!slowpath && (n << 3) + 7 < t->size) {
+			if (likely(n << 4 < t->size))
+				prefetch(&base->f[n << 4]);
+
+			n = bset_search_tree_wide(b, base, packed_search,
+						  n, &slowpath);
+		}
+
+	while (n < t->size) {
 		if (likely(n << 4 < t->size))
 			prefetch(&base->f[n << 4]);
 
@@ -1326,7 +1389,7 @@ slowpath:
 			return k;
 
 		n = n * 2 + (cmp < 0);
-	} while (n < t->size);
+	}
 
 	inorder = __eytzinger1_to_inorder(n >> 1, t->size, t->extra);
 
@@ -1340,6 +1403,8 @@ slowpath:
 			return btree_bkey_first(b, t);
 
 		f = &base->f[eytzinger1_prev(n >> 1, t->size)];
+	} else {
+		f = &base->f[n >> 1];
 	}
 
 	return cacheline_to_bkey(b, t, inorder, f->key_offset);
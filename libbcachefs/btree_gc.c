@@ -225,8 +225,8 @@ static int bch2_gc_btree(struct bch_fs *c, enum btree_id btree_id,
 
 	btree_node_range_checks_init(&r, depth);
 
-	__for_each_btree_node(&trans, iter, btree_id, POS_MIN,
-			      0, depth, BTREE_ITER_PREFETCH, b) {
+	__for_each_btree_node(&trans, iter, btree_id, POS_MIN, 0, depth,
+			      BTREE_ITER_PREFETCH|BTREE_ITER_SCAN, b) {
 		btree_node_range_checks(c, b, &r);
 
 		bch2_verify_btree_nr_keys(b);
@@ -738,6 +738,18 @@ int bch2_gc(struct bch_fs *c, struct journal_keys *journal_keys,
 	trace_gc_start(c);
 
 	down_write(&c->gc_lock);
+
+	/*
+	 * Nodes written by a bulk load aren't reachable until it finishes, so
+	 * gc would free their buckets - bch2_btree_bulk_load_finish() will
+	 * kick gc again:
+	 */
+	if (READ_ONCE(c->btree_bulk_loading)) {
+		set_bit(BCH_FS_GC_DEFERRED, &c->flags);
+		up_write(&c->gc_lock);
+		trace_gc_end(c);
+		return -EBUSY;
+	}
 again:
 	ret = bch2_gc_start(c, metadata_only);
 	if (ret)
@@ -1191,7 +1203,7 @@ static int bch2_gc_thread(void *arg)
 		last_kick = atomic_read(&c->kick_gc);
 
 		ret = bch2_gc(c, NULL, false, false);
-		if (ret)
+		if (ret && ret != -EBUSY)
 			bch_err(c, "btree gc failed: %i", ret);
 
 		debug_check_no_locks_held();
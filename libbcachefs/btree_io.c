@@ -1115,8 +1115,14 @@ void bch2_btree_complete_write(struct bch_fs *c, struct btree *b,
 		new &= ~1UL;
 	} while ((v = cmpxchg(&b->will_make_reachable, old, new)) != old);
 
-	if (old & 1)
+	/*
+	 * The node may not be on the btree_update's new_nodes list (bulk
+	 * loads), so all we may touch here is the ref the first write holds:
+	 */
+	if (old & 1) {
+		BUG_ON(!new);
 		closure_put(&((struct btree_update *) new)->cl);
+	}
 
 	bch2_journal_pin_drop(&c->journal, &w->journal);
 	closure_wake_up(&w->wait);
@@ -7,6 +7,7 @@
 #include "btree_locking.h"
 #include "debug.h"
 #include "extents.h"
+#include "super.h"
 
 #include <linux/prefetch.h>
 #include <trace/events/bcachefs.h>
@@ -919,20 +920,90 @@ static inline int btree_iter_lock_root(struct btree_iter *iter,
 	}
 }
 
+#define BTREE_SCAN_WINDOW_MIN		2
+
+/* Read latency of the slowest device btree node @k is on: */
+static u64 btree_node_read_latency(struct bch_fs *c, const struct bkey_i *k)
+{
+	struct bkey_ptrs_c ptrs = bch2_bkey_ptrs_c(bkey_i_to_s_c(k));
+	const struct bch_extent_ptr *ptr;
+	u64 ret = 0;
+
+	bkey_for_each_ptr(ptrs, ptr) {
+		struct bch_dev *ca = bch_dev_bkey_exists(c, ptr->dev);
+
+		ret = max_t(u64, ret, atomic64_read(&ca->cur_latency[READ]));
+	}
+
+	return ret;
+}
+
+/*
+ * BTREE_ITER_SCAN: we just got leaf @b (the read, if any, having started at
+ * @get_start) - returns how many of the following leaves should be in flight.
+ *
+ * Until we've seen the iterator go through a couple of consecutive leaves,
+ * that's none. After that it's however many leaves the iterator gets through
+ * in the time it takes to read one - device read latency over the average time
+ * the iterator spends per leaf - clamped to the btree_scan_readahead option,
+ * and growing at most by doubling each leaf:
+ */
+static unsigned btree_iter_scan_window(struct btree_iter *iter,
+				       struct btree *b, u64 get_start)
+{
+	struct bch_fs *c = iter->trans->c;
+	unsigned max_window = c->opts.btree_scan_readahead;
+	u64 now = local_clock(), latency, window;
+
+	if (bkey_cmp(b->data->min_key, iter->scan_next)) {
+		iter->scan_seq		= 0;
+		iter->scan_window	= BTREE_SCAN_WINDOW_MIN;
+		iter->scan_leaf_ns	= 0;
+	} else {
+		/* Time spent on the previous leaf, not waiting for this one: */
+		u64 leaf_ns = time_after64(get_start, iter->scan_last)
+			? get_start - iter->scan_last
+			: 0;
+
+		iter->scan_leaf_ns = iter->scan_leaf_ns
+			? ewma_add(iter->scan_leaf_ns, leaf_ns, 3)
+			: leaf_ns;
+
+		if (iter->scan_seq < U8_MAX)
+			iter->scan_seq++;
+	}
+
+	iter->scan_next = btree_type_successor(iter->btree_id, b->key.k.p);
+	iter->scan_last = now;
+
+	if (iter->scan_seq < 2 || !max_window)
+		return 0;
+
+	latency = btree_node_read_latency(c, &b->key);
+	window	= div64_u64(latency, max_t(u64, iter->scan_leaf_ns, 1)) + 1;
+	window	= min_t(u64, window, iter->scan_window * 2);
+	window	= min_t(u64, window, max_window);
+	window	= max_t(u64, window, min_t(unsigned, BTREE_SCAN_WINDOW_MIN, max_window));
+
+	iter->scan_window = window;
+	return window;
+}
+
+/*
+ * Start reads of the @nr children of the current node following the one we're
+ * descending into, from the node's key list:
+ */
 noinline
-static void btree_iter_prefetch(struct btree_iter *iter)
+static void btree_iter_prefetch(struct btree_iter *iter, unsigned nr)
 {
 	struct bch_fs *c = iter->trans->c;
 	struct btree_iter_level *l = &iter->l[iter->level];
 	struct btree_node_iter node_iter = l->iter;
 	struct bkey_packed *k;
 	BKEY_PADDED(k) tmp;
-	unsigned nr = test_bit(BCH_FS_STARTED, &c->flags)
-		? (iter->level > 1 ? 0 :  2)
-		: (iter->level > 1 ? 1 : 16);
 	bool was_locked = btree_node_locked(iter, iter->level);
 
-	while (nr) {
+	while (nr--) {
 		if (!bch2_btree_node_relock(iter, iter->level))
 			return;
 
@@ -957,6 +1028,8 @@ static __always_inline int btree_iter_down(struct btree_iter *iter)
 	unsigned level = iter->level - 1;
 	enum six_lock_type lock_type = __btree_lock_want(iter, level);
 	BKEY_PADDED(k) tmp;
+	u64 start = iter->flags & BTREE_ITER_SCAN ? local_clock() : 0;
+	unsigned nr_prefetch = 0;
 
 	EBUG_ON(!btree_node_locked(iter, iter->level));
 
@@ -971,7 +1044,17 @@ static __always_inline int btree_iter_down(struct btree_iter *iter)
 	btree_iter_node_set(iter, b);
 
 	if (iter->flags & BTREE_ITER_PREFETCH)
-		btree_iter_prefetch(iter);
+		nr_prefetch = test_bit(BCH_FS_STARTED, &c->flags)
+			? (level ? 0 :  2)
+			: (level ? 1 : 16);
+
+	if (iter->flags & BTREE_ITER_SCAN)
+		nr_prefetch = max(nr_prefetch, level
+				  ? 1U
+				  : btree_iter_scan_window(iter, b, start));
+
+	if (nr_prefetch)
+		btree_iter_prefetch(iter, nr_prefetch);
 
 	iter->level = level;
 
@@ -1154,6 +1237,7 @@ static int btree_iter_traverse_one(struct btree_iter *iter)
 
 int __must_check __bch2_btree_iter_traverse(struct btree_iter *iter)
 {
+	u64 start = bch2_trans_phase_start(iter->trans);
 	int ret;
 
 	ret =   bch2_trans_cond_resched(iter->trans) ?:
@@ -1161,6 +1245,7 @@ int __must_check __bch2_btree_iter_traverse(struct btree_iter *iter)
 	if (unlikely(ret))
 		ret = __btree_iter_traverse_all(iter->trans, iter, ret);
 
+	bch2_trans_phase_end(iter->trans, BTREE_TRANS_PHASE_traverse, start);
 	return ret;
 }
 
@@ -1733,6 +1818,146 @@ struct bkey_s_c bch2_btree_iter_next_slot(struct btree_iter *iter)
 	return __bch2_btree_iter_peek_slot(iter);
 }
 
+/* Batched lookups: */
+
+#define BTREE_LOOKUP_MANY_PREFETCH	4
+
+/*
+ * We just moved to a new leaf: start reads of the leaves the next few
+ * positions we'll be looking up are in, from the parent node's key list:
+ */
+static void btree_lookup_many_prefetch(struct btree_iter *iter,
+				       const struct bpos *pos, unsigned nr)
+{
+	struct bch_fs *c = iter->trans->c;
+	struct btree_iter_level *l = &iter->l[1];
+	struct btree *leaf = iter->l[0].b;
+	struct btree_node_iter node_iter;
+	struct bkey_packed *k;
+	BKEY_PADDED(k) tmp;
+	unsigned nr_prefetch = BTREE_LOOKUP_MANY_PREFETCH;
+	bool was_locked;
+
+	while (nr && bkey_cmp(*pos, leaf->key.k.p) <= 0) {
+		pos++;
+		--nr;
+	}
+
+	if (!nr || !is_btree_node(iter, 1))
+		return;
+
+	was_locked = btree_node_locked(iter, 1);
+	if (!bch2_btree_node_relock(iter, 1))
+		return;
+
+	node_iter = l->iter;
+
+	while (nr && nr_prefetch &&
+	       (k = bch2_btree_node_iter_peek(&node_iter, l->b))) {
+		bch2_bkey_unpack(l->b, &tmp.k, k);
+
+		if (bkey_cmp(*pos, tmp.k.k.p) <= 0) {
+			bch2_btree_node_prefetch(c, iter, &tmp.k, 0);
+			--nr_prefetch;
+
+			while (nr && bkey_cmp(*pos, tmp.k.k.p) <= 0) {
+				pos++;
+				--nr;
+			}
+		}
+
+		bch2_btree_node_iter_advance(&node_iter, l->b);
+	}
+
+	if (!was_locked)
+		btree_node_unlock(iter, 1);
+}
+
+/**
+ * bch2_btree_lookup_many - look up many positions in one btree
+ * @trans:	btree transaction; results are allocated from its memory
+ * @btree_id:	btree to search
+ * @pos:	positions to look up, in ascending order
+ * @nr:		number of positions
+ * @flags:	BTREE_ITER_* flags for the iterator
+ * @ret:	on success, an array of @nr keys, copied into transaction memory:
+ *		for each position, the key at that position (for extents, the
+ *		extent overlapping it) - or a deleted key, if there isn't one
+ *
+ * Equivalent to bch2_btree_iter_set_pos() and bch2_btree_iter_peek_slot() for
+ * each position, but positions in the same leaf as the previous one only
+ * advance the node iterator instead of rewalking the path, and when we move to
+ * a new leaf we start reads of the leaves the following positions are in.
+ *
+ * Returns 0 on success, or an error - -EINTR meaning the transaction must be
+ * restarted.
+ */
+int bch2_btree_lookup_many(struct btree_trans *trans, enum btree_id btree_id,
+			   const struct bpos *pos, unsigned nr,
+			   unsigned flags, struct bkey_s_c **ret)
+{
+	struct btree_iter *iter;
+	struct btree *leaf = NULL;
+	struct bkey_s_c *keys, k;
+	struct bkey_i *copy;
+	unsigned i;
+	int err = 0;
+
+	keys = bch2_trans_kmalloc(trans, sizeof(*keys) * nr);
+	if (IS_ERR(keys))
+		return PTR_ERR(keys);
+
+	if (!nr)
+		goto out;
+
+	iter = bch2_trans_get_iter(trans, btree_id, pos[0],
+				   flags|BTREE_ITER_SLOTS);
+	if (IS_ERR(iter))
+		return PTR_ERR(iter);
+
+	for (i = 0; i < nr; i++) {
+		EBUG_ON(i && bkey_cmp(pos[i], pos[i - 1]) < 0);
+
+		if (i && !bkey_cmp(pos[i], pos[i - 1])) {
+			keys[i] = keys[i - 1];
+			continue;
+		}
+
+		if (iter->uptodate <= BTREE_ITER_NEED_PEEK &&
+		    btree_node_locked(iter, 0) &&
+		    bkey_cmp(pos[i], iter->pos) >= 0 &&
+		    bkey_cmp(pos[i], iter->l[0].b->key.k.p) <= 0)
+			bch2_btree_iter_set_pos_same_leaf(iter, pos[i]);
+		else
+			bch2_btree_iter_set_pos(iter, pos[i]);
+
+		k = bch2_btree_iter_peek_slot(iter);
+		err = bkey_err(k);
+		if (err)
+			break;
+
+		if (iter->l[0].b != leaf) {
+			leaf = iter->l[0].b;
+			btree_lookup_many_prefetch(iter, pos + i + 1, nr - i - 1);
+		}
+
+		copy = bch2_trans_kmalloc(trans, bkey_bytes(k.k));
+		if (IS_ERR(copy)) {
+			err = PTR_ERR(copy);
+			break;
+		}
+
+		bkey_reassemble(copy, k);
+		keys[i] = bkey_i_to_s_c(copy);
+	}
+
+	bch2_trans_iter_put(trans, iter);
+out:
+	if (!err)
+		*ret = keys;
+	return err;
+}
+
 static inline void bch2_btree_iter_init(struct btree_trans *trans,
 			struct btree_iter *iter, enum btree_id btree_id,
 			struct bpos pos, unsigned flags)
@@ -1759,6 +1984,12 @@ static inline void bch2_btree_iter_init(struct btree_trans *trans,
 		iter->l[i].b		= NULL;
 	iter->l[iter->level].b		= BTREE_ITER_NO_NODE_INIT;
 
+	iter->scan_next			= POS_MIN;
+	iter->scan_seq			= 0;
+	iter->scan_window		= BTREE_SCAN_WINDOW_MIN;
+	iter->scan_last			= 0;
+	iter->scan_leaf_ns		= 0;
+
 	prefetch(c->btree_roots[btree_id].b);
 }
 
@@ -1961,8 +2192,10 @@ static struct btree_iter *__btree_trans_get_iter(struct btree_trans *trans,
 	}
 
 	iter->flags &= ~BTREE_ITER_KEEP_UNTIL_COMMIT;
-	iter->flags &= ~(BTREE_ITER_SLOTS|BTREE_ITER_INTENT|BTREE_ITER_PREFETCH);
-	iter->flags |= flags & (BTREE_ITER_SLOTS|BTREE_ITER_INTENT|BTREE_ITER_PREFETCH);
+	iter->flags &= ~(BTREE_ITER_SLOTS|BTREE_ITER_INTENT|
+			 BTREE_ITER_PREFETCH|BTREE_ITER_SCAN);
+	iter->flags |= flags & (BTREE_ITER_SLOTS|BTREE_ITER_INTENT|
+				BTREE_ITER_PREFETCH|BTREE_ITER_SCAN);
 
 	if (iter->flags & BTREE_ITER_INTENT)
 		bch2_btree_iter_upgrade(iter, 1);
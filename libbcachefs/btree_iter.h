@@ -168,6 +168,10 @@ struct bkey_s_c bch2_btree_iter_next_slot(struct btree_iter *);
 void bch2_btree_iter_set_pos_same_leaf(struct btree_iter *, struct bpos);
 void bch2_btree_iter_set_pos(struct btree_iter *, struct bpos);
 
+int bch2_btree_lookup_many(struct btree_trans *, enum btree_id,
+			   const struct bpos *, unsigned, unsigned,
+			   struct bkey_s_c **);
+
 static inline struct bpos btree_type_successor(enum btree_id id,
 					       struct bpos pos)
 {
@@ -289,6 +293,19 @@ struct btree_iter *bch2_trans_get_node_iter(struct btree_trans *,
 				enum btree_id, struct bpos,
 				unsigned, unsigned, unsigned);
 
+static inline u64 bch2_trans_phase_start(struct btree_trans *trans)
+{
+	return unlikely(trans->phase_time) ? local_clock() : 0;
+}
+
+static inline void bch2_trans_phase_end(struct btree_trans *trans,
+					enum btree_trans_phase phase,
+					u64 start)
+{
+	if (unlikely(trans->phase_time))
+		trans->phase_time[phase] += local_clock() - start;
+}
+
 #define TRANS_RESET_ITERS		(1 << 0)
 #define TRANS_RESET_MEM			(1 << 1)
 
@@ -121,6 +121,11 @@ struct btree {
 	 * If a btree node isn't reachable yet, we don't want to kick off
 	 * another write - because that write also won't yet be reachable and
 	 * marking it as completed before it's reachable would be incorrect:
+	 *
+	 * Pointer to the btree_update that will make it reachable; bit 0 is set
+	 * while the first write is in flight, and holds a ref on the
+	 * btree_update's closure. Usually the node is also on that update's
+	 * new_nodes list, except for nodes written by a bulk load.
 	 */
 	unsigned long		will_make_reachable;
 
@@ -195,6 +200,12 @@ enum btree_iter_type {
  */
 #define BTREE_ITER_IS_EXTENTS		(1 << 6)
 #define BTREE_ITER_ERROR		(1 << 7)
+/*
+ * Iterator is going to walk sequentially over a large range: once it's seen
+ * descending into consecutive leaves, keep a window of leaf reads in flight
+ * ahead of it, sized by device read latency and how fast it's going:
+ */
+#define BTREE_ITER_SCAN			(1 << 8)
 
 enum btree_iter_uptodate {
 	BTREE_ITER_UPTODATE		= 0,
@@ -216,7 +227,7 @@ struct btree_iter {
 	struct btree_trans	*trans;
 	struct bpos		pos;
 
-	u8			flags;
+	u16			flags;
 	enum btree_iter_uptodate uptodate:4;
 	enum btree_id		btree_id:4;
 	unsigned		level:4,
@@ -235,6 +246,17 @@ struct btree_iter {
 	 * bch2_btree_iter_next_slot() can correctly advance pos.
 	 */
 	struct bkey		k;
+
+	/*
+	 * BTREE_ITER_SCAN: min_key the next leaf has if we're going
+	 * sequentially, number of consecutive leaves seen, when we got the last
+	 * leaf, average time spent per leaf and current readahead window:
+	 */
+	struct bpos		scan_next;
+	u8			scan_seq;
+	u8			scan_window;
+	u64			scan_last;
+	u64			scan_leaf_ns;
 };
 
 static inline enum btree_iter_type btree_iter_type(struct btree_iter *iter)
@@ -249,6 +271,24 @@ struct btree_insert_entry {
 
 #define BTREE_ITER_MAX		64
 
+/*
+ * Phases of a btree operation that can optionally be timed, by pointing
+ * trans->phase_time at an array of BTREE_TRANS_PHASE_NR u64s - used by the
+ * btree perf tests:
+ */
+#define BTREE_TRANS_PHASES()		\
+	x(traverse)			\
+	x(lock_wait)			\
+	x(journal_res)			\
+	x(bset_insert)
+
+enum btree_trans_phase {
+#define x(n)	BTREE_TRANS_PHASE_##n,
+	BTREE_TRANS_PHASES()
+#undef x
+	BTREE_TRANS_PHASE_NR
+};
+
 struct btree_trans {
 	struct bch_fs		*c;
 	unsigned long		ip;
@@ -281,6 +321,9 @@ struct btree_trans {
 	unsigned		journal_u64s;
 	struct replicas_delta_list *fs_usage_deltas;
 
+	/* nsec, indexed by enum btree_trans_phase; normally NULL: */
+	u64			*phase_time;
+
 	struct btree_iter	iters_onstack[2];
 	struct btree_insert_entry updates_onstack[6];
 	u8			updates_sorted_onstack[6];
@@ -350,17 +350,10 @@ mem_alloc:
 	return b;
 }
 
-static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned level)
+static void btree_node_init_new(struct bch_fs *c, struct btree *b,
+				enum btree_id id, unsigned level)
 {
-	struct bch_fs *c = as->c;
-	struct btree *b;
-
-	BUG_ON(level >= BTREE_MAX_DEPTH);
-	BUG_ON(!as->reserve->nr);
-
-	b = as->reserve->b[--as->reserve->nr];
-
-	BUG_ON(bch2_btree_node_hash_insert(&c->btree_cache, b, level, as->btree_id));
+	BUG_ON(bch2_btree_node_hash_insert(&c->btree_cache, b, level, id));
 
 	set_btree_node_accessed(b);
 	set_btree_node_dirty(b);
@@ -370,11 +363,24 @@ static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned lev
 	memset(&b->nr, 0, sizeof(b->nr));
 	b->data->magic = cpu_to_le64(bset_magic(c));
 	b->data->flags = 0;
-	SET_BTREE_NODE_ID(b->data, as->btree_id);
+	SET_BTREE_NODE_ID(b->data, id);
 	SET_BTREE_NODE_LEVEL(b->data, level);
 	b->data->ptr = bkey_i_to_btree_ptr(&b->key)->v.start[0];
 
 	bch2_btree_build_aux_trees(b);
+}
+
+static struct btree *bch2_btree_node_alloc(struct btree_update *as, unsigned level)
+{
+	struct bch_fs *c = as->c;
+	struct btree *b;
+
+	BUG_ON(level >= BTREE_MAX_DEPTH);
+	BUG_ON(!as->reserve->nr);
+
+	b = as->reserve->b[--as->reserve->nr];
+
+	btree_node_init_new(c, b, as->btree_id, level);
 
 	btree_node_will_make_reachable(as, b);
 
@@ -2149,6 +2155,630 @@ err_free_update:
 	goto err;
 }
 
+/* Bulk loading: */
+
+/*
+ * Builds a btree bottom up from keys that arrive in sorted order, instead of
+ * inserting them one at a time: each level stages keys until the next one
+ * wouldn't fit in a node packed with the best format for everything staged so
+ * far, then packs them into a new node and passes the pointer to that node up
+ * to the next level.
+ *
+ * Nodes are written out as soon as they're full, but none of them are
+ * reachable until the root is swapped in at the end. So the btree has to be
+ * empty when we start and when we finish, and nothing else may be inserting
+ * into it - we only load btrees on filesystems that aren't mounted. gc can't
+ * see nodes that aren't reachable yet and would free their buckets out from
+ * under us, so it's deferred until the load finishes (c->btree_bulk_loading),
+ * and we take gc_lock whenever we're writing nodes or marking keys.
+ *
+ * Nodes we write aren't on the btree_update's new_nodes list - there's only
+ * room there for what a split needs - but they still use will_make_reachable
+ * to hold a ref on the btree_update until their first write completes, see
+ * bch2_btree_complete_write(). We wait on those writes ourselves before the
+ * root is made reachable.
+ */
+
+#define BTREE_BULK_LOAD_WRITES_INFLIGHT	32
+
+struct btree_bulk_load_level {
+	struct keylist		keys;
+	struct bkey_format_state format;
+	struct bpos		min_key;
+	struct bpos		max_key;
+	unsigned		nr_keys;
+	unsigned		val_u64s;
+	unsigned		nr_nodes;
+};
+
+struct btree_bulk_load {
+	struct bch_fs		*c;
+	enum btree_id		btree_id;
+	int			ret;
+
+	struct btree_update	*as;
+	struct disk_reservation	*data_res;
+	struct disk_reservation	disk_res;
+
+	struct bpos		pos;
+	u64			nr_keys;
+
+	size_t			buf_u64s;
+	unsigned		nr_levels;
+	struct btree_bulk_load_level level[BTREE_MAX_DEPTH];
+
+	u64			nr_written;
+	struct btree		*inflight[BTREE_BULK_LOAD_WRITES_INFLIGHT];
+};
+
+static void btree_bulk_load_level_reset(struct btree_bulk_load_level *l,
+					struct bpos min_key)
+{
+	l->keys.top	= l->keys.keys;
+	l->min_key	= min_key;
+	l->max_key	= min_key;
+	l->nr_keys	= 0;
+	l->val_u64s	= 0;
+
+	bch2_bkey_format_init(&l->format);
+	bch2_bkey_format_add_pos(&l->format, min_key);
+}
+
+/*
+ * Would the staged keys plus @k still fit in a single node, with the format
+ * we'd pick for them?
+ */
+static bool btree_bulk_load_fits(struct btree_bulk_load *load,
+				 struct btree_bulk_load_level *l,
+				 struct bkey_i *k)
+{
+	struct bkey_format_state s = l->format;
+	struct bkey_format f;
+	size_t u64s;
+
+	if (bch_keylist_u64s(&l->keys) + k->k.u64s > load->buf_u64s)
+		return false;
+
+	bch2_bkey_format_add_key(&s, &k->k);
+	f = bch2_bkey_format_done(&s);
+
+	u64s = (l->nr_keys + 1) * f.key_u64s +
+		l->val_u64s + bkey_val_u64s(&k->k);
+
+	return __vstruct_bytes(struct btree_node, u64s) < btree_bytes(load->c);
+}
+
+static void btree_bulk_load_mark_keys(struct btree_bulk_load *load,
+				      struct bkey_i *k, struct bkey_i *end,
+				      struct disk_reservation *res)
+{
+	struct bch_fs *c = load->c;
+	struct bch_fs_usage *fs_usage;
+
+	/*
+	 * gc can't be running (we hold gc_lock), so there's no need to mark
+	 * the gc copy of the bucket marks as well:
+	 */
+	percpu_down_read(&c->mark_lock);
+	fs_usage = bch2_fs_usage_scratch_get(c);
+
+	for (; k != end; k = bkey_next(k))
+		bch2_mark_key_locked(c, bkey_i_to_s_c(k),
+				     0, k->k.size, fs_usage, 0,
+				     BCH_BUCKET_MARK_INSERT);
+
+	bch2_fs_usage_apply(c, fs_usage, res, 0);
+	bch2_fs_usage_scratch_put(c, fs_usage);
+	percpu_up_read(&c->mark_lock);
+}
+
+static struct btree *btree_bulk_load_node_alloc(struct btree_bulk_load *load,
+						unsigned level)
+{
+	struct bch_fs *c = load->c;
+	struct closure cl;
+	struct btree *b;
+	int ret;
+
+	closure_init_stack(&cl);
+
+	ret = bch2_disk_reservation_add(c, &load->disk_res,
+			c->opts.btree_node_size * c->opts.metadata_replicas, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	while (1) {
+		do {
+			ret = bch2_btree_cache_cannibalize_lock(c, &cl);
+			closure_sync(&cl);
+		} while (ret);
+
+		b = __bch2_btree_node_alloc(c, &load->disk_res, &cl, 0);
+		bch2_btree_cache_cannibalize_unlock(c);
+
+		if (PTR_ERR_OR_ZERO(b) != -EAGAIN)
+			break;
+
+		/*
+		 * Don't wait on the allocator with gc_lock held: the allocator
+		 * may be waiting on gc, and gc on gc_lock. gc will see that
+		 * we're loading and defer itself, so it can't free our nodes:
+		 */
+		up_read(&c->gc_lock);
+		closure_sync(&cl);
+		down_read(&c->gc_lock);
+	}
+
+	if (IS_ERR(b))
+		return b;
+
+	ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(&b->key));
+	if (ret) {
+		bch2_open_buckets_put(c, &b->ob);
+		__btree_node_free(c, b);
+		six_unlock_write(&b->lock);
+		six_unlock_intent(&b->lock);
+		return ERR_PTR(ret);
+	}
+
+	btree_node_init_new(c, b, load->btree_id, level);
+
+	/* Not on as->new_nodes, see the comment at the top of this section: */
+	b->will_make_reachable = 1UL|(unsigned long) load->as;
+	closure_get(&load->as->cl);
+
+	return b;
+}
+
+static void btree_bulk_load_node_retire(struct bch_fs *c, struct btree *b)
+{
+	btree_node_wait_on_io(b);
+
+	/* bch2_btree_complete_write() dropped our ref on as: */
+	b->will_make_reachable = 0;
+
+	bch2_open_buckets_put(c, &b->ob);
+	six_unlock_intent(&b->lock);
+}
+
+static void btree_bulk_load_drain(struct btree_bulk_load *load)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(load->inflight); i++)
+		if (load->inflight[i]) {
+			btree_bulk_load_node_retire(load->c, load->inflight[i]);
+			load->inflight[i] = NULL;
+		}
+}
+
+/*
+ * Pack everything staged at @level into @b, and start staging the next node at
+ * this level:
+ */
+static void btree_bulk_load_node_fill(struct btree_bulk_load *load,
+				      struct btree *b, unsigned level,
+				      struct bpos max_key)
+{
+	struct btree_bulk_load_level *l = &load->level[level];
+	struct bset *i = btree_bset_first(b);
+	struct bkey_packed *out = i->start;
+	struct bkey_i *k;
+
+	if (!level &&
+	    btree_node_type_needs_gc(__btree_node_type(0, load->btree_id)))
+		btree_bulk_load_mark_keys(load, l->keys.keys, l->keys.top,
+					  load->data_res);
+
+	b->data->min_key	= l->min_key;
+	b->data->max_key	= max_key;
+	b->data->format		= bch2_bkey_format_done(&l->format);
+	b->key.k.p		= max_key;
+
+	btree_node_set_format(b, b->data->format);
+
+	for_each_keylist_key(&l->keys, k) {
+		/* the format was computed from these keys: */
+		BUG_ON(!bch2_bkey_pack(out, k, &b->format));
+
+		btree_keys_account_key_add(&b->nr, 0, out);
+		out = bkey_next(out);
+	}
+
+	i->u64s = cpu_to_le16((u64 *) out - i->_data);
+	set_btree_bset_end(b, b->set);
+	btree_node_reset_sib_u64s(b);
+
+	bch2_btree_build_aux_trees(b);
+	six_unlock_write(&b->lock);
+
+	/* the last node at each level ends at POS_MAX, with nothing after: */
+	if (bkey_cmp(max_key, POS_MAX))
+		btree_bulk_load_level_reset(l,
+			btree_type_successor(load->btree_id, max_key));
+}
+
+static int btree_bulk_load_stage(struct btree_bulk_load *, unsigned,
+				 struct bkey_i *);
+
+static int btree_bulk_load_emit(struct btree_bulk_load *load, unsigned level,
+				struct bpos max_key)
+{
+	struct btree *b;
+	unsigned idx;
+
+	b = btree_bulk_load_node_alloc(load, level);
+	if (IS_ERR(b))
+		return PTR_ERR(b);
+
+	btree_bulk_load_node_fill(load, b, level, max_key);
+	load->level[level].nr_nodes++;
+
+	bch2_btree_node_write(load->c, b, SIX_LOCK_intent);
+
+	btree_bulk_load_mark_keys(load, &b->key, bkey_next(&b->key),
+				  &load->disk_res);
+
+	/* Keep a bounded number of writes in flight: */
+	idx = load->nr_written++ % ARRAY_SIZE(load->inflight);
+	if (load->inflight[idx])
+		btree_bulk_load_node_retire(load->c, load->inflight[idx]);
+	load->inflight[idx] = b;
+
+	return btree_bulk_load_stage(load, level + 1, &b->key);
+}
+
+static int btree_bulk_load_level_init(struct btree_bulk_load *load,
+				      unsigned level)
+{
+	struct btree_bulk_load_level *l = &load->level[level];
+	u64 *buf;
+
+	if (level >= BTREE_MAX_DEPTH)
+		return -E2BIG;
+
+	buf = kvpmalloc(load->buf_u64s * sizeof(u64), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+
+	bch2_keylist_init(&l->keys, buf);
+	btree_bulk_load_level_reset(l, POS_MIN);
+	load->nr_levels = level + 1;
+	return 0;
+}
+
+static int btree_bulk_load_stage(struct btree_bulk_load *load, unsigned level,
+				 struct bkey_i *k)
+{
+	struct btree_bulk_load_level *l;
+	int ret;
+
+	if (level >= load->nr_levels) {
+		ret = btree_bulk_load_level_init(load, level);
+		if (ret)
+			return ret;
+	}
+
+	l = &load->level[level];
+
+	if (l->nr_keys && !btree_bulk_load_fits(load, l, k)) {
+		ret = btree_bulk_load_emit(load, level, l->max_key);
+		if (ret)
+			return ret;
+	}
+
+	bch2_bkey_format_add_key(&l->format, &k->k);
+	bch2_keylist_add(&l->keys, k);
+	l->max_key = k->k.p;
+	l->nr_keys++;
+	l->val_u64s += bkey_val_u64s(&k->k);
+	return 0;
+}
+
+/**
+ * bch2_btree_bulk_load_add - add the next key to a bulk load
+ *
+ * Keys must be added in strictly increasing order (and must not overlap, for
+ * extents); deleted keys are skipped.
+ */
+int bch2_btree_bulk_load_add(struct btree_bulk_load *load, struct bkey_i *k)
+{
+	struct bch_fs *c = load->c;
+	enum btree_node_type type = __btree_node_type(0, load->btree_id);
+	int ret;
+
+	if (load->ret)
+		return load->ret;
+
+	if (bkey_deleted(&k->k))
+		return 0;
+
+	if (load->nr_keys &&
+	    (btree_node_type_is_extents(type)
+	     ? bkey_cmp(bkey_start_pos(&k->k), load->pos) < 0
+	     : bkey_cmp(k->k.p, load->pos) <= 0))
+		return -EINVAL;
+
+	if (bch2_bkey_invalid(c, bkey_i_to_s_c(k), type))
+		return -EINVAL;
+
+	ret = bch2_mark_bkey_replicas(c, bkey_i_to_s_c(k));
+	if (ret)
+		return ret;
+
+	down_read(&c->gc_lock);
+	ret = btree_bulk_load_stage(load, 0, k);
+	up_read(&c->gc_lock);
+
+	if (ret) {
+		load->ret = ret;
+		return ret;
+	}
+
+	load->pos = k->k.p;
+	load->nr_keys++;
+	return 0;
+}
+
+static bool btree_bulk_load_btree_empty(struct bch_fs *c, struct btree *b)
+{
+	struct btree_node_iter node_iter;
+	struct bkey unpacked;
+	struct bkey_s_c k;
+
+	if (b != btree_node_root(c, b))
+		return false;
+
+	for_each_btree_node_key_unpack(b, k, &node_iter, &unpacked)
+		return false;
+
+	return true;
+}
+
+static int btree_bulk_load_check_empty(struct bch_fs *c, enum btree_id id)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	/* Intent lock on the leaf, so nothing can insert while we check: */
+	iter = bch2_trans_get_node_iter(&trans, id, POS_MIN, 1, 0, 0);
+	ret = PTR_ERR_OR_ZERO(iter);
+	if (ret)
+		goto err;
+
+	ret = bch2_btree_iter_traverse(iter);
+	if (ret)
+		goto err;
+
+	if (!btree_bulk_load_btree_empty(c, iter->l[0].b))
+		ret = -EEXIST;
+err:
+	if (ret == -EINTR)
+		goto retry;
+
+	bch2_trans_exit(&trans);
+	return ret;
+}
+
+static void btree_bulk_load_end(struct bch_fs *c, enum btree_id id)
+{
+	bool kick_gc;
+
+	down_read(&c->gc_lock);
+	clear_bit(id, &c->btree_bulk_loading);
+	kick_gc = test_and_clear_bit(BCH_FS_GC_DEFERRED, &c->flags);
+	up_read(&c->gc_lock);
+
+	/* If another load is still running, gc will just defer again: */
+	if (kick_gc && c->gc_thread) {
+		atomic_inc(&c->kick_gc);
+		wake_up_process(c->gc_thread);
+	}
+}
+
+/**
+ * bch2_btree_bulk_load_start - start building btree @id from sorted keys
+ *
+ * @disk_res is charged for the data the keys point to, as with
+ * bch2_trans_commit(), and may be NULL if there isn't any.
+ *
+ * Fails with -EBUSY if the filesystem is mounted or the btree is already being
+ * loaded, and -EEXIST if the btree isn't empty. gc is deferred until the load
+ * is finished.
+ */
+struct btree_bulk_load *bch2_btree_bulk_load_start(struct bch_fs *c,
+						   enum btree_id id,
+						   struct disk_reservation *disk_res)
+{
+	struct btree_bulk_load *load;
+	struct btree_update *as;
+	struct closure cl;
+	int ret;
+
+	/* the new root must be written before it's made reachable: */
+	if (test_bit(BCH_FS_HOLD_BTREE_WRITES, &c->flags))
+		return ERR_PTR(-EROFS);
+
+	/* Mounted, so its btrees are live - anything could be inserting: */
+	if (c->vfs_sb)
+		return ERR_PTR(-EBUSY);
+
+	closure_init_stack(&cl);
+
+	/*
+	 * Reserve the new root now, while we're allowed to wait - once the
+	 * load has started gc is deferred, and the allocator may be waiting
+	 * on gc:
+	 */
+	while (1) {
+		down_read(&c->gc_lock);
+		as = bch2_btree_update_start(c, id, 1, 0, &cl);
+		up_read(&c->gc_lock);
+
+		if (PTR_ERR_OR_ZERO(as) != -EAGAIN)
+			break;
+
+		closure_sync(&cl);
+	}
+
+	if (IS_ERR(as))
+		return ERR_CAST(as);
+
+	/* Synchronize with gc, which checks c->btree_bulk_loading: */
+	down_read(&c->gc_lock);
+	ret = test_and_set_bit(id, &c->btree_bulk_loading) ? -EBUSY : 0;
+	up_read(&c->gc_lock);
+
+	if (ret)
+		goto err_free_update;
+
+	ret = btree_bulk_load_check_empty(c, id);
+	if (ret)
+		goto err;
+
+	load = kzalloc(sizeof(*load), GFP_KERNEL);
+	if (!load) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	load->c		= c;
+	load->btree_id	= id;
+	load->as	= as;
+	load->data_res	= disk_res;
+	load->disk_res	= bch2_disk_reservation_init(c, c->opts.metadata_replicas);
+	load->buf_u64s	= 2 * btree_bytes(c) / sizeof(u64);
+
+	return load;
+err:
+	btree_bulk_load_end(c, id);
+err_free_update:
+	bch2_btree_update_free(as);
+	return ERR_PTR(ret);
+}
+
+static int btree_bulk_load_set_root(struct btree_bulk_load *load,
+				    struct btree *n)
+{
+	struct bch_fs *c = load->c;
+	struct btree_update *as = load->as;
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree *b;
+	int ret;
+
+	bch2_trans_init(&trans, c, 0, 0);
+retry:
+	bch2_trans_begin(&trans);
+
+	iter = bch2_trans_get_node_iter(&trans, load->btree_id, POS_MIN,
+					BTREE_MAX_DEPTH, 0, 0);
+	ret = PTR_ERR_OR_ZERO(iter);
+	if (ret)
+		goto err;
+
+	ret = bch2_btree_iter_traverse(iter);
+	if (ret)
+		goto err;
+
+	/* Checked in bch2_btree_bulk_load_start(), but someone may have inserted: */
+	b = iter->l[0].b;
+	if (!btree_bulk_load_btree_empty(c, b)) {
+		ret = -EEXIST;
+		goto err;
+	}
+
+	bch2_btree_interior_update_will_free_node(as, b);
+
+	bch2_btree_node_write(c, n, SIX_LOCK_intent);
+
+	bch2_btree_set_root(as, n, iter);
+
+	bch2_open_buckets_put(c, &n->ob);
+
+	six_lock_increment(&b->lock, SIX_LOCK_intent);
+	bch2_btree_iter_node_drop(iter, b);
+	bch2_btree_node_free_inmem(c, b, iter);
+	six_unlock_intent(&n->lock);
+
+	bch2_trans_exit(&trans);
+
+	bch2_btree_update_done(as);
+	return 0;
+err:
+	if (ret == -EINTR)
+		goto retry;
+
+	bch2_trans_exit(&trans);
+
+	clear_btree_node_need_write(n);
+	bch2_btree_node_free_never_inserted(c, n);
+	six_unlock_intent(&n->lock);
+	return ret;
+}
+
+/**
+ * bch2_btree_bulk_load_finish - finish a bulk load and make it visible
+ *
+ * Writes out whatever is still staged, then replaces the (empty) root of the
+ * btree with the root of the new tree. @load is freed whether or not this
+ * succeeds.
+ *
+ * On failure the btree is left empty, but nodes that were already written and
+ * the accounting for keys that were already added aren't undone - they're
+ * leaked until the next gc, which will fix them up.
+ */
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *load)
+{
+	struct bch_fs *c = load->c;
+	struct btree *root = NULL;
+	unsigned level;
+	int ret = load->ret;
+
+	down_read(&c->gc_lock);
+
+	if (!ret && !load->nr_levels)
+		ret = btree_bulk_load_level_init(load, 0);
+
+	/*
+	 * Emitting the last node at a level adds a key to the level above it;
+	 * the first level that never had to emit a node is the root:
+	 */
+	for (level = 0; !ret && level < load->nr_levels; level++) {
+		if (load->level[level].nr_nodes) {
+			ret = btree_bulk_load_emit(load, level, POS_MAX);
+		} else {
+			root = bch2_btree_node_alloc(load->as, level);
+			btree_bulk_load_node_fill(load, root, level, POS_MAX);
+			break;
+		}
+	}
+
+	btree_bulk_load_drain(load);
+
+	if (!ret)
+		ret = btree_bulk_load_set_root(load, root);
+	if (ret)
+		bch2_btree_update_free(load->as);
+
+	bch2_disk_reservation_put(c, &load->disk_res);
+	up_read(&c->gc_lock);
+
+	btree_bulk_load_end(c, load->btree_id);
+
+	for (level = 0; level < load->nr_levels; level++)
+		kvpfree(load->level[level].keys.keys_p,
+			load->buf_u64s * sizeof(u64));
+	kfree(load);
+
+	return ret;
+}
+
 /* Init code: */
 
 /*
@@ -184,6 +184,20 @@ static inline void bch2_foreground_maybe_merge(struct bch_fs *c,
 					    btree_next_sib);
 }
 
+/*
+ * Bulk loading an empty btree from sorted keys, on a filesystem that isn't
+ * mounted: nothing else may insert into the btree until the load is finished
+ * (if something does, finishing fails with -EEXIST). gc is deferred while a
+ * load is open, so always finish the load:
+ */
+struct btree_bulk_load;
+
+struct btree_bulk_load *bch2_btree_bulk_load_start(struct bch_fs *,
+						   enum btree_id,
+						   struct disk_reservation *);
+int bch2_btree_bulk_load_add(struct btree_bulk_load *, struct bkey_i *);
+int bch2_btree_bulk_load_finish(struct btree_bulk_load *);
+
 void bch2_btree_set_root_for_read(struct bch_fs *, struct btree *);
 void bch2_btree_root_alloc(struct bch_fs *, enum btree_id);
 
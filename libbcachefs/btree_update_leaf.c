@@ -413,6 +413,7 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 		: 0;
 	unsigned iter, u64s = 0;
 	bool marking = false;
+	u64 start;
 	int ret;
 
 	if (race_fault()) {
@@ -454,8 +455,10 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	 * succeed:
 	 */
 	if (likely(!(trans->flags & BTREE_INSERT_JOURNAL_REPLAY))) {
+		start = bch2_trans_phase_start(trans);
 		ret = bch2_trans_journal_res_get(trans,
 				JOURNAL_RES_GET_NONBLOCK);
+		bch2_trans_phase_end(trans, BTREE_TRANS_PHASE_journal_res, start);
 		if (ret)
 			goto err;
 	}
@@ -493,8 +496,10 @@ bch2_trans_commit_write_locked(struct btree_trans *trans,
 	if (unlikely(c->gc_pos.phase))
 		bch2_trans_mark_gc(trans);
 
+	start = bch2_trans_phase_start(trans);
 	trans_for_each_update(trans, i)
 		do_btree_insert_one(trans, i);
+	bch2_trans_phase_end(trans, BTREE_TRANS_PHASE_bset_insert, start);
 err:
 	if (marking) {
 		bch2_fs_usage_scratch_put(c, fs_usage);
@@ -513,6 +518,7 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	struct btree_insert_entry *i;
 	struct btree_iter *iter;
 	unsigned idx, u64s, journal_preres_u64s = 0;
+	u64 start;
 	int ret;
 
 	/*
@@ -544,12 +550,14 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 		trans->journal_u64s += u64s;
 	}
 
+	start = bch2_trans_phase_start(trans);
 	ret = bch2_journal_preres_get(&trans->c->journal,
 			&trans->journal_preres, journal_preres_u64s,
 			JOURNAL_RES_GET_NONBLOCK);
 	if (unlikely(ret == -EAGAIN))
 		ret = bch2_trans_journal_preres_get_cold(trans,
 						journal_preres_u64s);
+	bch2_trans_phase_end(trans, BTREE_TRANS_PHASE_journal_res, start);
 	if (unlikely(ret))
 		return ret;
 
@@ -579,10 +587,12 @@ static inline int do_bch2_trans_commit(struct btree_trans *trans,
 	 */
 	btree_trans_sort_updates(trans);
 
+	start = bch2_trans_phase_start(trans);
 	trans_for_each_update_sorted(trans, i, idx)
 		if (!same_leaf_as_prev(trans, idx))
 			bch2_btree_node_lock_for_insert(trans->c,
 						i->iter->l[0].b, i->iter);
+	bch2_trans_phase_end(trans, BTREE_TRANS_PHASE_lock_wait, start);
 
 	ret = bch2_trans_commit_write_locked(trans, stopped_at);
 
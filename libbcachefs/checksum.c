@@ -67,6 +67,23 @@ static u64 bch2_checksum_update(unsigned type, u64 crc, const void *data, size_t
 	}
 }
 
+/* bch2_checksum_update() over @len zeroes, in O(log len) time: */
+static u64 bch2_checksum_shift(unsigned type, u64 crc, size_t len)
+{
+	switch (type) {
+	case BCH_CSUM_NONE:
+		return 0;
+	case BCH_CSUM_CRC32C_NONZERO:
+	case BCH_CSUM_CRC32C:
+		return __crc32c_le_shift(crc, len);
+	case BCH_CSUM_CRC64_NONZERO:
+	case BCH_CSUM_CRC64:
+		return crc64_be_shift(crc, len);
+	default:
+		BUG();
+	}
+}
+
 static inline void do_encrypt_sg(struct crypto_sync_skcipher *tfm,
 				 struct nonce nonce,
 				 struct scatterlist *sg, size_t len)
@@ -176,12 +193,51 @@ void bch2_encrypt(struct bch_fs *c, unsigned type,
 	do_encrypt(c->chacha20, nonce, data, len);
 }
 
+static u64 bch2_checksum_update_bio(unsigned type, u64 crc,
+				    struct bio *bio, struct bvec_iter *iter)
+{
+	struct bio_vec bv;
+
+#ifdef CONFIG_HIGHMEM
+	__bio_for_each_segment(bv, bio, *iter, *iter) {
+		void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
+		crc = bch2_checksum_update(type,
+			crc, p, bv.bv_len);
+		kunmap_atomic(p);
+	}
+#else
+	__bio_for_each_bvec(bv, bio, *iter, *iter)
+		crc = bch2_checksum_update(type, crc,
+			page_address(bv.bv_page) + bv.bv_offset,
+			bv.bv_len);
+#endif
+	return crc;
+}
+
+static void bch2_poly1305_update_bio(struct shash_desc *desc,
+				     struct bio *bio, struct bvec_iter *iter)
+{
+	struct bio_vec bv;
+
+#ifdef CONFIG_HIGHMEM
+	__bio_for_each_segment(bv, bio, *iter, *iter) {
+		void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
+
+		crypto_shash_update(desc, p, bv.bv_len);
+		kunmap_atomic(p);
+	}
+#else
+	__bio_for_each_bvec(bv, bio, *iter, *iter)
+		crypto_shash_update(desc,
+			page_address(bv.bv_page) + bv.bv_offset,
+			bv.bv_len);
+#endif
+}
+
 static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 					   struct nonce nonce, struct bio *bio,
 					   struct bvec_iter *iter)
 {
-	struct bio_vec bv;
-
 	switch (type) {
 	case BCH_CSUM_NONE:
 		return (struct bch_csum) { 0 };
@@ -191,19 +247,7 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	case BCH_CSUM_CRC64: {
 		u64 crc = bch2_checksum_init(type);
 
-#ifdef CONFIG_HIGHMEM
-		__bio_for_each_segment(bv, bio, *iter, *iter) {
-			void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
-			crc = bch2_checksum_update(type,
-				crc, p, bv.bv_len);
-			kunmap_atomic(p);
-		}
-#else
-		__bio_for_each_bvec(bv, bio, *iter, *iter)
-			crc = bch2_checksum_update(type, crc,
-				page_address(bv.bv_page) + bv.bv_offset,
-				bv.bv_len);
-#endif
+		crc = bch2_checksum_update_bio(type, crc, bio, iter);
 		crc = bch2_checksum_final(type, crc);
 		return (struct bch_csum) { .lo = cpu_to_le64(crc) };
 	}
@@ -215,20 +259,7 @@ static struct bch_csum __bch2_checksum_bio(struct bch_fs *c, unsigned type,
 		struct bch_csum ret = { 0 };
 
 		gen_poly_key(c, desc, nonce);
-
-#ifdef CONFIG_HIGHMEM
-		__bio_for_each_segment(bv, bio, *iter, *iter) {
-			void *p = kmap_atomic(bv.bv_page) + bv.bv_offset;
-
-			crypto_shash_update(desc, p, bv.bv_len);
-			kunmap_atomic(p);
-		}
-#else
-		__bio_for_each_bvec(bv, bio, *iter, *iter)
-			crypto_shash_update(desc,
-				page_address(bv.bv_page) + bv.bv_offset,
-				bv.bv_len);
-#endif
+		bch2_poly1305_update_bio(desc, bio, iter);
 		crypto_shash_final(desc, digest);
 
 		memcpy(&ret, digest, bch_crc_bytes[type]);
@@ -247,8 +278,9 @@ struct bch_csum bch2_checksum_bio(struct bch_fs *c, unsigned type,
 	return __bch2_checksum_bio(c, type, nonce, bio, &iter);
 }
 
-void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
-		      struct nonce nonce, struct bio *bio)
+static void __bch2_encrypt_bio(struct bch_fs *c, unsigned type,
+			       struct nonce nonce, struct bio *bio,
+			       struct bvec_iter start)
 {
 	struct bio_vec bv;
 	struct bvec_iter iter;
@@ -260,7 +292,7 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 
 	sg_init_table(sgl, ARRAY_SIZE(sgl));
 
-	bio_for_each_segment(bv, bio, iter) {
+	__bio_for_each_bvec(bv, bio, iter, start) {
 		if (sg == sgl + ARRAY_SIZE(sgl)) {
 			sg_mark_end(sg - 1);
 			do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
@@ -280,19 +312,122 @@ void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
 	do_encrypt_sg(c->chacha20, nonce, sgl, bytes);
 }
 
-struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
-				    struct bch_csum b, size_t b_len)
+void bch2_encrypt_bio(struct bch_fs *c, unsigned type,
+		      struct nonce nonce, struct bio *bio)
 {
-	BUG_ON(!bch2_checksum_mergeable(type));
+	__bch2_encrypt_bio(c, type, nonce, bio, bio->bi_iter);
+}
+
+/*
+ * Fused copy, encrypt and checksum: instead of streaming the whole bio through
+ * the cache once for each, we do it a chunk at a time, so that the checksum
+ * reads back data the copy and the cipher just wrote.
+ *
+ * The checksum is always of the ciphertext: when encrypting it's computed after
+ * each chunk is encrypted, when decrypting before.
+ */
+static struct bch_csum __bch2_crypt_checksum_bio(struct bch_fs *c,
+					unsigned type, struct nonce nonce,
+					struct bio *dst, struct bio *src,
+					struct shash_desc *desc, bool decrypt)
+{
+	struct bvec_iter iter = dst->bi_iter, src_iter, chunk, csum_iter;
+	struct bch_csum ret = { 0 };
+	u8 digest[POLY1305_DIGEST_SIZE];
+	u64 crc = 0;
+
+	if (src)
+		src_iter = src->bi_iter;
+
+	if (desc)
+		gen_poly_key(c, desc, nonce);
+	else if (type)
+		crc = bch2_checksum_init(type);
 
-	while (b_len) {
-		unsigned b = min_t(unsigned, b_len, PAGE_SIZE);
+	while (iter.bi_size) {
+		unsigned bytes = min_t(unsigned, iter.bi_size,
+				       BCH_CRYPT_CHUNK_SIZE);
 
-		a.lo = bch2_checksum_update(type, a.lo,
-				page_address(ZERO_PAGE(0)), b);
-		b_len -= b;
+		chunk = iter;
+		chunk.bi_size = bytes;
+
+		if (src) {
+			struct bvec_iter dst_chunk = chunk;
+
+			bio_copy_data_iter(dst, &dst_chunk, src, &src_iter);
+		}
+
+		if (!decrypt)
+			__bch2_encrypt_bio(c, type, nonce, dst, chunk);
+
+		csum_iter = chunk;
+		if (desc)
+			bch2_poly1305_update_bio(desc, dst, &csum_iter);
+		else if (type)
+			crc = bch2_checksum_update_bio(type, crc, dst, &csum_iter);
+
+		if (decrypt)
+			__bch2_encrypt_bio(c, type, nonce, dst, chunk);
+
+		bio_advance_iter(dst, &iter, bytes);
+		nonce = nonce_add(nonce, bytes);
+	}
+
+	if (desc) {
+		crypto_shash_final(desc, digest);
+		memcpy(&ret, digest, bch_crc_bytes[type]);
+	} else if (type) {
+		ret.lo = cpu_to_le64(bch2_checksum_final(type, crc));
 	}
 
+	return ret;
+}
+
+/*
+ * Copies @src into @dst (if @src is non NULL), then encrypts @dst and returns
+ * its checksum - the same as bio_copy_data(), bch2_encrypt_bio() and
+ * bch2_checksum_bio(), in one pass:
+ */
+struct bch_csum bch2_encrypt_checksum_bio(struct bch_fs *c, unsigned type,
+					  struct nonce nonce,
+					  struct bio *dst, struct bio *src)
+{
+	if (bch2_csum_type_is_encryption(type)) {
+		SHASH_DESC_ON_STACK(desc, c->poly1305);
+
+		return __bch2_crypt_checksum_bio(c, type, nonce, dst, src,
+						 desc, false);
+	}
+
+	return __bch2_crypt_checksum_bio(c, type, nonce, dst, src,
+					 NULL, false);
+}
+
+/*
+ * Returns the checksum of @bio, then decrypts it - bch2_checksum_bio() and
+ * bch2_encrypt_bio() in one pass. The caller must verify the checksum, and
+ * can't reverify it afterwards:
+ */
+struct bch_csum bch2_checksum_decrypt_bio(struct bch_fs *c, unsigned type,
+					  struct nonce nonce, struct bio *bio)
+{
+	if (bch2_csum_type_is_encryption(type)) {
+		SHASH_DESC_ON_STACK(desc, c->poly1305);
+
+		return __bch2_crypt_checksum_bio(c, type, nonce, bio, NULL,
+						 desc, true);
+	}
+
+	return __bch2_crypt_checksum_bio(c, type, nonce, bio, NULL,
+					 NULL, true);
+}
+
+struct bch_csum bch2_checksum_merge(unsigned type, struct bch_csum a,
+				    struct bch_csum b, size_t b_len)
+{
+	BUG_ON(!bch2_checksum_mergeable(type));
+
+	a.lo = bch2_checksum_shift(type, a.lo, b_len);
 	a.lo ^= b.lo;
 	a.hi ^= b.hi;
 	return a;
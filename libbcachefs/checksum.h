@@ -64,6 +64,18 @@ int bch2_rechecksum_bio(struct bch_fs *, struct bio *, struct bversion,
 void bch2_encrypt_bio(struct bch_fs *, unsigned,
 		    struct nonce, struct bio *);
 
+/*
+ * Fused encrypt/checksum passes work on chunks of this size, small enough to
+ * stay in L1/L2 between passes:
+ */
+#define BCH_CRYPT_CHUNK_SIZE	(32U << 10)
+
+struct bch_csum bch2_encrypt_checksum_bio(struct bch_fs *, unsigned,
+					  struct nonce, struct bio *,
+					  struct bio *);
+struct bch_csum bch2_checksum_decrypt_bio(struct bch_fs *, unsigned,
+					  struct nonce, struct bio *);
+
 int bch2_decrypt_sb_key(struct bch_fs *, struct bch_sb_field_crypt *,
 			struct bch_key *);
 
@@ -6,6 +6,7 @@
 #include "io.h"
 #include "super-io.h"
 
+#include <linux/hash.h>
 #include <linux/lz4.h>
 #include <linux/zlib.h>
 #include <linux/zstd.h>
@@ -29,6 +30,8 @@ static struct bbuf __bounce_alloc(struct bch_fs *c, unsigned size, int rw)
 
 	BUG_ON(size > c->sb.encoded_extent_max << 9);
 
+	atomic64_add(size, &c->compress_bounce[BCH_COMPRESS_BOUNCE_bounced]);
+
 	b = kmalloc(size, GFP_NOIO|__GFP_NOWARN);
 	if (b)
 		return (struct bbuf) { .b = b, .type = BB_KMALLOC, .rw = rw };
@@ -50,10 +53,35 @@ static struct bbuf __bounce_alloc(struct bch_fs *c, unsigned size, int rw)
 	BUG();
 }
 
-static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
-				       struct bvec_iter start, int rw)
+/*
+ * For compressing in parallel: chunks can be held for as long as the write
+ * they're part of, so they mustn't take from the compression_bounce mempools
+ * that the inline path relies on making forward progress. Returns a NULL
+ * buffer on failure:
+ */
+static struct bbuf __bounce_alloc_nopool(struct bch_fs *c, unsigned size, int rw)
+{
+	void *b;
+
+	BUG_ON(size > c->sb.encoded_extent_max << 9);
+
+	atomic64_add(size, &c->compress_bounce[BCH_COMPRESS_BOUNCE_bounced]);
+
+	b = kmalloc(size, GFP_NOIO|__GFP_NOWARN);
+	if (b)
+		return (struct bbuf) { .b = b, .type = BB_KMALLOC, .rw = rw };
+
+	b = vmalloc(size);
+	if (b)
+		return (struct bbuf) { .b = b, .type = BB_VMALLOC, .rw = rw };
+
+	return (struct bbuf) { NULL };
+}
+
+/* Map a bio without copying it, if we can; returns a NULL buffer if not: */
+static struct bbuf __bio_map(struct bch_fs *c, struct bio *bio,
+			     struct bvec_iter start, int rw)
 {
-	struct bbuf ret;
 	struct bio_vec bv;
 	struct bvec_iter iter;
 	unsigned nr_pages = 0;
@@ -61,7 +89,7 @@ static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
 	struct page **pages = NULL;
 	bool first = true;
 	unsigned prev_end = PAGE_SIZE;
-	void *data;
+	void *data, *end = NULL;
 
 	BUG_ON(bvec_iter_sectors(start) > c->sb.encoded_extent_max);
 
@@ -73,11 +101,28 @@ static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
 				.type = BB_NONE, .rw = rw
 			};
 	}
+
+	/* pages that happen to be virtually contiguous don't need mapping: */
+	__bio_for_each_segment(bv, bio, iter, start) {
+		data = page_address(bv.bv_page) + bv.bv_offset;
+
+		if (end && data != end)
+			goto vmap;
+
+		end = data + bv.bv_len;
+	}
+
+	atomic64_add(start.bi_size, &c->compress_bounce[BCH_COMPRESS_BOUNCE_avoided]);
+	return (struct bbuf) {
+		.b = end - start.bi_size,
+		.type = BB_NONE, .rw = rw
+	};
+vmap:
 #endif
 	__bio_for_each_segment(bv, bio, iter, start) {
 		if ((!first && bv.bv_offset) ||
 		    prev_end != PAGE_SIZE)
-			goto bounce;
+			return (struct bbuf) { NULL };
 
 		prev_end = bv.bv_offset + bv.bv_len;
 		nr_pages++;
@@ -89,7 +134,7 @@ static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
 		? kmalloc_array(nr_pages, sizeof(struct page *), GFP_NOIO)
 		: stack_pages;
 	if (!pages)
-		goto bounce;
+		return (struct bbuf) { NULL };
 
 	nr_pages = 0;
 	__bio_for_each_segment(bv, bio, iter, start)
@@ -99,13 +144,19 @@ static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
 	if (pages != stack_pages)
 		kfree(pages);
 
-	if (data)
-		return (struct bbuf) {
-			.b = data + bio_iter_offset(bio, start),
-			.type = BB_VMAP, .rw = rw
-		};
-bounce:
-	ret = __bounce_alloc(c, start.bi_size, rw);
+	if (!data)
+		return (struct bbuf) { NULL };
+
+	return (struct bbuf) {
+		.b = data + bio_iter_offset(bio, start),
+		.type = BB_VMAP, .rw = rw
+	};
+}
+
+static struct bbuf __bio_bounce(struct bch_fs *c, struct bio *bio,
+				struct bvec_iter start, int rw)
+{
+	struct bbuf ret = __bounce_alloc(c, start.bi_size, rw);
 
 	if (rw == READ)
 		memcpy_from_bio(ret.b, bio, start);
@@ -113,6 +164,14 @@ bounce:
 	return ret;
 }
 
+static struct bbuf __bio_map_or_bounce(struct bch_fs *c, struct bio *bio,
+				       struct bvec_iter start, int rw)
+{
+	struct bbuf ret = __bio_map(c, bio, start, rw);
+
+	return ret.b ? ret : __bio_bounce(c, bio, start, rw);
+}
+
 static struct bbuf bio_map_or_bounce(struct bch_fs *c, struct bio *bio, int rw)
 {
 	return __bio_map_or_bounce(c, bio, bio->bi_iter, rw);
@@ -139,6 +198,253 @@ static void bio_unmap_or_unbounce(struct bch_fs *c, struct bbuf buf)
 	}
 }
 
+/* Workspaces: */
+
+static void **workspace_slot(struct bch_workspace_pool *pool)
+{
+	return &pool->cache[hash_ptr(current, ilog2(BCH_WORKSPACE_CACHE_SLOTS))];
+}
+
+static struct bch_workspace workspace_get(struct bch_workspace_pool *pool)
+{
+	void *p = xchg(workspace_slot(pool), NULL);
+
+	if (!p)
+		p = kvpmalloc(pool->size, GFP_NOIO|__GFP_NOWARN);
+	if (p)
+		return (struct bch_workspace) { .p = p };
+
+	return (struct bch_workspace) {
+		.p		= mempool_alloc(&pool->reserve, GFP_NOIO),
+		.reserve	= true,
+	};
+}
+
+static void workspace_put(struct bch_workspace_pool *pool,
+			  struct bch_workspace ws)
+{
+	if (ws.reserve)
+		mempool_free(ws.p, &pool->reserve);
+	else if (cmpxchg(workspace_slot(pool), NULL, ws.p))
+		kvpfree(ws.p, pool->size);
+}
+
+static void workspace_pool_exit(struct bch_workspace_pool *pool)
+{
+	unsigned i;
+
+	for (i = 0; i < ARRAY_SIZE(pool->cache); i++)
+		if (pool->cache[i])
+			kvpfree(pool->cache[i], pool->size);
+	memset(pool->cache, 0, sizeof(pool->cache));
+
+	mempool_exit(&pool->reserve);
+}
+
+static int workspace_pool_init(struct bch_workspace_pool *pool, size_t size)
+{
+	int ret = mempool_init_kvpmalloc_pool(&pool->reserve, 1, size);
+
+	/* size is how we check if the pool has been initialized: */
+	if (!ret)
+		pool->size = size;
+	return ret;
+}
+
+/* Trained zstd dictionary: */
+
+struct bch_compression_dict {
+	u32			id;
+	size_t			len;
+
+	/* shared by all decompression workspaces: */
+	const ZSTD_DDict	*ddict;
+	void			*ddict_workspace;
+
+	/* compression dictionaries depend on the level, so are made on demand: */
+	struct mutex		lock;
+	const ZSTD_CDict	*cdict[BCH_COMPRESSION_LEVEL_MAX + 1];
+	void			*cdict_workspace[BCH_COMPRESSION_LEVEL_MAX + 1];
+	size_t			cdict_workspace_size[BCH_COMPRESSION_LEVEL_MAX + 1];
+
+	u8			data[];
+};
+
+static ZSTD_parameters zstd_params(struct bch_fs *c, unsigned level,
+				   size_t dict_len)
+{
+	return ZSTD_getParams(level, c->sb.encoded_extent_max << 9, dict_len);
+}
+
+static const ZSTD_CDict *compression_dict_cdict(struct bch_fs *c,
+						unsigned level)
+{
+	struct bch_compression_dict *dict = c->compression_dict;
+	const ZSTD_CDict *cdict;
+	ZSTD_parameters params;
+	void *workspace;
+	size_t size;
+
+	if (!dict)
+		return NULL;
+
+	cdict = smp_load_acquire(&dict->cdict[level]);
+	if (cdict)
+		return cdict;
+
+	mutex_lock(&dict->lock);
+	cdict = dict->cdict[level];
+	if (cdict)
+		goto out;
+
+	params	= zstd_params(c, level, dict->len);
+	size	= ZSTD_CDictWorkspaceBound(params.cParams);
+
+	workspace = kvpmalloc(size, GFP_NOIO|__GFP_NOWARN);
+	if (!workspace)
+		goto out;
+
+	cdict = ZSTD_initCDict(dict->data, dict->len, params, workspace, size);
+	if (!cdict) {
+		kvpfree(workspace, size);
+		goto out;
+	}
+
+	dict->cdict_workspace[level]		= workspace;
+	dict->cdict_workspace_size[level]	= size;
+	smp_store_release(&dict->cdict[level], cdict);
+out:
+	mutex_unlock(&dict->lock);
+	return cdict;
+}
+
+static void bch2_compression_dict_exit(struct bch_fs *c)
+{
+	struct bch_compression_dict *dict = c->compression_dict;
+	unsigned i;
+
+	if (!dict)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(dict->cdict); i++)
+		if (dict->cdict_workspace[i])
+			kvpfree(dict->cdict_workspace[i],
+				dict->cdict_workspace_size[i]);
+	if (dict->ddict_workspace)
+		kvpfree(dict->ddict_workspace, ZSTD_DDictWorkspaceBound());
+	kfree(dict);
+	c->compression_dict = NULL;
+}
+
+static int bch2_compression_dict_init(struct bch_fs *c)
+{
+	struct bch_sb_field_compression_dict *f =
+		bch2_sb_get_compression_dict(c->disk_sb.sb);
+	struct bch_compression_dict *dict;
+	size_t len;
+
+	if (!f || c->compression_dict)
+		return 0;
+
+	len = le32_to_cpu(f->dict_len);
+
+	dict = kzalloc(sizeof(*dict) + len, GFP_KERNEL);
+	if (!dict)
+		return -ENOMEM;
+
+	dict->id	= le32_to_cpu(f->dict_id);
+	dict->len	= len;
+	mutex_init(&dict->lock);
+	memcpy(dict->data, f->data, len);
+	c->compression_dict = dict;
+
+	dict->ddict_workspace = kvpmalloc(ZSTD_DDictWorkspaceBound(), GFP_KERNEL);
+	if (!dict->ddict_workspace)
+		return -ENOMEM;
+
+	dict->ddict = ZSTD_initDDict(dict->data, dict->len,
+				     dict->ddict_workspace,
+				     ZSTD_DDictWorkspaceBound());
+	if (!dict->ddict ||
+	    ZSTD_getDictID_fromDDict(dict->ddict) != dict->id) {
+		bch_err(c, "invalid compression dictionary");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int bch2_set_compression_dict(struct bch_fs *c, const void *data, size_t len)
+{
+	struct bch_sb_field_compression_dict *f;
+	unsigned id = ZSTD_getDictID_fromDict(data, len);
+	int ret = 0;
+
+	if (!id || len > BCH_COMPRESSION_DICT_MAX_SIZE)
+		return -EINVAL;
+
+	mutex_lock(&c->sb_lock);
+	if (bch2_sb_get_compression_dict(c->disk_sb.sb)) {
+		ret = -EEXIST;
+		goto out;
+	}
+
+	f = bch2_sb_resize_compression_dict(&c->disk_sb,
+			DIV_ROUND_UP(sizeof(*f) + len, sizeof(u64)));
+	if (!f) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	f->dict_id	= cpu_to_le32(id);
+	f->dict_len	= cpu_to_le32(len);
+	memcpy(f->data, data, len);
+
+	c->disk_sb.sb->features[0] |= cpu_to_le64(1ULL << BCH_FEATURE_ZSTD_DICT);
+	bch2_write_super(c);
+out:
+	mutex_unlock(&c->sb_lock);
+	return ret;
+}
+
+static const char *bch2_sb_validate_compression_dict(struct bch_sb *sb,
+						     struct bch_sb_field *f)
+{
+	struct bch_sb_field_compression_dict *d =
+		field_to_type(f, compression_dict);
+	size_t len;
+
+	if (vstruct_bytes(&d->field) < sizeof(*d))
+		return "invalid field compression_dict: wrong size";
+
+	len = le32_to_cpu(d->dict_len);
+	if (len > BCH_COMPRESSION_DICT_MAX_SIZE ||
+	    sizeof(*d) + len > vstruct_bytes(&d->field))
+		return "invalid field compression_dict: bad dictionary size";
+
+	if (!le32_to_cpu(d->dict_id))
+		return "invalid field compression_dict: no dictionary id";
+
+	return NULL;
+}
+
+static void bch2_sb_compression_dict_to_text(struct printbuf *out,
+					     struct bch_sb *sb,
+					     struct bch_sb_field *f)
+{
+	struct bch_sb_field_compression_dict *d =
+		field_to_type(f, compression_dict);
+
+	pr_buf(out, "id %u size %u",
+	       le32_to_cpu(d->dict_id),
+	       le32_to_cpu(d->dict_len));
+}
+
+const struct bch_sb_field_ops bch_sb_field_ops_compression_dict = {
+	.validate	= bch2_sb_validate_compression_dict,
+	.to_text	= bch2_sb_compression_dict_to_text,
+};
+
 static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 {
 #ifdef __KERNEL__
@@ -146,59 +452,67 @@ static inline void zlib_set_workspace(z_stream *strm, void *workspace)
 #endif
 }
 
-static int __bio_uncompress(struct bch_fs *c, struct bio *src,
-			    void *dst_data, struct bch_extent_crc_unpacked crc)
+static int __uncompress(struct bch_fs *c,
+			void *src_data, size_t src_len,
+			void *dst_data, struct bch_extent_crc_unpacked crc)
 {
-	struct bbuf src_data = { NULL };
-	size_t src_len = src->bi_iter.bi_size;
 	size_t dst_len = crc.uncompressed_size << 9;
-	void *workspace;
+	struct bch_workspace workspace;
 	int ret;
 
-	src_data = bio_map_or_bounce(c, src, READ);
-
 	switch (crc.compression_type) {
 	case BCH_COMPRESSION_LZ4_OLD:
 	case BCH_COMPRESSION_LZ4:
-		ret = LZ4_decompress_safe_partial(src_data.b, dst_data,
+		ret = LZ4_decompress_safe_partial(src_data, dst_data,
 						  src_len, dst_len, dst_len);
 		if (ret != dst_len)
 			goto err;
 		break;
 	case BCH_COMPRESSION_GZIP: {
 		z_stream strm = {
-			.next_in	= src_data.b,
+			.next_in	= src_data,
 			.avail_in	= src_len,
 			.next_out	= dst_data,
 			.avail_out	= dst_len,
 		};
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
+		workspace = workspace_get(&c->decompress_workspace);
 
-		zlib_set_workspace(&strm, workspace);
+		zlib_set_workspace(&strm, workspace.p);
 		zlib_inflateInit2(&strm, -MAX_WBITS);
 		ret = zlib_inflate(&strm, Z_FINISH);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		workspace_put(&c->decompress_workspace, workspace);
 
 		if (ret != Z_STREAM_END)
 			goto err;
 		break;
 	}
 	case BCH_COMPRESSION_ZSTD: {
+		struct bch_compression_dict *dict = c->compression_dict;
 		ZSTD_DCtx *ctx;
+		unsigned dict_id;
 		size_t len;
 
-		workspace = mempool_alloc(&c->decompress_workspace, GFP_NOIO);
-		ctx = ZSTD_initDCtx(workspace, ZSTD_DCtxWorkspaceBound());
+		src_len = le32_to_cpup(src_data);
+
+		dict_id = ZSTD_getDictID_fromFrame(src_data + 4, src_len);
+		if (dict_id && (!dict || dict_id != dict->id))
+			goto err;
 
-		src_len = le32_to_cpup(src_data.b);
+		workspace = workspace_get(&c->decompress_workspace);
+		ctx = ZSTD_initDCtx(workspace.p, ZSTD_DCtxWorkspaceBound());
 
-		len = ZSTD_decompressDCtx(ctx,
+		len = dict_id
+			? ZSTD_decompress_usingDDict(ctx,
+				dst_data,	dst_len,
+				src_data + 4, src_len,
+				dict->ddict)
+			: ZSTD_decompressDCtx(ctx,
 				dst_data,	dst_len,
-				src_data.b + 4, src_len);
+				src_data + 4, src_len);
 
-		mempool_free(workspace, &c->decompress_workspace);
+		workspace_put(&c->decompress_workspace, workspace);
 
 		if (len != dst_len)
 			goto err;
@@ -207,13 +521,194 @@ static int __bio_uncompress(struct bch_fs *c, struct bio *src,
 	default:
 		BUG();
 	}
-	ret = 0;
-out:
+	return 0;
+err:
+	return -EIO;
+}
+
+static int __bio_uncompress(struct bch_fs *c, struct bio *src,
+			    void *dst_data, struct bch_extent_crc_unpacked crc)
+{
+	struct bbuf src_data = bio_map_or_bounce(c, src, READ);
+	int ret = __uncompress(c, src_data.b, src->bi_iter.bi_size,
+			       dst_data, crc);
+
 	bio_unmap_or_unbounce(c, src_data);
 	return ret;
-err:
-	ret = -EIO;
-	goto out;
+}
+
+/*
+ * Streaming decompression:
+ *
+ * gzip and zstd can consume their input and produce their output a segment at
+ * a time, so neither the compressed nor the decompressed data has to be mapped
+ * or bounced. Output before crc.offset is decompressed into the first segment
+ * of @dst and then overwritten, and we stop as soon as @dst is full, without
+ * decompressing the rest of the extent.
+ */
+struct uncompress_stream {
+	struct bio		*src;
+	struct bvec_iter	src_iter;
+	struct bio		*dst;
+	struct bvec_iter	dst_iter;
+	size_t			skip;
+};
+
+static inline bool uncompress_can_stream(unsigned compression_type)
+{
+	return !IS_ENABLED(CONFIG_HIGHMEM) &&
+		(compression_type == BCH_COMPRESSION_GZIP ||
+		 compression_type == BCH_COMPRESSION_ZSTD);
+}
+
+/* Next segment of input, or NULL if there's no more: */
+static void *stream_in(struct uncompress_stream *s, size_t *len)
+{
+	struct bio_vec bv;
+
+	*len = 0;
+	if (!s->src_iter.bi_size)
+		return NULL;
+
+	bv = bio_iter_iovec(s->src, s->src_iter);
+	bio_advance_iter(s->src, &s->src_iter, bv.bv_len);
+
+	*len = bv.bv_len;
+	return page_address(bv.bv_page) + bv.bv_offset;
+}
+
+/* Where the next output goes: */
+static void *stream_out(struct uncompress_stream *s, size_t *len)
+{
+	struct bio_vec bv = bio_iter_iovec(s->dst, s->dst_iter);
+
+	*len = s->skip ? min_t(size_t, s->skip, bv.bv_len) : bv.bv_len;
+	return page_address(bv.bv_page) + bv.bv_offset;
+}
+
+static void stream_out_done(struct uncompress_stream *s, size_t len)
+{
+	if (s->skip)
+		s->skip -= len;
+	else
+		bio_advance_iter(s->dst, &s->dst_iter, len);
+}
+
+static int stream_inflate(struct bch_fs *c, struct uncompress_stream *s)
+{
+	struct bch_workspace workspace = workspace_get(&c->decompress_workspace);
+	z_stream strm = { NULL };
+	size_t in_len, out_len;
+	int ret;
+
+	zlib_set_workspace(&strm, workspace.p);
+	zlib_inflateInit2(&strm, -MAX_WBITS);
+
+	while (s->dst_iter.bi_size) {
+		if (!strm.avail_in) {
+			strm.next_in	= stream_in(s, &in_len);
+			strm.avail_in	= in_len;
+		}
+
+		strm.next_out	= stream_out(s, &out_len);
+		strm.avail_out	= out_len;
+
+		ret = zlib_inflate(&strm, Z_SYNC_FLUSH);
+		stream_out_done(s, out_len - strm.avail_out);
+
+		/* Z_BUF_ERROR means no progress was possible: */
+		if (ret != Z_OK)
+			break;
+	}
+
+	zlib_inflateEnd(&strm);
+	workspace_put(&c->decompress_workspace, workspace);
+
+	return s->dst_iter.bi_size ? -EIO : 0;
+}
+
+static int stream_zstd(struct bch_fs *c, struct uncompress_stream *s)
+{
+	struct bch_compression_dict *dict = c->compression_dict;
+	struct bch_workspace workspace;
+	struct bvec_iter hdr_iter = s->src_iter;
+	u8 hdr[4 + ZSTD_FRAMEHEADERSIZE_MAX];
+	ZSTD_inBuffer in = { NULL };
+	ZSTD_outBuffer out;
+	ZSTD_DStream *ds;
+	unsigned frame_len, dict_id;
+	size_t ret;
+
+	/* length prefix, and the frame header for the dictionary id: */
+	hdr_iter.bi_size = min_t(unsigned, hdr_iter.bi_size, sizeof(hdr));
+	if (hdr_iter.bi_size < 4)
+		return -EIO;
+	memcpy_from_bio(hdr, s->src, hdr_iter);
+
+	frame_len	= le32_to_cpup((__le32 *) hdr);
+	dict_id		= ZSTD_getDictID_fromFrame(hdr + 4,
+				min(hdr_iter.bi_size - 4, frame_len));
+	if (dict_id && (!dict || dict_id != dict->id))
+		return -EIO;
+
+	bio_advance_iter(s->src, &s->src_iter, 4);
+	s->src_iter.bi_size = min(s->src_iter.bi_size, frame_len);
+
+	workspace = workspace_get(&c->decompress_workspace);
+	ds = dict_id
+		? ZSTD_initDStream_usingDDict(c->sb.encoded_extent_max << 9,
+				dict->ddict,
+				workspace.p, c->decompress_workspace.size)
+		: ZSTD_initDStream(c->sb.encoded_extent_max << 9,
+				workspace.p, c->decompress_workspace.size);
+	if (!ds)
+		goto out;
+
+	while (s->dst_iter.bi_size) {
+		size_t in_pos;
+
+		if (in.pos == in.size) {
+			in.src	= stream_in(s, &in.size);
+			in.pos	= 0;
+		}
+		in_pos = in.pos;
+
+		out.dst = stream_out(s, &out.size);
+		out.pos = 0;
+
+		ret = ZSTD_decompressStream(ds, &out, &in);
+		stream_out_done(s, out.pos);
+
+		if (ZSTD_isError(ret) || !ret ||
+		    (!out.pos && in.pos == in_pos))
+			break;
+	}
+out:
+	workspace_put(&c->decompress_workspace, workspace);
+
+	return s->dst_iter.bi_size ? -EIO : 0;
+}
+
+static int bio_uncompress_stream(struct bch_fs *c, struct bio *src,
+				 struct bio *dst, struct bvec_iter dst_iter,
+				 struct bch_extent_crc_unpacked crc)
+{
+	struct uncompress_stream s = {
+		.src		= src,
+		.src_iter	= src->bi_iter,
+		.dst		= dst,
+		.dst_iter	= dst_iter,
+		.skip		= crc.offset << 9,
+	};
+
+	switch (crc.compression_type) {
+	case BCH_COMPRESSION_GZIP:
+		return stream_inflate(c, &s);
+	case BCH_COMPRESSION_ZSTD:
+		return stream_zstd(c, &s);
+	default:
+		BUG();
+	}
 }
 
 int bch2_bio_uncompress_inplace(struct bch_fs *c, struct bio *bio,
@@ -263,26 +758,46 @@ int bch2_bio_uncompress(struct bch_fs *c, struct bio *src,
 		       struct bio *dst, struct bvec_iter dst_iter,
 		       struct bch_extent_crc_unpacked crc)
 {
-	struct bbuf dst_data = { NULL };
+	struct bbuf src_data = { NULL }, dst_data = { NULL };
+	size_t src_len = src->bi_iter.bi_size;
 	size_t dst_len = crc.uncompressed_size << 9;
-	int ret = -ENOMEM;
+	bool dst_bounced = false;
+	int ret;
 
 	if (crc.uncompressed_size	> c->sb.encoded_extent_max ||
 	    crc.compressed_size		> c->sb.encoded_extent_max)
 		return -EIO;
 
-	dst_data = dst_len == dst_iter.bi_size
-		? __bio_map_or_bounce(c, dst, dst_iter, WRITE)
-		: __bounce_alloc(c, dst_len, WRITE);
+	src_data = __bio_map(c, src, src->bi_iter, READ);
+	if (dst_len == dst_iter.bi_size)
+		dst_data = __bio_map(c, dst, dst_iter, WRITE);
+
+	/* If either side would have to be bounced, stream instead if we can: */
+	if ((!src_data.b || !dst_data.b) &&
+	    uncompress_can_stream(crc.compression_type) &&
+	    !bio_uncompress_stream(c, src, dst, dst_iter, crc)) {
+		atomic64_add((!src_data.b ? src_len : 0) +
+			     (!dst_data.b ? dst_len : 0),
+			     &c->compress_bounce[BCH_COMPRESS_BOUNCE_avoided]);
+		ret = 0;
+		goto out;
+	}
 
-	ret = __bio_uncompress(c, src, dst_data.b, crc);
-	if (ret)
-		goto err;
+	if (!src_data.b)
+		src_data = __bio_bounce(c, src, src->bi_iter, READ);
 
-	if (dst_data.type != BB_NONE)
+	if (!dst_data.b) {
+		dst_data = __bounce_alloc(c, dst_len, WRITE);
+		dst_bounced = true;
+	}
+
+	ret = __uncompress(c, src_data.b, src_len, dst_data.b, crc);
+
+	if (!ret && dst_bounced)
 		memcpy_to_bio(dst, dst_iter, dst_data.b + (crc.offset << 9));
-err:
+out:
 	bio_unmap_or_unbounce(c, dst_data);
+	bio_unmap_or_unbounce(c, src_data);
 	return ret;
 }
 
@@ -290,21 +805,31 @@ static int attempt_compress(struct bch_fs *c,
 			    void *workspace,
 			    void *dst, size_t dst_len,
 			    void *src, size_t src_len,
-			    unsigned compression_type)
+			    unsigned compression_type,
+			    unsigned level)
 {
 	switch (compression_type) {
-	case BCH_COMPRESSION_LZ4: {
-		int len = src_len;
-		int ret = LZ4_compress_destSize(
-				src,		dst,
-				&len,		dst_len,
-				workspace);
-
-		if (len < src_len)
-			return -len;
-
-		return ret;
-	}
+	case BCH_COMPRESSION_LZ4:
+		if (level < LZ4HC_MIN_CLEVEL) {
+			int len = src_len;
+			int ret = LZ4_compress_destSize(
+					src,		dst,
+					&len,		dst_len,
+					workspace);
+
+			if (len < src_len)
+				return -len;
+
+			return ret;
+		} else {
+			int ret = LZ4_compress_HC(
+					src,		dst,
+					src_len,	dst_len,
+					min_t(unsigned, level, LZ4HC_MAX_CLEVEL),
+					workspace);
+
+			return ret > 0 ? ret : 0;
+		}
 	case BCH_COMPRESSION_GZIP: {
 		z_stream strm = {
 			.next_in	= src,
@@ -314,7 +839,8 @@ static int attempt_compress(struct bch_fs *c,
 		};
 
 		zlib_set_workspace(&strm, workspace);
-		zlib_deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+		zlib_deflateInit2(&strm,
+				  level ? (int) min(level, 9U) : Z_DEFAULT_COMPRESSION,
 				  Z_DEFLATED, -MAX_WBITS, DEF_MEM_LEVEL,
 				  Z_DEFAULT_STRATEGY);
 
@@ -328,12 +854,20 @@ static int attempt_compress(struct bch_fs *c,
 	}
 	case BCH_COMPRESSION_ZSTD: {
 		ZSTD_CCtx *ctx = ZSTD_initCCtx(workspace,
-			ZSTD_CCtxWorkspaceBound(c->zstd_params.cParams));
-
-		size_t len = ZSTD_compressCCtx(ctx,
+			c->compress_workspace[BCH_COMPRESSION_ZSTD].size);
+		/* small extents compress much better against a dictionary: */
+		const ZSTD_CDict *cdict = src_len <= BCH_COMPRESSION_DICT_MAX_EXTENT
+			? compression_dict_cdict(c, level)
+			: NULL;
+		size_t len = cdict
+			? ZSTD_compress_usingCDict(ctx,
+				dst + 4,	dst_len - 4,
+				src,		src_len,
+				cdict)
+			: ZSTD_compressCCtx(ctx,
 				dst + 4,	dst_len - 4,
 				src,		src_len,
-				c->zstd_params);
+				zstd_params(c, level, 0));
 		if (ZSTD_isError(len))
 			return 0;
 
@@ -345,30 +879,123 @@ static int attempt_compress(struct bch_fs *c,
 	}
 }
 
-static unsigned __bio_compress(struct bch_fs *c,
-			       struct bio *dst, size_t *dst_len,
-			       struct bio *src, size_t *src_len,
-			       unsigned compression_type)
+/*
+ * Incompressible data detection:
+ *
+ * Before running the compressor, sample a few KB of the input and estimate its
+ * entropy from a byte histogram; data that's already compressed or encrypted
+ * looks random, and isn't worth a full compression pass. Data made of repeated
+ * patterns, or of only a few distinct byte values, is always worth trying.
+ *
+ * One in COMPRESS_PREDICT_CHECK extents we skip is compressed anyway, so the
+ * stats in c->compress_predict[] can tell us how often we skip data that would
+ * have compressed.
+ */
+
+#define COMPRESS_SAMPLE_SIZE		256
+#define COMPRESS_SAMPLES		16
+/* entropy, in 1/1024ths of a bit per byte, above which we skip compression: */
+#define COMPRESS_ENTROPY_MAX		(7 * 1024 + 256)
+#define COMPRESS_BYTE_CORE_SET		64
+#define COMPRESS_PREDICT_CHECK		64
+
+/*
+ * log2(x), in 1/1024ths: log2(1 + f) ~= f + 0.346 * f * (1 - f), good to about
+ * 0.01 bits
+ */
+static inline unsigned log2_1024(u32 x)
 {
-	struct bbuf src_data = { NULL }, dst_data = { NULL };
-	void *workspace;
+	unsigned l = ilog2(x);
+	unsigned f = (((u64) x << 10) >> l) & 1023;
+
+	return (l << 10) + f + ((f * (1024 - f) * 355) >> 20);
+}
+
+static bool compress_sample_repeated(const u8 *src, size_t len)
+{
+	size_t stride = len / COMPRESS_SAMPLES, i;
+
+	for (i = 1; i < COMPRESS_SAMPLES; i++)
+		if (memcmp(src, src + i * stride, COMPRESS_SAMPLE_SIZE))
+			return false;
+
+	return true;
+}
+
+/* Returns false if @src looks like it won't compress: */
+static bool compress_worth_trying(const u8 *src, size_t len)
+{
+	u32 count[256] = { 0 };
+	size_t stride, i, j, nr = 0;
+	unsigned nr_distinct = 0;
+	u64 sum = 0;
+
+	if (len < COMPRESS_SAMPLES * COMPRESS_SAMPLE_SIZE * 2) {
+		stride	= COMPRESS_SAMPLE_SIZE;
+	} else {
+		if (compress_sample_repeated(src, len))
+			return true;
+
+		stride	= len / COMPRESS_SAMPLES;
+	}
+
+	for (i = 0; i + COMPRESS_SAMPLE_SIZE <= len; i += stride)
+		for (j = 0; j < COMPRESS_SAMPLE_SIZE; j++)
+			count[src[i + j]]++;
+	nr = (len / stride) * COMPRESS_SAMPLE_SIZE;
+
+	for (i = 0; i < 256; i++)
+		if (count[i]) {
+			nr_distinct++;
+			sum += (u64) count[i] * log2_1024(count[i]);
+		}
+
+	if (nr_distinct <= COMPRESS_BYTE_CORE_SET)
+		return true;
+
+	/* H = log2(n) - sum(c * log2(c)) / n */
+	return log2_1024(nr) - div64_u64(sum, nr) <= COMPRESS_ENTROPY_MAX;
+}
+
+static inline u64 compress_predict_stat(struct bch_fs *c,
+					enum bch_compress_predict_stat stat)
+{
+	return atomic64_inc_return(&c->compress_predict[stat]);
+}
+
+/*
+ * Compress @src into @dst: on success returns the compression type used, with
+ * @src_len and @dst_len updated to how much was consumed and produced, padded
+ * to block size; returns 0 if the data didn't compress:
+ */
+static unsigned __compress(struct bch_fs *c,
+			   void *dst, size_t *dst_len,
+			   void *src, size_t *src_len,
+			   unsigned compression_type,
+			   unsigned level)
+{
+	struct bch_workspace workspace;
 	unsigned pad;
+	bool predict_skip, checking = false;
 	int ret = 0;
 
 	BUG_ON(compression_type >= BCH_COMPRESSION_NR);
-	BUG_ON(!mempool_initialized(&c->compress_workspace[compression_type]));
-
-	/* If it's only one block, don't bother trying to compress: */
-	if (bio_sectors(src) <= c->opts.block_size)
-		return 0;
+	BUG_ON(!c->compress_workspace[compression_type].size);
 
-	dst_data = bio_map_or_bounce(c, dst, WRITE);
-	src_data = bio_map_or_bounce(c, src, READ);
+	predict_skip = *src_len > block_bytes(c) &&
+		!compress_worth_trying(src, *src_len);
+	if (predict_skip) {
+		if (compress_predict_stat(c, BCH_COMPRESS_PREDICT_skipped) %
+		    COMPRESS_PREDICT_CHECK)
+			return 0;
 
-	workspace = mempool_alloc(&c->compress_workspace[compression_type], GFP_NOIO);
+		compress_predict_stat(c, BCH_COMPRESS_PREDICT_skipped_checked);
+		checking = true;
+	} else {
+		compress_predict_stat(c, BCH_COMPRESS_PREDICT_tried);
+	}
 
-	*src_len = src->bi_iter.bi_size;
-	*dst_len = dst->bi_iter.bi_size;
+	workspace = workspace_get(&c->compress_workspace[compression_type]);
 
 	/*
 	 * XXX: this algorithm sucks when the compression code doesn't tell us
@@ -380,10 +1007,10 @@ static unsigned __bio_compress(struct bch_fs *c,
 			break;
 		}
 
-		ret = attempt_compress(c, workspace,
-				       dst_data.b,	*dst_len,
-				       src_data.b,	*src_len,
-				       compression_type);
+		ret = attempt_compress(c, workspace.p,
+				       dst,	*dst_len,
+				       src,	*src_len,
+				       compression_type, level);
 		if (ret > 0) {
 			*dst_len = ret;
 			ret = 0;
@@ -408,40 +1035,68 @@ static unsigned __bio_compress(struct bch_fs *c,
 		*src_len = round_down(*src_len, block_bytes(c));
 	}
 
-	mempool_free(workspace, &c->compress_workspace[compression_type]);
-
-	if (ret)
-		goto err;
+	workspace_put(&c->compress_workspace[compression_type], workspace);
 
 	/* Didn't get smaller: */
-	if (round_up(*dst_len, block_bytes(c)) >= *src_len)
-		goto err;
+	if (ret || round_up(*dst_len, block_bytes(c)) >= *src_len) {
+		if (!predict_skip)
+			compress_predict_stat(c, BCH_COMPRESS_PREDICT_tried_failed);
+		return 0;
+	}
+
+	if (checking)
+		compress_predict_stat(c, BCH_COMPRESS_PREDICT_skipped_wrong);
 
 	pad = round_up(*dst_len, block_bytes(c)) - *dst_len;
 
-	memset(dst_data.b + *dst_len, 0, pad);
+	memset(dst + *dst_len, 0, pad);
 	*dst_len += pad;
 
+	BUG_ON(*dst_len & (block_bytes(c) - 1));
+	BUG_ON(*src_len & (block_bytes(c) - 1));
+	return compression_type;
+}
+
+static unsigned __bio_compress(struct bch_fs *c,
+			       struct bio *dst, size_t *dst_len,
+			       struct bio *src, size_t *src_len,
+			       unsigned compression_type,
+			       unsigned level)
+{
+	struct bbuf src_data = { NULL }, dst_data = { NULL };
+
+	/* If it's only one block, don't bother trying to compress: */
+	if (bio_sectors(src) <= c->opts.block_size)
+		return 0;
+
+	dst_data = bio_map_or_bounce(c, dst, WRITE);
+	src_data = bio_map_or_bounce(c, src, READ);
+
+	*src_len = src->bi_iter.bi_size;
+	*dst_len = dst->bi_iter.bi_size;
+
+	compression_type = __compress(c, dst_data.b, dst_len,
+				      src_data.b, src_len,
+				      compression_type, level);
+	if (!compression_type)
+		goto out;
+
 	if (dst_data.type != BB_NONE)
 		memcpy_to_bio(dst, dst->bi_iter, dst_data.b);
 
 	BUG_ON(!*dst_len || *dst_len > dst->bi_iter.bi_size);
 	BUG_ON(!*src_len || *src_len > src->bi_iter.bi_size);
-	BUG_ON(*dst_len & (block_bytes(c) - 1));
-	BUG_ON(*src_len & (block_bytes(c) - 1));
 out:
 	bio_unmap_or_unbounce(c, src_data);
 	bio_unmap_or_unbounce(c, dst_data);
 	return compression_type;
-err:
-	compression_type = 0;
-	goto out;
 }
 
 unsigned bch2_bio_compress(struct bch_fs *c,
 			   struct bio *dst, size_t *dst_len,
 			   struct bio *src, size_t *src_len,
-			   unsigned compression_type)
+			   unsigned compression_type,
+			   unsigned level)
 {
 	unsigned orig_dst = dst->bi_iter.bi_size;
 	unsigned orig_src = src->bi_iter.bi_size;
@@ -456,13 +1111,278 @@ unsigned bch2_bio_compress(struct bch_fs *c,
 		compression_type = BCH_COMPRESSION_LZ4;
 
 	compression_type =
-		__bio_compress(c, dst, dst_len, src, src_len, compression_type);
+		__bio_compress(c, dst, dst_len, src, src_len,
+			       compression_type, level);
 
 	dst->bi_iter.bi_size = orig_dst;
 	src->bi_iter.bi_size = orig_src;
 	return compression_type;
 }
 
+/*
+ * Parallel compression:
+ *
+ * A write bigger than encoded_extent_max is split into chunks that are
+ * compressed concurrently on c->compress_wq, a few chunks ahead of where the
+ * write path is consuming them; the write path still consumes them (and emits
+ * extents) in order, via bch2_compress_batch_next(), and falls back to
+ * compressing inline whenever the next chunk isn't available or doesn't match
+ * what it needs.
+ *
+ * The batch lives as long as the write op, so chunks queued ahead of one write
+ * point are used by the next rather than thrown away.
+ *
+ * The memory used by in flight chunks is bounded by the
+ * compression_inflight_max option: when we're at the limit we don't queue more
+ * chunks, we just compress inline. Chunks never allocate from the bounce
+ * mempools - if they can't get memory, that chunk is compressed inline too.
+ */
+
+struct bch_compress_chunk {
+	struct work_struct	work;
+	struct completion	done;
+	struct bch_fs		*c;
+	struct bio		*src;
+	struct bvec_iter	src_iter;
+	/* offset of this chunk from the start of the batch: */
+	unsigned		offset;
+	unsigned		compression_type;
+	unsigned		compression_level;
+	struct bbuf		buf;
+	size_t			src_len;
+	size_t			dst_len;
+};
+
+static void bch2_compress_chunk_work(struct work_struct *work)
+{
+	struct bch_compress_chunk *chunk =
+		container_of(work, struct bch_compress_chunk, work);
+	struct bch_fs *c = chunk->c;
+	unsigned bytes = chunk->src_iter.bi_size;
+	struct bbuf src_data;
+
+	src_data = __bio_map(c, chunk->src, chunk->src_iter, READ);
+	if (!src_data.b) {
+		src_data = __bounce_alloc_nopool(c, bytes, READ);
+		if (!src_data.b)
+			goto out;
+
+		memcpy_from_bio(src_data.b, chunk->src, chunk->src_iter);
+	}
+
+	chunk->buf = __bounce_alloc_nopool(c, bytes, WRITE);
+	if (!chunk->buf.b)
+		goto out_unmap;
+
+	chunk->src_len	= bytes;
+	/* Don't generate a bigger output than input: */
+	chunk->dst_len	= bytes;
+
+	chunk->compression_type =
+		__compress(c, chunk->buf.b, &chunk->dst_len,
+			   src_data.b, &chunk->src_len,
+			   chunk->compression_type,
+			   chunk->compression_level);
+out_unmap:
+	bio_unmap_or_unbounce(c, src_data);
+out:
+	complete(&chunk->done);
+}
+
+static void bch2_compress_chunk_free(struct bch_fs *c,
+				     struct bch_compress_chunk *chunk)
+{
+	wait_for_completion(&chunk->done);
+	bio_unmap_or_unbounce(c, chunk->buf);
+	atomic64_sub(chunk->src_iter.bi_size, &c->compress_inflight);
+	kfree(chunk);
+}
+
+static bool bch2_compress_inflight_get(struct bch_fs *c, unsigned bytes)
+{
+	u64 max = (u64) c->opts.compression_inflight_max << 9;
+
+	if (atomic64_add_return(bytes, &c->compress_inflight) <= max)
+		return true;
+
+	atomic64_sub(bytes, &c->compress_inflight);
+	return false;
+}
+
+static void bch2_compress_batch_fill(struct bch_fs *c,
+				     struct bch_compress_batch *b)
+{
+	unsigned chunk_max = c->sb.encoded_extent_max << 9;
+
+	/* If we fell back to compressing inline, restart from where we are: */
+	if (b->front == b->back) {
+		b->iter		= b->src->bi_iter;
+		b->queued	= b->src_size - b->src->bi_iter.bi_size;
+	}
+
+	while (b->back - b->front < ARRAY_SIZE(b->chunks) &&
+	       b->iter.bi_size > block_bytes(c)) {
+		struct bch_compress_chunk *chunk;
+		unsigned bytes = min(b->iter.bi_size, chunk_max);
+
+		if (!bch2_compress_inflight_get(c, bytes))
+			break;
+
+		chunk = kmalloc(sizeof(*chunk), GFP_NOWAIT|__GFP_NOWARN);
+		if (!chunk) {
+			atomic64_sub(bytes, &c->compress_inflight);
+			break;
+		}
+
+		INIT_WORK(&chunk->work, bch2_compress_chunk_work);
+		init_completion(&chunk->done);
+		chunk->c		= c;
+		chunk->src		= b->src;
+		chunk->src_iter		= b->iter;
+		chunk->src_iter.bi_size	= bytes;
+		chunk->offset		= b->queued;
+		chunk->compression_type	= b->compression_type;
+		chunk->compression_level = b->compression_level;
+		chunk->buf		= (struct bbuf) { NULL };
+
+		queue_work(c->compress_wq, &chunk->work);
+
+		b->chunks[b->back++ % ARRAY_SIZE(b->chunks)] = chunk;
+		bio_advance_iter(b->src, &b->iter, bytes);
+		b->queued += bytes;
+	}
+}
+
+/*
+ * Start compressing @src in parallel - only worth it if there's more than one
+ * chunk's worth:
+ */
+void bch2_compress_batch_init(struct bch_fs *c, struct bch_compress_batch *b,
+			      struct bio *src, unsigned compression_type,
+			      unsigned compression_level)
+{
+	memset(b, 0, sizeof(*b));
+
+	if (compression_type == BCH_COMPRESSION_LZ4_OLD)
+		compression_type = BCH_COMPRESSION_LZ4;
+
+	b->src			= src;
+	b->src_size		= src->bi_iter.bi_size;
+	b->compression_type	= compression_type;
+	b->compression_level	= compression_level;
+	b->parallel		= c->compress_wq &&
+		bio_sectors(src) > c->sb.encoded_extent_max;
+
+	if (b->parallel)
+		bch2_compress_batch_fill(c, b);
+}
+
+void bch2_compress_batch_exit(struct bch_fs *c, struct bch_compress_batch *b)
+{
+	while (b->front != b->back)
+		bch2_compress_chunk_free(c,
+			b->chunks[b->front++ % ARRAY_SIZE(b->chunks)]);
+
+	b->src = NULL;
+}
+
+/*
+ * Like bch2_bio_compress(), for the data at the current position of the
+ * batch's src bio: uses the next chunk if it's been compressed in parallel, and
+ * fits in @dst
+ */
+unsigned bch2_compress_batch_next(struct bch_fs *c, struct bch_compress_batch *b,
+				  struct bio *dst, size_t *dst_len,
+				  size_t *src_len)
+{
+	struct bio *src = b->src;
+	unsigned consumed = b->src_size - src->bi_iter.bi_size;
+	struct bch_compress_chunk *chunk = NULL;
+	unsigned ret;
+
+	if (!b->parallel)
+		goto fallback;
+
+	/* Drop chunks we've already written past: */
+	while (b->front != b->back) {
+		chunk = b->chunks[b->front % ARRAY_SIZE(b->chunks)];
+		if (chunk->offset >= consumed)
+			break;
+
+		bch2_compress_chunk_free(c, chunk);
+		b->front++;
+		chunk = NULL;
+	}
+
+	if (b->front == b->back)
+		bch2_compress_batch_fill(c, b);
+
+	if (b->front == b->back)
+		goto fallback;
+
+	chunk = b->chunks[b->front % ARRAY_SIZE(b->chunks)];
+	if (chunk->offset != consumed)
+		goto fallback;
+
+	wait_for_completion(&chunk->done);
+
+	/* Couldn't allocate buffers: */
+	if (!chunk->buf.b)
+		goto fallback;
+
+	if (chunk->compression_type &&
+	    chunk->dst_len > dst->bi_iter.bi_size)
+		goto fallback;
+
+	b->front++;
+
+	ret = chunk->compression_type;
+	if (ret) {
+		struct bvec_iter iter = dst->bi_iter;
+
+		iter.bi_size = chunk->dst_len;
+		memcpy_to_bio(dst, iter, chunk->buf.b);
+
+		*dst_len = chunk->dst_len;
+		*src_len = chunk->src_len;
+	}
+
+	bch2_compress_chunk_free(c, chunk);
+	bch2_compress_batch_fill(c, b);
+	return ret;
+fallback:
+	return bch2_bio_compress(c, dst, dst_len, src, src_len,
+				 b->compression_type, b->compression_level);
+}
+
+void bch2_compress_predict_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	static const char * const names[] = {
+#define x(n)	#n,
+		BCH_COMPRESS_PREDICT_STATS()
+#undef x
+	};
+	unsigned i;
+
+	for (i = 0; i < BCH_COMPRESS_PREDICT_NR; i++)
+		pr_buf(out, "%-20s%llu\n", names[i],
+		       (u64) atomic64_read(&c->compress_predict[i]));
+}
+
+void bch2_compress_bounce_stats_to_text(struct printbuf *out, struct bch_fs *c)
+{
+	static const char * const names[] = {
+#define x(n)	#n,
+		BCH_COMPRESS_BOUNCE_STATS()
+#undef x
+	};
+	unsigned i;
+
+	for (i = 0; i < BCH_COMPRESS_BOUNCE_NR; i++)
+		pr_buf(out, "%-20s%llu\n", names[i],
+		       (u64) atomic64_read(&c->compress_bounce[i]));
+}
+
 static int __bch2_fs_compress_init(struct bch_fs *, u64);
 
 #define BCH_FEATURE_NONE	0
@@ -517,40 +1437,61 @@ void bch2_fs_compress_exit(struct bch_fs *c)
 {
 	unsigned i;
 
-	mempool_exit(&c->decompress_workspace);
+	if (c->compress_wq)
+		destroy_workqueue(c->compress_wq);
+
+	bch2_compression_dict_exit(c);
+
+	workspace_pool_exit(&c->decompress_workspace);
 	for (i = 0; i < ARRAY_SIZE(c->compress_workspace); i++)
-		mempool_exit(&c->compress_workspace[i]);
+		workspace_pool_exit(&c->compress_workspace[i]);
 	mempool_exit(&c->compression_bounce[WRITE]);
 	mempool_exit(&c->compression_bounce[READ]);
 }
 
+/* Workspaces have to be big enough for any level, with or without the dict: */
+static size_t zstd_compress_workspace_size(struct bch_fs *c)
+{
+	size_t dict_len = c->compression_dict ? c->compression_dict->len : 0;
+	size_t ret = 0;
+	unsigned level;
+
+	for (level = 0; level <= BCH_COMPRESSION_LEVEL_MAX; level++) {
+		ret = max(ret, ZSTD_CCtxWorkspaceBound(
+				zstd_params(c, level, 0).cParams));
+		ret = max(ret, ZSTD_CCtxWorkspaceBound(
+				zstd_params(c, level, dict_len).cParams));
+	}
+
+	return ret;
+}
+
 static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 {
 	size_t max_extent = c->sb.encoded_extent_max << 9;
 	size_t order = get_order(max_extent);
 	size_t decompress_workspace_size = 0;
 	bool decompress_workspace_needed;
-	ZSTD_parameters params = ZSTD_getParams(0, max_extent, 0);
 	struct {
 		unsigned	feature;
 		unsigned	type;
 		size_t		compress_workspace;
 		size_t		decompress_workspace;
 	} compression_types[] = {
-		{ BCH_FEATURE_LZ4, BCH_COMPRESSION_LZ4, LZ4_MEM_COMPRESS, 0 },
+		{ BCH_FEATURE_LZ4, BCH_COMPRESSION_LZ4,
+			max_t(size_t, LZ4_MEM_COMPRESS, LZ4HC_MEM_COMPRESS), 0 },
 		{ BCH_FEATURE_GZIP, BCH_COMPRESSION_GZIP,
 			zlib_deflate_workspacesize(MAX_WBITS, DEF_MEM_LEVEL),
 			zlib_inflate_workspacesize(), },
 		{ BCH_FEATURE_ZSTD, BCH_COMPRESSION_ZSTD,
-			ZSTD_CCtxWorkspaceBound(params.cParams),
-			ZSTD_DCtxWorkspaceBound() },
+			zstd_compress_workspace_size(c),
+			max_t(size_t, ZSTD_DCtxWorkspaceBound(),
+			      ZSTD_DStreamWorkspaceBound(max_extent)) },
 	}, *i;
 	int ret = 0;
 
 	pr_verbose_init(c->opts, "");
 
-	c->zstd_params = params;
-
 	for (i = compression_types;
 	     i < compression_types + ARRAY_SIZE(compression_types);
 	     i++)
@@ -560,6 +1501,16 @@ static int __bch2_fs_compress_init(struct bch_fs *c, u64 features)
 	goto out;
 have_compressed:
 
+	if (!c->compress_wq) {
+		c->compress_wq = alloc_workqueue("bcachefs_compress",
+				WQ_UNBOUND|WQ_FREEZABLE|WQ_MEM_RECLAIM|
+				WQ_CPU_INTENSIVE, 0);
+		if (!c->compress_wq) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
 	if (!mempool_initialized(&c->compression_bounce[READ])) {
 		ret = mempool_init_page_pool(&c->compression_bounce[READ],
 					     1, order);
@@ -586,20 +1537,18 @@ have_compressed:
 		if (i->decompress_workspace)
 			decompress_workspace_needed = true;
 
-		if (mempool_initialized(&c->compress_workspace[i->type]))
+		if (c->compress_workspace[i->type].size)
 			continue;
 
-		ret = mempool_init_kvpmalloc_pool(
-				&c->compress_workspace[i->type],
-				1, i->compress_workspace);
+		ret = workspace_pool_init(&c->compress_workspace[i->type],
+					  i->compress_workspace);
 		if (ret)
 			goto out;
 	}
 
-	if (!mempool_initialized(&c->decompress_workspace)) {
-		ret = mempool_init_kmalloc_pool(
-				&c->decompress_workspace,
-				1, decompress_workspace_size);
+	if (!c->decompress_workspace.size) {
+		ret = workspace_pool_init(&c->decompress_workspace,
+					  decompress_workspace_size);
 		if (ret)
 			goto out;
 	}
@@ -611,6 +1560,11 @@ out:
 int bch2_fs_compress_init(struct bch_fs *c)
 {
 	u64 f = c->sb.features;
+	int ret;
+
+	ret = bch2_compression_dict_init(c);
+	if (ret)
+		return ret;
 
 	if (c->opts.compression)
 		f |= 1ULL << bch2_compression_opt_to_feature[c->opts.compression];
@@ -9,7 +9,22 @@ int bch2_bio_uncompress_inplace(struct bch_fs *, struct bio *,
 int bch2_bio_uncompress(struct bch_fs *, struct bio *, struct bio *,
 		       struct bvec_iter, struct bch_extent_crc_unpacked);
 unsigned bch2_bio_compress(struct bch_fs *, struct bio *, size_t *,
-			   struct bio *, size_t *, unsigned);
+			   struct bio *, size_t *, unsigned, unsigned);
+
+struct bch_compress_batch;
+
+void bch2_compress_batch_init(struct bch_fs *, struct bch_compress_batch *,
+			      struct bio *, unsigned, unsigned);
+void bch2_compress_batch_exit(struct bch_fs *, struct bch_compress_batch *);
+unsigned bch2_compress_batch_next(struct bch_fs *, struct bch_compress_batch *,
+				  struct bio *, size_t *, size_t *);
+
+int bch2_set_compression_dict(struct bch_fs *, const void *, size_t);
+extern const struct bch_sb_field_ops bch_sb_field_ops_compression_dict;
+
+struct printbuf;
+void bch2_compress_predict_stats_to_text(struct printbuf *, struct bch_fs *);
+void bch2_compress_bounce_stats_to_text(struct printbuf *, struct bch_fs *);
 
 int bch2_check_set_has_compressed_data(struct bch_fs *, unsigned);
 void bch2_fs_compress_exit(struct bch_fs *);
@@ -498,6 +498,7 @@ static void bch2_write_done(struct closure *cl)
 		bch2_disk_reservation_put(c, &op->res);
 	percpu_ref_put(&c->writes);
 	bch2_keylist_free(&op->insert_keys, op->inline_keys);
+	bch2_compress_batch_exit(c, &op->compress);
 
 	bch2_time_stats_update(&c->times[BCH_TIME_data_write], op->start_time);
 
@@ -754,13 +755,17 @@ static int bch2_write_decrypt(struct bch_write_op *op)
 	 * If we need to decrypt data in the write path, we'll no longer be able
 	 * to verify the existing checksum (poly1305 mac, in this case) after
 	 * it's decrypted - this is the last point we'll be able to reverify the
-	 * checksum:
+	 * checksum.
+	 *
+	 * The checksum is computed in the same pass as the decryption, so on
+	 * error the data has already been decrypted - that's fine, since the
+	 * write is failed:
 	 */
-	csum = bch2_checksum_bio(c, op->crc.csum_type, nonce, &op->wbio.bio);
+	csum = bch2_checksum_decrypt_bio(c, op->crc.csum_type, nonce,
+					 &op->wbio.bio);
 	if (bch2_crc_cmp(op->crc.csum, csum))
 		return -EIO;
 
-	bch2_encrypt_bio(c, op->crc.csum_type, nonce, &op->wbio.bio);
 	op->crc.csum_type = 0;
 	op->crc.csum = (struct bch_csum) { 0, 0 };
 	return 0;
@@ -892,11 +897,18 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 
 	saved_iter = dst->bi_iter;
 
+	/* Started on the first extent we compress, torn down in write_done: */
+	if (op->compression_type && !op->compress.src)
+		bch2_compress_batch_init(c, &op->compress, src,
+					 op->compression_type,
+					 op->compression_level);
+
 	do {
 		struct bch_extent_crc_unpacked crc =
 			(struct bch_extent_crc_unpacked) { 0 };
 		struct bversion version = op->version;
 		size_t dst_len, src_len;
+		bool rechecksum;
 
 		if (page_alloc_failed &&
 		    bio_sectors(dst) < wp->sectors_free &&
@@ -909,9 +921,15 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 		BUG_ON(op->compression_type && !bounce);
 
 		crc.compression_type = op->compression_type
-			?  bch2_bio_compress(c, dst, &dst_len, src, &src_len,
-					     op->compression_type)
+			?  bch2_compress_batch_next(c, &op->compress,
+						    dst, &dst_len, &src_len)
 			: 0;
+
+		rechecksum = (op->flags & BCH_WRITE_DATA_ENCODED) &&
+			!crc.compression_type &&
+			bch2_csum_type_is_encryption(op->crc.csum_type) ==
+			bch2_csum_type_is_encryption(op->csum_type);
+
 		if (!crc.compression_type) {
 			dst_len = min(dst->bi_iter.bi_size, src->bi_iter.bi_size);
 			dst_len = min_t(unsigned, dst_len, wp->sectors_free << 9);
@@ -920,7 +938,11 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 				dst_len = min_t(unsigned, dst_len,
 						c->sb.encoded_extent_max << 9);
 
-			if (bounce) {
+			/*
+			 * Otherwise, the copy is done below in the same pass as
+			 * encrypting and checksumming:
+			 */
+			if (bounce && rechecksum) {
 				swap(dst->bi_iter.bi_size, dst_len);
 				bio_copy_data(dst, src);
 				swap(dst->bi_iter.bi_size, dst_len);
@@ -940,10 +962,7 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			}
 		}
 
-		if ((op->flags & BCH_WRITE_DATA_ENCODED) &&
-		    !crc.compression_type &&
-		    bch2_csum_type_is_encryption(op->crc.csum_type) ==
-		    bch2_csum_type_is_encryption(op->csum_type)) {
+		if (rechecksum) {
 			/*
 			 * Note: when we're using rechecksum(), we need to be
 			 * checksumming @src because it has all the data our
@@ -976,10 +995,10 @@ static int bch2_write_extent(struct bch_write_op *op, struct write_point *wp,
 			crc.live_size		= src_len >> 9;
 
 			swap(dst->bi_iter.bi_size, dst_len);
-			bch2_encrypt_bio(c, op->csum_type,
-					 extent_nonce(version, crc), dst);
-			crc.csum = bch2_checksum_bio(c, op->csum_type,
-					 extent_nonce(version, crc), dst);
+			crc.csum = bch2_encrypt_checksum_bio(c, op->csum_type,
+					extent_nonce(version, crc), dst,
+					bounce && !crc.compression_type
+					? src : NULL);
 			crc.csum_type = op->csum_type;
 			swap(dst->bi_iter.bi_size, dst_len);
 		}
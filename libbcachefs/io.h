@@ -75,6 +75,7 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->error		= 0;
 	op->csum_type		= bch2_data_checksum_type(c, opts.data_checksum);
 	op->compression_type	= bch2_compression_opt_to_type[opts.compression];
+	op->compression_level	= opts.compression_level;
 	op->nr_replicas		= 0;
 	op->nr_replicas_required = c->opts.data_replicas_required;
 	op->alloc_reserve	= RESERVE_NONE;
@@ -90,6 +91,7 @@ static inline void bch2_write_op_init(struct bch_write_op *op, struct bch_fs *c,
 	op->new_i_size		= U64_MAX;
 	op->i_sectors_delta	= 0;
 	op->index_update_fn	= bch2_write_index_default;
+	op->compress		= (struct bch_compress_batch) { NULL };
 }
 
 void bch2_write(struct closure *);
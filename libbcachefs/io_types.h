@@ -90,6 +90,25 @@ struct bch_write_bio {
 	struct bio		bio;
 };
 
+struct bch_compress_chunk;
+
+/* Chunks of a write being compressed in parallel, see compress.c: */
+struct bch_compress_batch {
+	struct bio		*src;
+	unsigned		src_size;
+	unsigned		compression_type;
+	unsigned		compression_level;
+	bool			parallel;
+
+	/* next chunk to queue: */
+	struct bvec_iter	iter;
+	unsigned		queued;
+
+	unsigned		front;
+	unsigned		back;
+	struct bch_compress_chunk *chunks[8];
+};
+
 struct bch_write_op {
 	struct closure		cl;
 	struct bch_fs		*c;
@@ -102,6 +121,7 @@ struct bch_write_op {
 
 	unsigned		csum_type:4;
 	unsigned		compression_type:4;
+	unsigned		compression_level:5;
 	unsigned		nr_replicas:4;
 	unsigned		nr_replicas_required:4;
 	unsigned		alloc_reserve:4;
@@ -141,6 +161,12 @@ struct bch_write_op {
 	struct keylist		insert_keys;
 	u64			inline_keys[BKEY_EXTENT_U64s_MAX * 2];
 
+	/*
+	 * Lives as long as the op, since a write may be split across several
+	 * write points:
+	 */
+	struct bch_compress_batch compress;
+
 	/* Must be last: */
 	struct bch_write_bio	wbio;
 };
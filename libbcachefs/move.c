@@ -224,9 +224,11 @@ int bch2_migrate_write_init(struct bch_fs *c, struct migrate_write *m,
 	m->nr_ptrs_reserved = 0;
 
 	bch2_write_op_init(&m->op, c, io_opts);
-	m->op.compression_type =
-		bch2_compression_opt_to_type[io_opts.background_compression ?:
-					     io_opts.compression];
+	if (io_opts.background_compression) {
+		m->op.compression_type =
+			bch2_compression_opt_to_type[io_opts.background_compression];
+		m->op.compression_level = io_opts.background_compression_level;
+	}
 	m->op.target	= data_opts.target,
 	m->op.write_point = wp;
 
@@ -507,7 +509,7 @@ static int __bch2_move_data(struct bch_fs *c,
 	stats->pos	= POS_MIN;
 
 	iter = bch2_trans_get_iter(&trans, btree_id, start,
-				   BTREE_ITER_PREFETCH);
+				   BTREE_ITER_PREFETCH|BTREE_ITER_SCAN);
 
 	if (rate)
 		bch2_ratelimit_reset(rate);
@@ -130,6 +130,23 @@ enum opt_type {
 	  OPT_STR(bch2_compression_types),				\
 	  BCH_SB_BACKGROUND_COMPRESSION_TYPE,BCH_COMPRESSION_OPT_NONE,	\
 	  NULL,		NULL)						\
+	x(compression_level,		u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
+	  OPT_UINT(0, BCH_COMPRESSION_LEVEL_MAX),			\
+	  BCH_SB_COMPRESSION_LEVEL,	0,				\
+	  "level",	"Compression level, 0 for the default:\n"	\
+			"lz4 3-12 uses lz4hc, gzip 1-9, zstd 1-22")	\
+	x(background_compression_level,	u8,				\
+	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME|OPT_INODE,			\
+	  OPT_UINT(0, BCH_COMPRESSION_LEVEL_MAX),			\
+	  BCH_SB_BACKGROUND_COMPRESSION_LEVEL,0,			\
+	  "level",	"Compression level for background_compression")	\
+	x(compression_inflight_max,	u32,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_SECTORS(0, U32_MAX),					\
+	  NO_SB_OPT,			64 << 11,			\
+	  "size",	"Max memory for compressing writes in parallel,\n"\
+			"0 to always compress on the writing thread")	\
 	x(str_hash,			u8,				\
 	  OPT_FORMAT|OPT_MOUNT|OPT_RUNTIME,				\
 	  OPT_STR(bch2_str_hash_types),					\
@@ -223,6 +240,12 @@ enum opt_type {
 	  NULL,		"Disable journal flush on sync/fsync\n"		\
 			"If enabled, writes can be lost, but only since the\n"\
 			"last journal write (default 1 second)")	\
+	x(btree_scan_readahead,		u8,				\
+	  OPT_MOUNT|OPT_RUNTIME,					\
+	  OPT_UINT(0, U8_MAX),						\
+	  NO_SB_OPT,			64,				\
+	  "nodes",	"Max btree leaf reads in flight ahead of a\n"	\
+			"sequential scan, 0 to disable scan readahead")	\
 	x(fsck,				u8,				\
 	  OPT_MOUNT,							\
 	  OPT_BOOL(),							\
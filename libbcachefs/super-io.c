@@ -3,6 +3,7 @@
 #include "bcachefs.h"
 #include "buckets.h"
 #include "checksum.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "error.h"
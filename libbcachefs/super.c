@@ -1972,6 +1972,7 @@ static void bcachefs_exit(void)
 
 static int __init bcachefs_init(void)
 {
+	bch2_bkey_init();
 	bch2_bkey_pack_test();
 	bch2_inode_pack_test();
 
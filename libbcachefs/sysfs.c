@@ -18,6 +18,7 @@
 #include "btree_update_interior.h"
 #include "btree_gc.h"
 #include "buckets.h"
+#include "compress.h"
 #include "disk_groups.h"
 #include "ec.h"
 #include "inode.h"
@@ -161,6 +162,8 @@ read_attribute(bucket_quantiles_oldest_gen);
 read_attribute(reserve_stats);
 read_attribute(btree_cache_size);
 read_attribute(compression_stats);
+read_attribute(compression_predict_stats);
+read_attribute(compression_bounce_stats);
 read_attribute(journal_debug);
 read_attribute(journal_pins);
 read_attribute(btree_updates);
@@ -401,6 +404,20 @@ SHOW(bch2_fs)
 	if (attr == &sysfs_compression_stats)
 		return bch2_compression_stats(c, buf);
 
+	if (attr == &sysfs_compression_predict_stats) {
+		struct printbuf out = _PBUF(buf, PAGE_SIZE);
+
+		bch2_compress_predict_stats_to_text(&out, c);
+		return out.pos - buf;
+	}
+
+	if (attr == &sysfs_compression_bounce_stats) {
+		struct printbuf out = _PBUF(buf, PAGE_SIZE);
+
+		bch2_compress_bounce_stats_to_text(&out, c);
+		return out.pos - buf;
+	}
+
 	if (attr == &sysfs_new_stripes)
 		return bch2_new_stripes(c, buf);
 
@@ -491,16 +508,23 @@ STORE(__bch2_fs)
 		char *test		= strsep(&p, " \t\n");
 		char *nr_str		= strsep(&p, " \t\n");
 		char *threads_str	= strsep(&p, " \t\n");
+		struct btree_perf_test_result r;
 		unsigned threads;
 		u64 nr;
 		int ret = -EINVAL;
 
 		if (threads_str &&
 		    !(ret = kstrtouint(threads_str, 10, &threads)) &&
-		    !(ret = bch2_strtoull_h(nr_str, &nr)))
-			bch2_btree_perf_test(c, test, nr, threads);
-		else
+		    !(ret = bch2_strtoull_h(nr_str, &nr)) &&
+		    !(ret = bch2_btree_perf_test(c, test, nr, threads, &r))) {
+			char out_buf[160];
+			struct printbuf out = PBUF(out_buf);
+
+			bch2_btree_perf_test_to_text(&out, test, &r);
+			printk(KERN_INFO "%s", out_buf);
+		} else {
 			size = ret;
+		}
 		kfree(tmp);
 	}
 #endif
@@ -534,6 +558,8 @@ struct attribute *bch2_fs_files[] = {
 	&sysfs_promote_whole_extents,
 
 	&sysfs_compression_stats,
+	&sysfs_compression_predict_stats,
+	&sysfs_compression_bounce_stats,
 
 #ifdef CONFIG_BCACHEFS_TESTS
 	&sysfs_perf_test,
@@ -3,11 +3,14 @@
 
 #include "bcachefs.h"
 #include "btree_update.h"
+#include "btree_update_interior.h"
+#include "buckets.h"
 #include "journal_reclaim.h"
 #include "tests.h"
 
 #include "linux/kthread.h"
 #include "linux/random.h"
+#include "linux/sort.h"
 
 static void delete_test_keys(struct bch_fs *c)
 {
@@ -394,8 +397,241 @@ static void test_extent_overwrite_all(struct bch_fs *c, u64 nr)
 	__test_extent_overwrite(c, 32, 64, 32, 128);
 }
 
+/*
+ * Nothing else here uses the reflink btree, so on the scratch filesystems these
+ * tests are run on it's empty - as a bulk load requires. Bulk loads aren't
+ * allowed on mounted filesystems, though:
+ */
+static void test_bulk_load(struct bch_fs *c, u64 nr)
+{
+	struct btree_trans trans;
+	struct btree_iter *iter;
+	struct btree_bulk_load *load;
+	struct disk_reservation res;
+	struct bkey_s_c k;
+	u64 i;
+	int ret;
+
+	if (c->vfs_sb) {
+		pr_info("filesystem mounted, skipping bulk load test");
+		return;
+	}
+
+	nr = round_up(nr, 8);
+
+	/* reservation keys, so that the load has some accounting to do: */
+	ret = bch2_disk_reservation_get(c, &res, nr, 1, 0);
+	BUG_ON(ret);
+
+	pr_info("bulk loading test reservations");
+
+	load = bch2_btree_bulk_load_start(c, BTREE_ID_REFLINK, &res);
+	BUG_ON(IS_ERR(load));
+
+	for (i = 0; i < nr; i += 8) {
+		struct bkey_i_reservation k;
+
+		bkey_reservation_init(&k.k_i);
+		k.k.p.offset = i + 8;
+		k.k.size = 8;
+		k.v.nr_replicas = 1;
+
+		ret = bch2_btree_bulk_load_add(load, &k.k_i);
+		BUG_ON(ret);
+	}
+
+	ret = bch2_btree_bulk_load_finish(load);
+	BUG_ON(ret);
+
+	bch2_disk_reservation_put(c, &res);
+
+	pr_info("iterating forwards");
+
+	bch2_trans_init(&trans, c, 0, 0);
+
+	i = 0;
+
+	for_each_btree_key(&trans, iter, BTREE_ID_REFLINK,
+			   POS_MIN, 0, k, ret) {
+		BUG_ON(k.k->type != KEY_TYPE_reservation);
+		BUG_ON(bkey_start_offset(k.k) != i);
+		i = k.k->p.offset;
+	}
+	BUG_ON(ret);
+
+	BUG_ON(i != nr);
+
+	bch2_trans_exit(&trans);
+
+	ret = bch2_btree_delete_range(c, BTREE_ID_REFLINK,
+				      POS(0, 0), POS(0, U64_MAX),
+				      NULL);
+	BUG_ON(ret);
+}
+
 /* perf tests */
 
+/*
+ * Latency histograms, HDR style: values are bucketed by power of two, and each
+ * power of two is split into TEST_HIST_SUB linear sub-buckets, for ~6%
+ * precision over the whole u64 range:
+ */
+#define TEST_HIST_SUB_BITS		4
+#define TEST_HIST_SUB			(1U << TEST_HIST_SUB_BITS)
+#define TEST_HIST_BUCKETS		((64 - TEST_HIST_SUB_BITS + 1) * TEST_HIST_SUB)
+
+struct test_hist {
+	u64				nr;
+	u64				max;
+	u64				b[TEST_HIST_BUCKETS];
+};
+
+static inline unsigned test_hist_idx(u64 v)
+{
+	unsigned shift;
+
+	if (v < TEST_HIST_SUB)
+		return v;
+
+	shift = fls64(v) - 1 - TEST_HIST_SUB_BITS;
+	return (shift + 1) * TEST_HIST_SUB + ((v >> shift) & (TEST_HIST_SUB - 1));
+}
+
+/* Highest value that maps to bucket @idx: */
+static u64 test_hist_val(unsigned idx)
+{
+	unsigned shift;
+
+	if (idx < TEST_HIST_SUB)
+		return idx;
+
+	shift = idx / TEST_HIST_SUB - 1;
+	return ((u64) (TEST_HIST_SUB + idx % TEST_HIST_SUB) << shift) +
+		((1ULL << shift) - 1);
+}
+
+static inline void test_hist_add_nr(struct test_hist *h, u64 v, unsigned nr)
+{
+	h->nr += nr;
+	h->max = max(h->max, v);
+	h->b[test_hist_idx(v)] += nr;
+}
+
+static inline void test_hist_add(struct test_hist *h, u64 v)
+{
+	test_hist_add_nr(h, v, 1);
+}
+
+static void test_hist_merge(struct test_hist *dst, struct test_hist *src)
+{
+	unsigned i;
+
+	dst->nr += src->nr;
+	dst->max = max(dst->max, src->max);
+	for (i = 0; i < TEST_HIST_BUCKETS; i++)
+		dst->b[i] += src->b[i];
+}
+
+static u64 test_hist_quantile(struct test_hist *h, unsigned per_mille)
+{
+	u64 want = div_u64(h->nr * per_mille + 999, 1000), seen = 0;
+	unsigned i;
+
+	for (i = 0; i < TEST_HIST_BUCKETS; i++) {
+		seen += h->b[i];
+		if (seen >= want)
+			return min(test_hist_val(i), h->max);
+	}
+
+	return h->max;
+}
+
+static void test_hist_to_lat(struct btree_perf_test_lat *l,
+			     struct test_hist *h)
+{
+	l->nr = h->nr;
+	if (!h->nr)
+		return;
+
+	l->p50	= test_hist_quantile(h, 500);
+	l->p99	= test_hist_quantile(h, 990);
+	l->p999	= test_hist_quantile(h, 999);
+	l->max	= h->max;
+}
+
+const char * const bch2_btree_perf_ops[] = {
+#define x(n)	#n,
+	BTREE_PERF_OPS()
+#undef x
+	NULL
+};
+
+const char * const bch2_btree_trans_phases[] = {
+#define x(n)	#n,
+	BTREE_TRANS_PHASES()
+#undef x
+	NULL
+};
+
+/*
+ * Per thread perf test state: every iteration of a test is timed, as are the
+ * individual btree ops within it; trans->phase_time of the test's btree_trans
+ * points at phase_time, and each iteration's share of each phase goes into
+ * the phase histograms:
+ */
+struct test_thread {
+	struct bch_fs			*c;
+
+	u64				start;
+	struct test_hist		lat;
+	struct test_hist		op[BTREE_PERF_OP_NR];
+
+	u64				phase_time[BTREE_TRANS_PHASE_NR];
+	u64				phase_start[BTREE_TRANS_PHASE_NR];
+	struct test_hist		phase[BTREE_TRANS_PHASE_NR];
+};
+
+static void test_trans_init(struct test_thread *t, struct btree_trans *trans)
+{
+	bch2_trans_init(trans, t->c, 0, 0);
+	trans->phase_time = t->phase_time;
+}
+
+static inline u64 test_op_start(void)
+{
+	return local_clock();
+}
+
+static inline void test_op_end(struct test_thread *t, enum btree_perf_op op,
+			       u64 start)
+{
+	test_hist_add(&t->op[op], local_clock() - start);
+}
+
+/* For @nr ops timed together, record the average of each: */
+static inline void test_ops_end(struct test_thread *t, enum btree_perf_op op,
+				u64 start, unsigned nr)
+{
+	test_hist_add_nr(&t->op[op], div_u64(local_clock() - start, nr), nr);
+}
+
+/* End of an iteration: */
+static inline void test_iter_done(struct test_thread *t)
+{
+	u64 now = local_clock();
+	unsigned i;
+
+	test_hist_add(&t->lat, now - t->start);
+	t->start = now;
+
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++)
+		if (t->phase_time[i] != t->phase_start[i]) {
+			test_hist_add(&t->phase[i], t->phase_time[i] -
+				      t->phase_start[i]);
+			t->phase_start[i] = t->phase_time[i];
+		}
+}
+
 static u64 test_rand(void)
 {
 	u64 v;
@@ -407,57 +643,142 @@ static u64 test_rand(void)
 	return v;
 }
 
-static void rand_insert(struct bch_fs *c, u64 nr)
+/* Like bch2_btree_insert(), but in the test's btree_trans: */
+static int test_insert(struct btree_trans *trans, struct bkey_i *k)
 {
+	struct btree_iter *iter;
+	int ret;
+
+	do {
+		bch2_trans_begin(trans);
+
+		iter = bch2_trans_get_iter(trans, BTREE_ID_DIRENTS,
+					   bkey_start_pos(&k->k),
+					   BTREE_ITER_INTENT);
+		if (IS_ERR(iter))
+			return PTR_ERR(iter);
+
+		bch2_trans_update(trans, iter, k);
+
+		ret = bch2_trans_commit(trans, NULL, NULL, 0);
+	} while (ret == -EINTR);
+
+	return ret;
+}
+
+static void rand_insert(struct test_thread *t, u64 nr)
+{
+	struct btree_trans trans;
 	struct bkey_i_cookie k;
+	u64 start;
 	int ret;
 	u64 i;
 
+	test_trans_init(t, &trans);
+
 	for (i = 0; i < nr; i++) {
 		bkey_cookie_init(&k.k_i);
 		k.k.p.offset = test_rand();
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k.k_i,
-					NULL, NULL, 0);
+		start = test_op_start();
+		ret = test_insert(&trans, &k.k_i);
+		test_op_end(t, BTREE_PERF_OP_insert, start);
 		BUG_ON(ret);
+		test_iter_done(t);
 	}
+
+	bch2_trans_exit(&trans);
 }
 
-static void rand_lookup(struct bch_fs *c, u64 nr)
+static void rand_lookup(struct test_thread *t, u64 nr)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
+	u64 start;
 	u64 i;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	test_trans_init(t, &trans);
 
 	for (i = 0; i < nr; i++) {
+		start = test_op_start();
 		iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS,
 					   POS(0, test_rand()), 0);
 
 		k = bch2_btree_iter_peek(iter);
+		test_op_end(t, BTREE_PERF_OP_lookup, start);
+
 		bch2_trans_iter_free(&trans, iter);
+		test_iter_done(t);
+	}
+
+	bch2_trans_exit(&trans);
+}
+
+#define RAND_LOOKUP_MANY_BATCH	64
+
+static int bpos_cmp(const void *_l, const void *_r)
+{
+	const struct bpos *l = _l, *r = _r;
+
+	return bkey_cmp(*l, *r);
+}
+
+/* rand_lookup, but a sorted batch of positions at a time: */
+static void rand_lookup_many(struct test_thread *t, u64 nr)
+{
+	struct btree_trans trans;
+	struct bpos pos[RAND_LOOKUP_MANY_BATCH];
+	struct bkey_s_c *k;
+	u64 start;
+	u64 i;
+	unsigned j;
+	int ret;
+
+	test_trans_init(t, &trans);
+
+	for (i = 0; i < nr; i += RAND_LOOKUP_MANY_BATCH) {
+		for (j = 0; j < RAND_LOOKUP_MANY_BATCH; j++)
+			pos[j] = POS(0, test_rand());
+
+		sort(pos, RAND_LOOKUP_MANY_BATCH, sizeof(pos[0]),
+		     bpos_cmp, NULL);
+
+		start = test_op_start();
+		do {
+			bch2_trans_begin(&trans);
+
+			ret = bch2_btree_lookup_many(&trans, BTREE_ID_DIRENTS,
+					pos, RAND_LOOKUP_MANY_BATCH, 0, &k);
+		} while (ret == -EINTR);
+		test_ops_end(t, BTREE_PERF_OP_lookup, start,
+			     RAND_LOOKUP_MANY_BATCH);
+		BUG_ON(ret);
+
+		test_iter_done(t);
 	}
 
 	bch2_trans_exit(&trans);
 }
 
-static void rand_mixed(struct bch_fs *c, u64 nr)
+static void rand_mixed(struct test_thread *t, u64 nr)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
+	u64 start;
 	int ret;
 	u64 i;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	test_trans_init(t, &trans);
 
 	for (i = 0; i < nr; i++) {
+		start = test_op_start();
 		iter = bch2_trans_get_iter(&trans, BTREE_ID_DIRENTS,
 					   POS(0, test_rand()), 0);
 
 		k = bch2_btree_iter_peek(iter);
+		test_op_end(t, BTREE_PERF_OP_lookup, start);
 
 		if (!(i & 3) && k.k) {
 			struct bkey_i_cookie k;
@@ -466,52 +787,69 @@ static void rand_mixed(struct bch_fs *c, u64 nr)
 			k.k.p = iter->pos;
 
 			bch2_trans_update(&trans, iter, &k.k_i);
+
+			start = test_op_start();
 			ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+			test_op_end(t, BTREE_PERF_OP_commit, start);
 			BUG_ON(ret);
 		}
 
 		bch2_trans_iter_free(&trans, iter);
+		test_iter_done(t);
 	}
 
 	bch2_trans_exit(&trans);
 }
 
-static void rand_delete(struct bch_fs *c, u64 nr)
+static void rand_delete(struct test_thread *t, u64 nr)
 {
+	struct btree_trans trans;
 	struct bkey_i k;
+	u64 start;
 	int ret;
 	u64 i;
 
+	test_trans_init(t, &trans);
+
 	for (i = 0; i < nr; i++) {
 		bkey_init(&k.k);
 		k.k.p.offset = test_rand();
 
-		ret = bch2_btree_insert(c, BTREE_ID_DIRENTS, &k,
-					NULL, NULL, 0);
+		start = test_op_start();
+		ret = test_insert(&trans, &k);
+		test_op_end(t, BTREE_PERF_OP_delete, start);
 		BUG_ON(ret);
+		test_iter_done(t);
 	}
+
+	bch2_trans_exit(&trans);
 }
 
-static void seq_insert(struct bch_fs *c, u64 nr)
+static void seq_insert(struct test_thread *t, u64 nr)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	struct bkey_i_cookie insert;
+	u64 start;
 	int ret;
 	u64 i = 0;
 
 	bkey_cookie_init(&insert.k_i);
 
-	bch2_trans_init(&trans, c, 0, 0);
+	test_trans_init(t, &trans);
 
 	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
 			   BTREE_ITER_SLOTS|BTREE_ITER_INTENT, k, ret) {
 		insert.k.p = iter->pos;
 
 		bch2_trans_update(&trans, iter, &insert.k_i);
+
+		start = test_op_start();
 		ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+		test_op_end(t, BTREE_PERF_OP_commit, start);
 		BUG_ON(ret);
+		test_iter_done(t);
 
 		if (++i == nr)
 			break;
@@ -519,28 +857,30 @@ static void seq_insert(struct bch_fs *c, u64 nr)
 	bch2_trans_exit(&trans);
 }
 
-static void seq_lookup(struct bch_fs *c, u64 nr)
+static void seq_lookup(struct test_thread *t, u64 nr)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
 	int ret;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	test_trans_init(t, &trans);
 
+	/* each iteration is one lookup: */
 	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN, 0, k, ret)
-		;
+		test_iter_done(t);
 	bch2_trans_exit(&trans);
 }
 
-static void seq_overwrite(struct bch_fs *c, u64 nr)
+static void seq_overwrite(struct test_thread *t, u64 nr)
 {
 	struct btree_trans trans;
 	struct btree_iter *iter;
 	struct bkey_s_c k;
+	u64 start;
 	int ret;
 
-	bch2_trans_init(&trans, c, 0, 0);
+	test_trans_init(t, &trans);
 
 	for_each_btree_key(&trans, iter, BTREE_ID_DIRENTS, POS_MIN,
 			   BTREE_ITER_INTENT, k, ret) {
@@ -549,29 +889,38 @@ static void seq_overwrite(struct bch_fs *c, u64 nr)
 		bkey_reassemble(&u.k_i, k);
 
 		bch2_trans_update(&trans, iter, &u.k_i);
+
+		start = test_op_start();
 		ret = bch2_trans_commit(&trans, NULL, NULL, 0);
+		test_op_end(t, BTREE_PERF_OP_commit, start);
 		BUG_ON(ret);
+		test_iter_done(t);
 	}
 	bch2_trans_exit(&trans);
 }
 
-static void seq_delete(struct bch_fs *c, u64 nr)
+static void seq_delete(struct test_thread *t, u64 nr)
 {
+	u64 start = test_op_start();
 	int ret;
 
-	ret = bch2_btree_delete_range(c, BTREE_ID_DIRENTS,
+	ret = bch2_btree_delete_range(t->c, BTREE_ID_DIRENTS,
 				      POS(0, 0), POS(0, U64_MAX),
 				      NULL);
 	BUG_ON(ret);
+	test_op_end(t, BTREE_PERF_OP_delete, start);
+	test_iter_done(t);
 }
 
-typedef void (*perf_test_fn)(struct bch_fs *, u64);
+typedef void (*perf_test_fn)(struct test_thread *, u64);
+typedef void (*unit_test_fn)(struct bch_fs *, u64);
 
 struct test_job {
 	struct bch_fs			*c;
 	u64				nr;
 	unsigned			nr_threads;
 	perf_test_fn			fn;
+	unit_test_fn			unit_fn;
 
 	atomic_t			ready;
 	wait_queue_head_t		ready_wait;
@@ -581,11 +930,35 @@ struct test_job {
 
 	u64				start;
 	u64				finish;
+
+	/* merged from each thread as it finishes: */
+	struct mutex			lock;
+	struct test_hist		lat;
+	struct test_hist		op[BTREE_PERF_OP_NR];
+	u64				phase_time[BTREE_TRANS_PHASE_NR];
+	struct test_hist		phase[BTREE_TRANS_PHASE_NR];
 };
 
+static void test_thread_merge(struct test_job *j, struct test_thread *t)
+{
+	unsigned i;
+
+	mutex_lock(&j->lock);
+	test_hist_merge(&j->lat, &t->lat);
+	for (i = 0; i < BTREE_PERF_OP_NR; i++)
+		test_hist_merge(&j->op[i], &t->op[i]);
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++) {
+		j->phase_time[i] += t->phase_time[i];
+		test_hist_merge(&j->phase[i], &t->phase[i]);
+	}
+	mutex_unlock(&j->lock);
+}
+
 static int btree_perf_test_thread(void *data)
 {
 	struct test_job *j = data;
+	/* histograms are too big for the stack: */
+	struct test_thread *t = kzalloc(sizeof(*t), GFP_KERNEL);
 
 	if (atomic_dec_and_test(&j->ready)) {
 		wake_up(&j->ready_wait);
@@ -594,7 +967,18 @@ static int btree_perf_test_thread(void *data)
 		wait_event(j->ready_wait, !atomic_read(&j->ready));
 	}
 
-	j->fn(j->c, j->nr / j->nr_threads);
+	if (j->unit_fn) {
+		j->unit_fn(j->c, j->nr / j->nr_threads);
+	} else if (t) {
+		t->c		= j->c;
+		t->start	= local_clock();
+		j->fn(t, j->nr / j->nr_threads);
+		test_thread_merge(j, t);
+	} else {
+		pr_err("perf test thread: allocation failure");
+	}
+
+	kfree(t);
 
 	if (atomic_dec_and_test(&j->done)) {
 		j->finish = sched_clock();
@@ -604,25 +988,41 @@ static int btree_perf_test_thread(void *data)
 	return 0;
 }
 
-void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
-			  u64 nr, unsigned nr_threads)
+int bch2_btree_perf_test(struct bch_fs *c, const char *testname,
+			 u64 nr, unsigned nr_threads,
+			 struct btree_perf_test_result *r)
 {
-	struct test_job j = { .c = c, .nr = nr, .nr_threads = nr_threads };
-	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	struct test_job *j;
 	unsigned i;
-	u64 time;
 
-	atomic_set(&j.ready, nr_threads);
-	init_waitqueue_head(&j.ready_wait);
+	memset(r, 0, sizeof(*r));
 
-	atomic_set(&j.done, nr_threads);
-	init_completion(&j.done_completion);
+	if (!nr_threads)
+		return -EINVAL;
+
+	j = kzalloc(sizeof(*j), GFP_KERNEL);
+	if (!j)
+		return -ENOMEM;
+
+	j->c		= c;
+	j->nr		= nr;
+	j->nr_threads	= nr_threads;
+	mutex_init(&j->lock);
+
+	atomic_set(&j->ready, nr_threads);
+	init_waitqueue_head(&j->ready_wait);
+
+	atomic_set(&j->done, nr_threads);
+	init_completion(&j->done_completion);
 
 #define perf_test(_test)				\
-	if (!strcmp(testname, #_test)) j.fn = _test
+	if (!strcmp(testname, #_test)) j->fn = _test
+#define unit_test(_test)				\
+	if (!strcmp(testname, #_test)) j->unit_fn = _test
 
 	perf_test(rand_insert);
 	perf_test(rand_lookup);
+	perf_test(rand_lookup_many);
 	perf_test(rand_mixed);
 	perf_test(rand_delete);
 
@@ -632,47 +1032,106 @@ void bch2_btree_perf_test(struct bch_fs *c, const char *testname,
 	perf_test(seq_delete);
 
 	/* a unit test, not a perf test: */
-	perf_test(test_delete);
-	perf_test(test_delete_written);
-	perf_test(test_iterate);
-	perf_test(test_iterate_extents);
-	perf_test(test_iterate_slots);
-	perf_test(test_iterate_slots_extents);
-	perf_test(test_peek_end);
-	perf_test(test_peek_end_extents);
-
-	perf_test(test_extent_overwrite_front);
-	perf_test(test_extent_overwrite_back);
-	perf_test(test_extent_overwrite_middle);
-	perf_test(test_extent_overwrite_all);
-
-	if (!j.fn) {
+	unit_test(test_delete);
+	unit_test(test_delete_written);
+	unit_test(test_iterate);
+	unit_test(test_iterate_extents);
+	unit_test(test_iterate_slots);
+	unit_test(test_iterate_slots_extents);
+	unit_test(test_peek_end);
+	unit_test(test_peek_end_extents);
+
+	unit_test(test_extent_overwrite_front);
+	unit_test(test_extent_overwrite_back);
+	unit_test(test_extent_overwrite_middle);
+	unit_test(test_extent_overwrite_all);
+
+	unit_test(test_bulk_load);
+
+	if (!j->fn && !j->unit_fn) {
 		pr_err("unknown test %s", testname);
-		return;
+		kfree(j);
+		return -EINVAL;
 	}
 
 	//pr_info("running test %s:", testname);
 
 	if (nr_threads == 1)
-		btree_perf_test_thread(&j);
+		btree_perf_test_thread(j);
 	else
 		for (i = 0; i < nr_threads; i++)
-			kthread_run(btree_perf_test_thread, &j,
+			kthread_run(btree_perf_test_thread, j,
 				    "bcachefs perf test[%u]", i);
 
-	while (wait_for_completion_interruptible(&j.done_completion))
+	while (wait_for_completion_interruptible(&j->done_completion))
 		;
 
-	time = j.finish - j.start;
+	r->nr		= nr;
+	r->nr_threads	= nr_threads;
+	r->time		= j->finish - j->start;
+
+	test_hist_to_lat(&r->lat, &j->lat);
+	for (i = 0; i < BTREE_PERF_OP_NR; i++)
+		test_hist_to_lat(&r->op[i], &j->op[i]);
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++) {
+		r->phase_time[i] = j->phase_time[i];
+		test_hist_to_lat(&r->phase[i], &j->phase[i]);
+	}
+
+	kfree(j);
+	return 0;
+}
+
+void bch2_btree_perf_test_to_text(struct printbuf *out, const char *testname,
+				  struct btree_perf_test_result *r)
+{
+	char name_buf[20], nr_buf[20], per_sec_buf[20];
+	u64 time = max_t(u64, r->time, 1);
 
 	scnprintf(name_buf, sizeof(name_buf), "%s:", testname);
-	bch2_hprint(&PBUF(nr_buf), nr);
-	bch2_hprint(&PBUF(per_sec_buf), nr * NSEC_PER_SEC / time);
-	printk(KERN_INFO "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
-		name_buf, nr_buf, nr_threads,
-		time / NSEC_PER_SEC,
-		time * nr_threads / nr,
-		per_sec_buf);
+	bch2_hprint(&PBUF(nr_buf), r->nr);
+	bch2_hprint(&PBUF(per_sec_buf), div64_u64(r->nr * NSEC_PER_SEC, time));
+	pr_buf(out, "%-12s %s with %u threads in %5llu sec, %5llu nsec per iter, %5s per sec\n",
+	       name_buf, nr_buf, r->nr_threads,
+	       time / NSEC_PER_SEC,
+	       div64_u64(time * r->nr_threads, max_t(u64, r->nr, 1)),
+	       per_sec_buf);
+}
+
+static void lat_to_text(struct printbuf *out, const char *name,
+			struct btree_perf_test_lat *l)
+{
+	pr_buf(out, "  %-12s %10llu ops, p50 %8llu p99 %8llu p999 %8llu max %8llu nsec\n",
+	       name, l->nr, l->p50, l->p99, l->p999, l->max);
+}
+
+void bch2_btree_perf_test_lat_to_text(struct printbuf *out,
+				      struct btree_perf_test_result *r)
+{
+	u64 total = 0;
+	unsigned i;
+
+	if (r->lat.nr)
+		lat_to_text(out, "iteration", &r->lat);
+
+	for (i = 0; i < BTREE_PERF_OP_NR; i++)
+		if (r->op[i].nr)
+			lat_to_text(out, bch2_btree_perf_ops[i], &r->op[i]);
+
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++)
+		total += r->phase_time[i];
+	if (!total)
+		return;
+
+	pr_buf(out, "  phases:\n");
+	for (i = 0; i < BTREE_TRANS_PHASE_NR; i++)
+		if (r->phase[i].nr) {
+			lat_to_text(out, bch2_btree_trans_phases[i],
+				    &r->phase[i]);
+			pr_buf(out, "  %-12s %10llu nsec total, %llu%%\n", "",
+			       r->phase_time[i],
+			       div64_u64(r->phase_time[i] * 100, total));
+		}
 }
 
 #endif /* CONFIG_BCACHEFS_TESTS */
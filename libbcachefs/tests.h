@@ -2,11 +2,57 @@
 #ifndef _BCACHEFS_TEST_H
 #define _BCACHEFS_TEST_H
 
+#include "btree_types.h"
+
 struct bch_fs;
+struct printbuf;
 
 #ifdef CONFIG_BCACHEFS_TESTS
 
-void bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned);
+#define BTREE_PERF_OPS()		\
+	x(insert)			\
+	x(lookup)			\
+	x(delete)			\
+	x(commit)
+
+enum btree_perf_op {
+#define x(n)	BTREE_PERF_OP_##n,
+	BTREE_PERF_OPS()
+#undef x
+	BTREE_PERF_OP_NR
+};
+
+extern const char * const bch2_btree_perf_ops[];
+extern const char * const bch2_btree_trans_phases[];
+
+/* Latencies are in nsec, accurate to about 6%: */
+struct btree_perf_test_lat {
+	u64		nr;
+	u64		p50;
+	u64		p99;
+	u64		p999;
+	u64		max;
+};
+
+struct btree_perf_test_result {
+	u64		nr;
+	unsigned	nr_threads;
+	u64		time;		/* nsec, wall clock */
+
+	struct btree_perf_test_lat lat;	/* of each test iteration */
+	struct btree_perf_test_lat op[BTREE_PERF_OP_NR];
+
+	/* time spent in each phase: in total, and per iteration: */
+	u64		phase_time[BTREE_TRANS_PHASE_NR];
+	struct btree_perf_test_lat phase[BTREE_TRANS_PHASE_NR];
+};
+
+int bch2_btree_perf_test(struct bch_fs *, const char *, u64, unsigned,
+			 struct btree_perf_test_result *);
+void bch2_btree_perf_test_to_text(struct printbuf *, const char *,
+				  struct btree_perf_test_result *);
+void bch2_btree_perf_test_lat_to_text(struct printbuf *,
+				      struct btree_perf_test_result *);
 
 #else
 
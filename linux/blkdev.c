@@ -17,12 +17,429 @@
 #include <linux/completion.h>
 #include <linux/fs.h>
 #include <linux/kthread.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
 
 #include "tools-util.h"
 
 static io_context_t aio_ctx;
 static atomic_t running_requests;
 
+enum blkdev_io_engine {
+	BLKDEV_IO_AIO,
+	BLKDEV_IO_URING,
+};
+
+static enum blkdev_io_engine io_engine;
+
+static void aio_submit(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct iocb iocb = {
+		.data		= bio,
+		.aio_fildes	= bio->bi_opf & REQ_FUA
+			? bio->bi_bdev->bd_sync_fd
+			: bio->bi_bdev->bd_fd,
+		.aio_lio_opcode	= bio_op(bio) == REQ_OP_READ
+			? IO_CMD_PREADV
+			: IO_CMD_PWRITEV,
+		.u.v.vec	= iov,
+		.u.v.nr		= nr,
+		.u.v.offset	= bio->bi_iter.bi_sector << 9,
+	}, *iocbp = &iocb;
+	ssize_t ret;
+
+	atomic_inc(&running_requests);
+	ret = io_submit(aio_ctx, 1, &iocbp);
+	if (ret != 1)
+		die("io_submit err: %s", strerror(-ret));
+}
+
+#ifdef CONFIG_IO_URING
+
+#include <liburing.h>
+
+#define URING_DEPTH		256
+#define URING_MAX_BUFFERS	64
+
+/*
+ * One ring per block device: submitters serialize on @lock to prepare SQEs,
+ * a dedicated thread per ring reaps completions.
+ */
+struct blkdev_ring {
+	struct io_uring		ring;
+	struct mutex		lock;
+	unsigned		pending;
+	bool			fixed_files;
+	/* number of uring_bufs registered with this ring, under @lock: */
+	unsigned		nr_fixed_bufs;
+	atomic_t		running_requests;
+	struct task_struct	*completion_task;
+	struct list_head	list;
+};
+
+/*
+ * Multi segment requests need their iovec to outlive the call to
+ * generic_make_request() (submission may be deferred by a plug); they're
+ * allocated here and tagged with the low bit of the SQE's user_data:
+ */
+struct uring_req {
+	struct bio		*bio;
+	struct iovec		iov[];
+};
+
+#define URING_REQ_ALLOCATED	1UL
+
+static DEFINE_MUTEX(uring_lock);
+static LIST_HEAD(uring_rings);
+static struct iovec uring_bufs[URING_MAX_BUFFERS];
+static unsigned uring_nr_bufs;
+
+static int uring_find_buf(struct blkdev_ring *r, void *p, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; i < r->nr_fixed_bufs; i++)
+		if (p >= uring_bufs[i].iov_base &&
+		    p + len <= uring_bufs[i].iov_base + uring_bufs[i].iov_len)
+			return i;
+	return -1;
+}
+
+static void uring_register_bufs(struct blkdev_ring *r)
+{
+	if (r->nr_fixed_bufs) {
+		io_uring_unregister_buffers(&r->ring);
+		r->nr_fixed_bufs = 0;
+	}
+
+	if (uring_nr_bufs &&
+	    !io_uring_register_buffers(&r->ring, uring_bufs, uring_nr_bufs))
+		r->nr_fixed_bufs = uring_nr_bufs;
+}
+
+/*
+ * Register long lived, page aligned buffers (e.g. the FUSE daemon's buffer
+ * pools) with every ring, so bios whose pages are contiguous and fall entirely
+ * within one can use IORING_OP_READ_FIXED/WRITE_FIXED and skip the per-I/O page
+ * pinning:
+ */
+int blkdev_register_buffers(const struct iovec *iov, unsigned nr)
+{
+	struct blkdev_ring *r;
+	int ret = 0;
+
+	mutex_lock(&uring_lock);
+	if (uring_nr_bufs + nr > ARRAY_SIZE(uring_bufs)) {
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	memcpy(uring_bufs + uring_nr_bufs, iov, sizeof(*iov) * nr);
+	uring_nr_bufs += nr;
+
+	list_for_each_entry(r, &uring_rings, list) {
+		mutex_lock(&r->lock);
+		uring_register_bufs(r);
+		mutex_unlock(&r->lock);
+	}
+out:
+	mutex_unlock(&uring_lock);
+	return ret;
+}
+
+static void uring_submit_locked(struct blkdev_ring *r)
+{
+	int ret;
+
+	while (r->pending) {
+		ret = io_uring_submit(&r->ring);
+		if (ret == -EINTR || ret == -EAGAIN || ret == -EBUSY)
+			continue;
+		if (ret < 0)
+			die("io_uring_submit err: %s", strerror(-ret));
+
+		r->pending -= min_t(unsigned, ret, r->pending);
+	}
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct blkdev_ring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = io_uring_get_sqe(&r->ring)))
+		uring_submit_locked(r);
+
+	r->pending++;
+	return sqe;
+}
+
+static void uring_plug_add(struct blk_plug *plug, struct blkdev_ring *r)
+{
+	unsigned i;
+
+	for (i = 0; i < plug->nr; i++)
+		if (plug->rings[i] == r)
+			return;
+
+	if (plug->nr == ARRAY_SIZE(plug->rings)) {
+		mutex_lock(&plug->rings[0]->lock);
+		uring_submit_locked(plug->rings[0]);
+		mutex_unlock(&plug->rings[0]->lock);
+
+		memmove(plug->rings, plug->rings + 1,
+			sizeof(plug->rings[0]) * --plug->nr);
+	}
+
+	plug->rings[plug->nr++] = r;
+}
+
+/*
+ * bch2_bio_map() adds one bvec per page, but the pages are usually virtually
+ * contiguous - merge them back so we can use a single (possibly fixed) buffer:
+ */
+static unsigned iov_merge_contiguous(struct iovec *iov, unsigned nr)
+{
+	unsigned i, j = 0;
+
+	for (i = 1; i < nr; i++)
+		if (iov[j].iov_base + iov[j].iov_len == iov[i].iov_base)
+			iov[j].iov_len += iov[i].iov_len;
+		else
+			iov[++j] = iov[i];
+
+	return nr ? j + 1 : 0;
+}
+
+static void uring_submit(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	struct blkdev_ring *r = bio->bi_bdev->bd_ring;
+	/* Synchronous bios have a waiter, don't let them sit in a plug: */
+	struct blk_plug *plug = current && !(bio->bi_opf & REQ_SYNC)
+		? current->plug : NULL;
+	bool sync = bio->bi_opf & REQ_FUA;
+	/* with fixed files, bd_fd and bd_sync_fd are registered at 0 and 1: */
+	int fd = r->fixed_files ? sync
+		: sync ? bio->bi_bdev->bd_sync_fd : bio->bi_bdev->bd_fd;
+	u64 offset = bio->bi_iter.bi_sector << 9;
+	bool read = bio_op(bio) == REQ_OP_READ;
+	struct io_uring_sqe *sqe;
+	struct uring_req *req = NULL;
+	int buf_idx = -1;
+
+	nr = iov_merge_contiguous(iov, nr);
+
+	if (nr > 1) {
+		req = malloc(sizeof(*req) + sizeof(*iov) * nr);
+		if (!req)
+			die("malloc err");
+
+		req->bio = bio;
+		memcpy(req->iov, iov, sizeof(*iov) * nr);
+	}
+
+	atomic_inc(&r->running_requests);
+
+	mutex_lock(&r->lock);
+	if (!req)
+		buf_idx = uring_find_buf(r, iov[0].iov_base, iov[0].iov_len);
+
+	sqe = uring_get_sqe(r);
+
+	if (req) {
+		if (read)
+			io_uring_prep_readv(sqe, fd, req->iov, nr, offset);
+		else
+			io_uring_prep_writev(sqe, fd, req->iov, nr, offset);
+		io_uring_sqe_set_data(sqe, (void *) ((unsigned long) req|
+						     URING_REQ_ALLOCATED));
+	} else {
+		if (buf_idx >= 0 && read)
+			io_uring_prep_read_fixed(sqe, fd, iov[0].iov_base,
+						 iov[0].iov_len, offset, buf_idx);
+		else if (buf_idx >= 0)
+			io_uring_prep_write_fixed(sqe, fd, iov[0].iov_base,
+						  iov[0].iov_len, offset, buf_idx);
+		else if (read)
+			io_uring_prep_read(sqe, fd, iov[0].iov_base,
+					   iov[0].iov_len, offset);
+		else
+			io_uring_prep_write(sqe, fd, iov[0].iov_base,
+					    iov[0].iov_len, offset);
+		io_uring_sqe_set_data(sqe, bio);
+	}
+
+	if (r->fixed_files)
+		io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+
+	if (!plug)
+		uring_submit_locked(r);
+	mutex_unlock(&r->lock);
+
+	if (plug)
+		uring_plug_add(plug, r);
+}
+
+static int uring_completion_thread(void *arg)
+{
+	struct blkdev_ring *r = arg;
+	struct io_uring_cqe *cqes[32], *cqe;
+	unsigned i, nr;
+	int ret;
+	bool stop = false;
+
+	while (!stop) {
+		ret = io_uring_wait_cqe(&r->ring, &cqe);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0)
+			die("io_uring_wait_cqe() error: %s", strerror(-ret));
+
+		nr = io_uring_peek_batch_cqe(&r->ring, cqes, ARRAY_SIZE(cqes));
+
+		for (i = 0; i < nr; i++) {
+			unsigned long data = (unsigned long)
+				io_uring_cqe_get_data(cqes[i]);
+			struct uring_req *req = NULL;
+			struct bio *bio;
+
+			/* This should only happen during uring_exit() */
+			if (!data) {
+				BUG_ON(atomic_read(&r->running_requests) != 0);
+				stop = true;
+				continue;
+			}
+
+			if (data & URING_REQ_ALLOCATED) {
+				req = (void *) (data & ~URING_REQ_ALLOCATED);
+				bio = req->bio;
+			} else {
+				bio = (void *) data;
+			}
+
+			if (cqes[i]->res != bio->bi_iter.bi_size)
+				bio->bi_status = BLK_STS_IOERR;
+
+			free(req);
+			bio_endio(bio);
+			atomic_dec(&r->running_requests);
+		}
+
+		io_uring_cq_advance(&r->ring, nr);
+	}
+
+	return 0;
+}
+
+static struct blkdev_ring *uring_init(struct block_device *bdev)
+{
+	struct blkdev_ring *r = calloc(1, sizeof(*r));
+	int fds[2] = { bdev->bd_fd, bdev->bd_sync_fd };
+	struct task_struct *p;
+
+	if (!r)
+		return NULL;
+
+	if (io_uring_queue_init(URING_DEPTH, &r->ring, 0)) {
+		free(r);
+		return NULL;
+	}
+
+	mutex_init(&r->lock);
+	r->fixed_files = !io_uring_register_files(&r->ring, fds, 2);
+
+	p = kthread_run(uring_completion_thread, r, "uring_completion");
+	BUG_ON(IS_ERR(p));
+	r->completion_task = p;
+
+	mutex_lock(&uring_lock);
+	uring_register_bufs(r);
+	list_add(&r->list, &uring_rings);
+	mutex_unlock(&uring_lock);
+
+	return r;
+}
+
+static void uring_exit(struct blkdev_ring *r)
+{
+	struct io_uring_sqe *sqe;
+	int ret;
+
+	mutex_lock(&uring_lock);
+	list_del(&r->list);
+	mutex_unlock(&uring_lock);
+
+	get_task_struct(r->completion_task);
+
+	/* Wake up the completion thread with a NULL request: signal to stop */
+	mutex_lock(&r->lock);
+	sqe = uring_get_sqe(r);
+	io_uring_prep_nop(sqe);
+	io_uring_sqe_set_data(sqe, NULL);
+	uring_submit_locked(r);
+	mutex_unlock(&r->lock);
+
+	ret = kthread_stop(r->completion_task);
+	BUG_ON(ret);
+
+	put_task_struct(r->completion_task);
+
+	io_uring_queue_exit(&r->ring);
+	free(r);
+}
+
+void blk_start_plug(struct blk_plug *plug)
+{
+	plug->nr = 0;
+
+	if (current && !current->plug)
+		current->plug = plug;
+}
+
+static void blk_flush_plug(struct blk_plug *plug)
+{
+	unsigned i;
+
+	for (i = 0; i < plug->nr; i++) {
+		mutex_lock(&plug->rings[i]->lock);
+		uring_submit_locked(plug->rings[i]);
+		mutex_unlock(&plug->rings[i]->lock);
+	}
+	plug->nr = 0;
+}
+
+void blk_finish_plug(struct blk_plug *plug)
+{
+	if (current && current->plug == plug)
+		current->plug = NULL;
+
+	blk_flush_plug(plug);
+}
+
+#else /* CONFIG_IO_URING */
+
+static void uring_submit(struct bio *bio, struct iovec *iov, unsigned nr)
+{
+	BUG();
+}
+
+static struct blkdev_ring *uring_init(struct block_device *bdev)
+{
+	return NULL;
+}
+
+static void uring_exit(struct blkdev_ring *r) {}
+
+int blkdev_register_buffers(const struct iovec *iov, unsigned nr)
+{
+	return 0;
+}
+
+static void blk_flush_plug(struct blk_plug *plug) {}
+void blk_start_plug(struct blk_plug *plug) {}
+void blk_finish_plug(struct blk_plug *plug) {}
+
+#endif /* CONFIG_IO_URING */
+
 void generic_make_request(struct bio *bio)
 {
 	struct iovec *iov;
@@ -62,35 +479,13 @@ void generic_make_request(struct bio *bio)
 			VALGRIND_MAKE_MEM_DEFINED(start, len);
 	}
 
-	struct iocb iocb = {
-		.data		= bio,
-		.aio_fildes	= bio->bi_opf & REQ_FUA
-			? bio->bi_bdev->bd_sync_fd
-			: bio->bi_bdev->bd_fd,
-	}, *iocbp = &iocb;
-
 	switch (bio_op(bio)) {
 	case REQ_OP_READ:
-		iocb.aio_lio_opcode	= IO_CMD_PREADV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
-		atomic_inc(&running_requests);
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
-		break;
 	case REQ_OP_WRITE:
-		iocb.aio_lio_opcode	= IO_CMD_PWRITEV;
-		iocb.u.v.vec		= iov;
-		iocb.u.v.nr		= i;
-		iocb.u.v.offset		= bio->bi_iter.bi_sector << 9;
-
-		atomic_inc(&running_requests);
-		ret = io_submit(aio_ctx, 1, &iocbp);
-		if (ret != 1)
-			die("io_submit err: %s", strerror(-ret));
+		if (bio->bi_bdev->bd_ring)
+			uring_submit(bio, iov, i);
+		else
+			aio_submit(bio, iov, i);
 		break;
 	case REQ_OP_FLUSH:
 		ret = fsync(bio->bi_bdev->bd_fd);
@@ -117,6 +512,11 @@ int submit_bio_wait(struct bio *bio)
 	bio->bi_end_io = submit_bio_wait_endio;
 	bio->bi_opf |= REQ_SYNC;
 	submit_bio(bio);
+
+	/* like the kernel does on schedule(): we may depend on plugged IO */
+	if (current && current->plug)
+		blk_flush_plug(current->plug);
+
 	wait_for_completion(&done);
 
 	return blk_status_to_errno(bio->bi_status);
@@ -169,6 +569,9 @@ sector_t get_capacity(struct gendisk *disk)
 
 void blkdev_put(struct block_device *bdev, fmode_t mode)
 {
+	if (bdev->bd_ring)
+		uring_exit(bdev->bd_ring);
+
 	fdatasync(bdev->bd_fd);
 	close(bdev->bd_sync_fd);
 	close(bdev->bd_fd);
@@ -179,6 +582,7 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 					void *holder)
 {
 	struct block_device *bdev;
+	struct stat statbuf;
 	int fd, sync_fd, flags = O_DIRECT;
 
 	if ((mode & (FMODE_READ|FMODE_WRITE)) == (FMODE_READ|FMODE_WRITE))
@@ -211,6 +615,10 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	strncpy(bdev->name, path, sizeof(bdev->name));
 	bdev->name[sizeof(bdev->name) - 1] = '\0';
 
+	if (!fstat(fd, &statbuf))
+		bdev->bd_dev	= S_ISBLK(statbuf.st_mode)
+			? statbuf.st_rdev : statbuf.st_dev;
+
 	bdev->bd_fd		= fd;
 	bdev->bd_sync_fd	= sync_fd;
 	bdev->bd_holder		= holder;
@@ -218,9 +626,54 @@ struct block_device *blkdev_get_by_path(const char *path, fmode_t mode,
 	bdev->bd_bdi		= &bdev->__bd_bdi;
 	bdev->queue.backing_dev_info = bdev->bd_bdi;
 
+	/* falls back to libaio if we can't set up a ring for this device: */
+	if (io_engine == BLKDEV_IO_URING)
+		bdev->bd_ring = uring_init(bdev);
+
 	return bdev;
 }
 
+void blk_fill_rwbs(char *rwbs, unsigned int op, int bytes)
+{
+	int i = 0;
+
+	if (op & REQ_PREFLUSH)
+		rwbs[i++] = 'F';
+
+	switch (op & REQ_OP_MASK) {
+	case REQ_OP_WRITE:
+	case REQ_OP_WRITE_SAME:
+		rwbs[i++] = 'W';
+		break;
+	case REQ_OP_DISCARD:
+		rwbs[i++] = 'D';
+		break;
+	case REQ_OP_SECURE_ERASE:
+		rwbs[i++] = 'D';
+		rwbs[i++] = 'E';
+		break;
+	case REQ_OP_FLUSH:
+		rwbs[i++] = 'F';
+		break;
+	case REQ_OP_READ:
+		rwbs[i++] = 'R';
+		break;
+	default:
+		rwbs[i++] = 'N';
+	}
+
+	if (op & REQ_FUA)
+		rwbs[i++] = 'F';
+	if (op & REQ_RAHEAD)
+		rwbs[i++] = 'A';
+	if (op & REQ_SYNC)
+		rwbs[i++] = 'S';
+	if (op & REQ_META)
+		rwbs[i++] = 'M';
+
+	rwbs[i] = '\0';
+}
+
 void bdput(struct block_device *bdev)
 {
 	BUG();
@@ -273,6 +726,16 @@ __attribute__((constructor(102)))
 static void blkdev_init(void)
 {
 	struct task_struct *p;
+	const char *engine = getenv("BCACHEFS_IO_ENGINE");
+
+#ifdef CONFIG_IO_URING
+	io_engine = BLKDEV_IO_URING;
+#endif
+	if (engine && !strcmp(engine, "aio"))
+		io_engine = BLKDEV_IO_AIO;
+	else if (engine && strcmp(engine, "io_uring"))
+		die("unknown BCACHEFS_IO_ENGINE %s (must be aio or io_uring)",
+		    engine);
 
 	if (io_setup(256, &aio_ctx))
 		die("io_setup() error: %m");
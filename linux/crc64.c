@@ -26,13 +26,213 @@
  *   Author: Coly Li <colyli@suse.de>
  */
 
+#include <linux/compiler.h>
 #include <linux/module.h>
 #include <linux/types.h>
+#include <asm/unaligned.h>
 #include "crc64table.h"
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 MODULE_DESCRIPTION("CRC64 calculations");
 MODULE_LICENSE("GPL v2");
 
+/* x^64 is implicit: */
+#define CRC64_POLY	0x42f0e1eba9ea3693ULL
+
+/*
+ * Slicing-by-8: crc64table_slice[k][b] is b * x^(64 + 8k) mod P, so eight
+ * bytes are folded in with eight independent table lookups per iteration,
+ * instead of eight dependent ones:
+ */
+static u64 ____cacheline_aligned crc64table_slice[8][256];
+
+/* crc64_pow2[i] is x^(8 * 2^i) mod P, for crc64_be_shift(): */
+static u64 crc64_pow2[64];
+
+/* Multiply two polynomials mod P: */
+static u64 crc64_mulmod(u64 a, u64 b)
+{
+	u64 r = 0;
+
+	while (b) {
+		if (b & 1)
+			r ^= a;
+		b >>= 1;
+		a = (a << 1) ^ (a >> 63 ? CRC64_POLY : 0);
+	}
+
+	return r;
+}
+
+static u64 crc64_be_bytes(u64 crc, const u8 *p, size_t len)
+{
+	while (len--)
+		crc = crc64table[(crc >> 56) ^ *p++] ^ (crc << 8);
+
+	return crc;
+}
+
+static u64 crc64_be_slice8(u64 crc, const void *p, size_t len)
+{
+	const u64 (*t)[256] = crc64table_slice;
+
+	while (len >= 8) {
+		crc ^= get_unaligned_be64(p);
+		crc =	t[7][crc >> 56] ^
+			t[6][(crc >> 48) & 0xff] ^
+			t[5][(crc >> 40) & 0xff] ^
+			t[4][(crc >> 32) & 0xff] ^
+			t[3][(crc >> 24) & 0xff] ^
+			t[2][(crc >> 16) & 0xff] ^
+			t[1][(crc >>  8) & 0xff] ^
+			t[0][crc & 0xff];
+		p	+= 8;
+		len	-= 8;
+	}
+
+	return crc64_be_bytes(crc, p, len);
+}
+
+#ifdef __x86_64__
+
+/*
+ * Carry-less multiply folding, as in Intel's "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction": the data is loaded big endian, as
+ * 128 bit polynomials (bit 127 the first bit of the block), and four
+ * accumulators are folded forward 512 bits at a time with
+ *
+ *	A * x^n = H * x^(n + 64) + L * x^n == H * K(n + 64) ^ L * K(n)  (mod P)
+ *
+ * where K(n) = x^n mod P. Once everything's been folded into one 128 bit
+ * accumulator A, the crc is A * x^64 mod P: i.e. the crc of A's 16 bytes,
+ * which slicing-by-8 does in two steps.
+ */
+
+static __m128i crc64_k512, crc64_k384, crc64_k256, crc64_k128;
+
+static u64 crc64_xpow(unsigned n)
+{
+	u64 r = 1;
+
+	while (n--)
+		r = (r << 1) ^ (r >> 63 ? CRC64_POLY : 0);
+	return r;
+}
+
+static void crc64_pclmul_init(void)
+{
+	crc64_k512 = _mm_set_epi64x(crc64_xpow(576), crc64_xpow(512));
+	crc64_k384 = _mm_set_epi64x(crc64_xpow(448), crc64_xpow(384));
+	crc64_k256 = _mm_set_epi64x(crc64_xpow(320), crc64_xpow(256));
+	crc64_k128 = _mm_set_epi64x(crc64_xpow(192), crc64_xpow(128));
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_load_be(const void *p, __m128i bswap)
+{
+	return _mm_shuffle_epi8(_mm_loadu_si128(p), bswap);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc64_fold(__m128i a, __m128i k, __m128i b)
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x11),
+					   _mm_clmulepi64_si128(a, k, 0x00)),
+			     b);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static u64 crc64_be_pclmul(u64 crc, const void *p, size_t len)
+{
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+					   8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i a0, a1, a2, a3;
+	u8 buf[16];
+
+	if (len < 64)
+		return crc64_be_slice8(crc, p, len);
+
+	/* the initial crc is just xored into the first 64 bits of data: */
+	a0 = _mm_xor_si128(crc64_load_be(p, bswap),
+			   _mm_set_epi64x(crc, 0));
+	a1 = crc64_load_be(p + 16, bswap);
+	a2 = crc64_load_be(p + 32, bswap);
+	a3 = crc64_load_be(p + 48, bswap);
+	p	+= 64;
+	len	-= 64;
+
+	while (len >= 64) {
+		a0 = crc64_fold(a0, crc64_k512, crc64_load_be(p, bswap));
+		a1 = crc64_fold(a1, crc64_k512, crc64_load_be(p + 16, bswap));
+		a2 = crc64_fold(a2, crc64_k512, crc64_load_be(p + 32, bswap));
+		a3 = crc64_fold(a3, crc64_k512, crc64_load_be(p + 48, bswap));
+		p	+= 64;
+		len	-= 64;
+	}
+
+	a0 = crc64_fold(a0, crc64_k384,
+	     crc64_fold(a1, crc64_k256,
+	     crc64_fold(a2, crc64_k128, a3)));
+
+	while (len >= 16) {
+		a0 = crc64_fold(a0, crc64_k128, crc64_load_be(p, bswap));
+		p	+= 16;
+		len	-= 16;
+	}
+
+	_mm_storeu_si128((void *) buf, _mm_shuffle_epi8(a0, bswap));
+	crc = crc64_be_slice8(0, buf, sizeof(buf));
+
+	return crc64_be_bytes(crc, p, len);
+}
+
+#endif
+
+/*
+ * Everything's computed at startup, before there are threads that could race
+ * with it, and not by resolve_crc64_be() - which may run from the first
+ * crc64_be() call:
+ */
+__attribute__((constructor(110)))
+static void crc64_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++) {
+		u64 crc = crc64table[i];
+
+		crc64table_slice[0][i] = crc;
+		for (k = 1; k < 8; k++) {
+			crc = crc64table[crc >> 56] ^ (crc << 8);
+			crc64table_slice[k][i] = crc;
+		}
+	}
+
+	crc64_pow2[0] = 1ULL << 8;
+	for (i = 1; i < ARRAY_SIZE(crc64_pow2); i++)
+		crc64_pow2[i] = crc64_mulmod(crc64_pow2[i - 1],
+					     crc64_pow2[i - 1]);
+
+#ifdef __x86_64__
+	crc64_pclmul_init();
+#endif
+}
+
+static void *resolve_crc64_be(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("pclmul") &&
+	    __builtin_cpu_supports("ssse3")) {
+		crc64_pclmul_init();
+		return crc64_be_pclmul;
+	}
+#endif
+	return crc64_be_slice8;
+}
+
 /**
  * crc64_be - Calculate bitwise big-endian ECMA-182 CRC64
  * @crc: seed value for computation. 0 or (u64)~0 for a new CRC calculation,
@@ -40,17 +240,64 @@ MODULE_LICENSE("GPL v2");
  * @p: pointer to buffer over which CRC64 is run
  * @len: length of buffer @p
  */
-u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+#ifdef HAVE_WORKING_IFUNC
+
+static void *ifunc_resolve_crc64_be(void)
 {
-	size_t i, t;
+	__builtin_cpu_init();
+
+	return resolve_crc64_be();
+}
 
-	const unsigned char *_p = p;
+u64 __pure crc64_be(u64, const void *, size_t)
+	__attribute__((ifunc("ifunc_resolve_crc64_be")));
+
+#else
+
+u64 __pure crc64_be(u64 crc, const void *p, size_t len)
+{
+	static u64 (*real_crc64_be)(u64, const void *, size_t);
+	u64 (*fn)(u64, const void *, size_t) = READ_ONCE(real_crc64_be);
 
-	for (i = 0; i < len; i++) {
-		t = ((crc >> 56) ^ (*_p++)) & 0xFF;
-		crc = crc64table[t] ^ (crc << 8);
+	/* racing callers all resolve to the same function: */
+	if (unlikely(!fn)) {
+		fn = resolve_crc64_be();
+		WRITE_ONCE(real_crc64_be, fn);
 	}
 
-	return crc;
+	return fn(crc, p, len);
 }
+
+#endif /* HAVE_WORKING_IFUNC */
 EXPORT_SYMBOL_GPL(crc64_be);
+
+/**
+ * crc64_be_shift - extend a CRC64 over zeroes
+ * @crc: crc so far
+ * @len: number of zero bytes
+ *
+ * Equivalent to crc64_be(crc, zeroes, len), in O(log len) time.
+ */
+u64 __pure crc64_be_shift(u64 crc, size_t len)
+{
+	unsigned i;
+
+	for (i = 0; len; i++, len >>= 1)
+		if (len & 1)
+			crc = crc64_mulmod(crc, crc64_pow2[i]);
+
+	return crc;
+}
+EXPORT_SYMBOL_GPL(crc64_be_shift);
+
+/**
+ * crc64_be_combine - CRC64 of two concatenated buffers
+ * @crc1: crc64_be() of the first buffer, with the seed for the concatenation
+ * @crc2: crc64_be() of the second buffer, with a seed of 0
+ * @len2: length of the second buffer
+ */
+u64 __pure crc64_be_combine(u64 crc1, u64 crc2, size_t len2)
+{
+	return crc64_be_shift(crc1, len2) ^ crc2;
+}
+EXPORT_SYMBOL_GPL(crc64_be_combine);
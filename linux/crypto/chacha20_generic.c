@@ -20,8 +20,13 @@
 #include <crypto/chacha.h>
 #include <crypto/skcipher.h>
 
+#include <sodium/core.h>
 #include <sodium/crypto_stream_chacha20.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 static struct skcipher_alg alg;
 
 struct chacha20_tfm {
@@ -45,35 +50,251 @@ static int crypto_chacha20_setkey(struct crypto_skcipher *tfm, const u8 *key,
 	return 0;
 }
 
+#ifdef __x86_64__
+
+/*
+ * AVX-512: sixteen blocks at a time, one per 32 bit lane - each register holds
+ * one word of the state for all sixteen blocks, so the rounds need no shuffles,
+ * and rotates are single instructions. The keystream is then transposed back
+ * into block order: 4x4 within each 128 bit lane, then 4x4 across lanes.
+ */
+#define CHACHA20_AVX512_BYTES	(16 * CHACHA_BLOCK_SIZE)
+
+static bool chacha20_have_avx512;
+
+#define CHACHA20_QR(a, b, c, d)						\
+do {									\
+	a = _mm512_add_epi32(a, b);					\
+	d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 16);		\
+	c = _mm512_add_epi32(c, d);					\
+	b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 12);		\
+	a = _mm512_add_epi32(a, b);					\
+	d = _mm512_rol_epi32(_mm512_xor_si512(d, a), 8);		\
+	c = _mm512_add_epi32(c, d);					\
+	b = _mm512_rol_epi32(_mm512_xor_si512(b, c), 7);		\
+} while (0)
+
+/* Transpose rows a-d as 4x4 matrices, within each 128 bit lane: */
+#define CHACHA20_TRANSPOSE4(a, b, c, d)					\
+do {									\
+	__m512i t0 = _mm512_unpacklo_epi32(a, b);			\
+	__m512i t1 = _mm512_unpackhi_epi32(a, b);			\
+	__m512i t2 = _mm512_unpacklo_epi32(c, d);			\
+	__m512i t3 = _mm512_unpackhi_epi32(c, d);			\
+									\
+	a = _mm512_unpacklo_epi64(t0, t2);				\
+	b = _mm512_unpackhi_epi64(t0, t2);				\
+	c = _mm512_unpacklo_epi64(t1, t3);				\
+	d = _mm512_unpackhi_epi64(t1, t3);				\
+} while (0)
+
+/* And then 128 bit lanes, as a 4x4 matrix: */
+#define CHACHA20_TRANSPOSE4_LANES(a, b, c, d)				\
+do {									\
+	__m512i t0 = _mm512_shuffle_i32x4(a, b, _MM_SHUFFLE(1, 0, 1, 0));\
+	__m512i t1 = _mm512_shuffle_i32x4(a, b, _MM_SHUFFLE(3, 2, 3, 2));\
+	__m512i t2 = _mm512_shuffle_i32x4(c, d, _MM_SHUFFLE(1, 0, 1, 0));\
+	__m512i t3 = _mm512_shuffle_i32x4(c, d, _MM_SHUFFLE(3, 2, 3, 2));\
+									\
+	a = _mm512_shuffle_i32x4(t0, t2, _MM_SHUFFLE(2, 0, 2, 0));	\
+	b = _mm512_shuffle_i32x4(t0, t2, _MM_SHUFFLE(3, 1, 3, 1));	\
+	c = _mm512_shuffle_i32x4(t1, t3, _MM_SHUFFLE(2, 0, 2, 0));	\
+	d = _mm512_shuffle_i32x4(t1, t3, _MM_SHUFFLE(3, 1, 3, 1));	\
+} while (0)
+
+#define CHACHA20_XOR_BLOCK(_p, _i, _x)					\
+	_mm512_storeu_si512((_p) + (_i) * CHACHA_BLOCK_SIZE,		\
+		_mm512_xor_si512(_x, _mm512_loadu_si512((_p) + (_i) * CHACHA_BLOCK_SIZE)))
+
+/* Returns number of bytes done, a multiple of CHACHA20_AVX512_BYTES: */
+__attribute__((target("avx512f")))
+static size_t chacha20_xor_avx512(u8 *p, size_t len, const u32 key[8],
+				  const u32 nonce[2], u64 counter)
+{
+	const __m512i lanes = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+					       7, 6, 5, 4, 3, 2, 1, 0);
+	size_t done = 0;
+
+	while (len - done >= CHACHA20_AVX512_BYTES) {
+		__m512i s0 = _mm512_set1_epi32(0x61707865);
+		__m512i s1 = _mm512_set1_epi32(0x3320646e);
+		__m512i s2 = _mm512_set1_epi32(0x79622d32);
+		__m512i s3 = _mm512_set1_epi32(0x6b206574);
+		__m512i s4 = _mm512_set1_epi32(key[0]);
+		__m512i s5 = _mm512_set1_epi32(key[1]);
+		__m512i s6 = _mm512_set1_epi32(key[2]);
+		__m512i s7 = _mm512_set1_epi32(key[3]);
+		__m512i s8 = _mm512_set1_epi32(key[4]);
+		__m512i s9 = _mm512_set1_epi32(key[5]);
+		__m512i s10 = _mm512_set1_epi32(key[6]);
+		__m512i s11 = _mm512_set1_epi32(key[7]);
+		__m512i s12 = _mm512_add_epi32(_mm512_set1_epi32(counter), lanes);
+		/* 64 bit block counter - carry into the high word: */
+		__m512i s13 = _mm512_mask_add_epi32(_mm512_set1_epi32(counter >> 32),
+					_mm512_cmplt_epu32_mask(s12, lanes),
+					_mm512_set1_epi32(counter >> 32),
+					_mm512_set1_epi32(1));
+		__m512i s14 = _mm512_set1_epi32(nonce[0]);
+		__m512i s15 = _mm512_set1_epi32(nonce[1]);
+		__m512i x0 = s0, x1 = s1, x2 = s2, x3 = s3;
+		__m512i x4 = s4, x5 = s5, x6 = s6, x7 = s7;
+		__m512i x8 = s8, x9 = s9, x10 = s10, x11 = s11;
+		__m512i x12 = s12, x13 = s13, x14 = s14, x15 = s15;
+		u8 *b = p + done;
+		unsigned i;
+
+		for (i = 0; i < 10; i++) {
+			CHACHA20_QR(x0, x4, x8,  x12);
+			CHACHA20_QR(x1, x5, x9,  x13);
+			CHACHA20_QR(x2, x6, x10, x14);
+			CHACHA20_QR(x3, x7, x11, x15);
+			CHACHA20_QR(x0, x5, x10, x15);
+			CHACHA20_QR(x1, x6, x11, x12);
+			CHACHA20_QR(x2, x7, x8,  x13);
+			CHACHA20_QR(x3, x4, x9,  x14);
+		}
+
+		x0 = _mm512_add_epi32(x0, s0);
+		x1 = _mm512_add_epi32(x1, s1);
+		x2 = _mm512_add_epi32(x2, s2);
+		x3 = _mm512_add_epi32(x3, s3);
+		x4 = _mm512_add_epi32(x4, s4);
+		x5 = _mm512_add_epi32(x5, s5);
+		x6 = _mm512_add_epi32(x6, s6);
+		x7 = _mm512_add_epi32(x7, s7);
+		x8 = _mm512_add_epi32(x8, s8);
+		x9 = _mm512_add_epi32(x9, s9);
+		x10 = _mm512_add_epi32(x10, s10);
+		x11 = _mm512_add_epi32(x11, s11);
+		x12 = _mm512_add_epi32(x12, s12);
+		x13 = _mm512_add_epi32(x13, s13);
+		x14 = _mm512_add_epi32(x14, s14);
+		x15 = _mm512_add_epi32(x15, s15);
+
+		CHACHA20_TRANSPOSE4(x0, x1, x2, x3);
+		CHACHA20_TRANSPOSE4(x4, x5, x6, x7);
+		CHACHA20_TRANSPOSE4(x8, x9, x10, x11);
+		CHACHA20_TRANSPOSE4(x12, x13, x14, x15);
+
+		/* x0, x4, x8, x12 now have the first block of each lane, etc.: */
+		CHACHA20_TRANSPOSE4_LANES(x0, x4, x8,  x12);
+		CHACHA20_TRANSPOSE4_LANES(x1, x5, x9,  x13);
+		CHACHA20_TRANSPOSE4_LANES(x2, x6, x10, x14);
+		CHACHA20_TRANSPOSE4_LANES(x3, x7, x11, x15);
+
+		CHACHA20_XOR_BLOCK(b,  0, x0);
+		CHACHA20_XOR_BLOCK(b,  1, x1);
+		CHACHA20_XOR_BLOCK(b,  2, x2);
+		CHACHA20_XOR_BLOCK(b,  3, x3);
+		CHACHA20_XOR_BLOCK(b,  4, x4);
+		CHACHA20_XOR_BLOCK(b,  5, x5);
+		CHACHA20_XOR_BLOCK(b,  6, x6);
+		CHACHA20_XOR_BLOCK(b,  7, x7);
+		CHACHA20_XOR_BLOCK(b,  8, x8);
+		CHACHA20_XOR_BLOCK(b,  9, x9);
+		CHACHA20_XOR_BLOCK(b, 10, x10);
+		CHACHA20_XOR_BLOCK(b, 11, x11);
+		CHACHA20_XOR_BLOCK(b, 12, x12);
+		CHACHA20_XOR_BLOCK(b, 13, x13);
+		CHACHA20_XOR_BLOCK(b, 14, x14);
+		CHACHA20_XOR_BLOCK(b, 15, x15);
+
+		counter += 16;
+		done	+= CHACHA20_AVX512_BYTES;
+	}
+
+	return done;
+}
+
+#endif
+
+/*
+ * Whole blocks go sixteen at a time with AVX-512 when we have it, the rest to
+ * libsodium, which has its own SSSE3 and AVX2 implementations:
+ */
+static void chacha20_xor(u8 *p, size_t len, const u32 key[8],
+			 const u32 nonce[2], u64 counter)
+{
+	int ret;
+
+#ifdef __x86_64__
+	if (chacha20_have_avx512 && len >= CHACHA20_AVX512_BYTES) {
+		size_t done = chacha20_xor_avx512(p, len, key, nonce, counter);
+
+		p	+= done;
+		len	-= done;
+		counter	+= done / CHACHA_BLOCK_SIZE;
+	}
+#endif
+	if (!len)
+		return;
+
+	ret = crypto_stream_chacha20_xor_ic(p, p, len, (void *) nonce,
+					    counter, (void *) key);
+	BUG_ON(ret);
+}
+
+static void chacha20_xor_bytes(u8 *dst, const u8 *src, size_t len)
+{
+	while (len--)
+		*dst++ ^= *src++;
+}
+
+/*
+ * The whole scatterlist is one keystream: runs of virtually contiguous
+ * segments (i.e. most bios, in userspace) are done with a single call, and
+ * segments needn't be a multiple of the block size - the rest of a block that
+ * a segment ends in the middle of is used for the start of the next.
+ */
 static int crypto_chacha20_crypt(struct skcipher_request *req)
 {
 	struct chacha20_tfm *ctx =
 		container_of(req->tfm, struct chacha20_tfm, tfm.base);
 	struct scatterlist *sg = req->src;
 	unsigned nbytes = req->cryptlen;
+	u8 ks[CHACHA_BLOCK_SIZE];
+	unsigned ks_used = CHACHA_BLOCK_SIZE;
 	u32 iv[4];
-	int ret;
+	u64 counter;
 
 	BUG_ON(req->src != req->dst);
 
 	memcpy(iv, req->iv, sizeof(iv));
+	counter = iv[0] | ((u64) iv[1] << 32);
 
 	while (1) {
-		ret = crypto_stream_chacha20_xor_ic(sg_virt(sg),
-						    sg_virt(sg),
-						    sg->length,
-						    (void *) &iv[2],
-						    iv[0] | ((u64) iv[1] << 32),
-						    (void *) ctx->key);
-		BUG_ON(ret);
+		u8 *p = sg_virt(sg);
+		size_t len = sg->length, n;
+
+		while (!sg_is_last(sg) && sg_virt(sg_next(sg)) == p + len) {
+			sg = sg_next(sg);
+			len += sg->length;
+		}
+
+		nbytes -= len;
+
+		n = min_t(size_t, len, CHACHA_BLOCK_SIZE - ks_used);
+		chacha20_xor_bytes(p, ks + ks_used, n);
+		ks_used	+= n;
+		p	+= n;
+		len	-= n;
+
+		n = round_down(len, CHACHA_BLOCK_SIZE);
+		chacha20_xor(p, n, ctx->key, &iv[2], counter);
+		counter	+= n / CHACHA_BLOCK_SIZE;
+		p	+= n;
+		len	-= n;
 
-		nbytes -= sg->length;
+		if (len) {
+			memset(ks, 0, sizeof(ks));
+			chacha20_xor(ks, sizeof(ks), ctx->key, &iv[2], counter++);
+			chacha20_xor_bytes(p, ks, len);
+			ks_used = len;
+		}
 
 		if (sg_is_last(sg))
 			break;
 
-		BUG_ON(sg->length % CHACHA_BLOCK_SIZE);
-		iv[0] += sg->length / CHACHA_BLOCK_SIZE;
 		sg = sg_next(sg);
 	};
 
@@ -107,5 +328,11 @@ static struct skcipher_alg alg = {
 __attribute__((constructor(110)))
 static int chacha20_generic_mod_init(void)
 {
+	/* picks libsodium's SIMD implementations: */
+	if (sodium_init() < 0)
+		return -ENOMEM;
+#ifdef __x86_64__
+	chacha20_have_avx512 = __builtin_cpu_supports("avx512f");
+#endif
 	return crypto_register_skcipher(&alg);
 }
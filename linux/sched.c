@@ -101,20 +101,44 @@ out:
 	return timeout < 0 ? 0 : timeout;
 }
 
-__attribute__((constructor(101)))
-static void sched_init(void)
+static struct task_struct *alloc_current(void)
 {
 	struct task_struct *p = malloc(sizeof(*p));
 
-	mlockall(MCL_CURRENT|MCL_FUTURE);
-
 	memset(p, 0, sizeof(*p));
 
 	p->state	= TASK_RUNNING;
 	atomic_set(&p->usage, 1);
 	init_completion(&p->exited);
 
-	current = p;
+	return p;
+}
+
+void sched_thread_init(void)
+{
+	if (current)
+		return;
+
+	current = alloc_current();
+	rcu_register_thread();
+}
+
+void sched_thread_exit(void)
+{
+	if (!current)
+		return;
+
+	rcu_unregister_thread();
+	free(current);
+	current = NULL;
+}
+
+__attribute__((constructor(101)))
+static void sched_init(void)
+{
+	mlockall(MCL_CURRENT|MCL_FUTURE);
+
+	current = alloc_current();
 
 	rcu_init();
 	rcu_register_thread();
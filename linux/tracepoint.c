@@ -0,0 +1,423 @@
+
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/atomic.h>
+#include <linux/jiffies.h>
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
+#include <linux/tracepoint.h>
+
+/*
+ * Each thread records events into its own ring buffer, so recording an event
+ * takes no locks and no atomic ops: the owning thread is the only writer of
+ * head and tail; readers (trace_events_dump()) copy the buffer out and then
+ * recheck tail to see what was overwritten while they were copying.
+ *
+ * Buffers outlive their threads so their events can still be dumped, and are
+ * reused by new threads.
+ */
+
+#define TRACE_BUF_SIZE		(1U << 20)
+#define TRACE_BUF_MASK		(TRACE_BUF_SIZE - 1)
+
+struct trace_entry {
+	u64			time;
+	/* NULL: padding to the end of the buffer */
+	struct trace_event_call	*event;
+	u32			size;
+	u32			tid;
+	u64			pad;
+	u64			data[];
+};
+
+/* every entry is a multiple of the header size, so a header always fits: */
+#define TRACE_ENTRY_ALIGN	sizeof(struct trace_entry)
+
+struct trace_buf {
+	struct list_head	list;
+	bool			in_use;
+	u32			tid;
+	u64			head;
+	u64			tail;
+	u64			reserved;
+	char			data[TRACE_BUF_SIZE];
+};
+
+static LIST_HEAD(trace_bufs);
+static DEFINE_MUTEX(trace_bufs_lock);
+static pthread_key_t trace_buf_key;
+static pthread_once_t trace_buf_key_once = PTHREAD_ONCE_INIT;
+static __thread struct trace_buf *trace_buf;
+
+extern struct trace_event_call * const __start__ftrace_events[] __attribute__((weak));
+extern struct trace_event_call * const __stop__ftrace_events[] __attribute__((weak));
+
+#define for_each_trace_event(_e)					\
+	for (_e = __start__ftrace_events; _e < __stop__ftrace_events; _e++)
+
+static void trace_buf_put(void *p)
+{
+	struct trace_buf *b = p;
+
+	mutex_lock(&trace_bufs_lock);
+	b->in_use = false;
+	mutex_unlock(&trace_bufs_lock);
+}
+
+static void trace_buf_key_init(void)
+{
+	pthread_key_create(&trace_buf_key, trace_buf_put);
+}
+
+static struct trace_buf *trace_buf_get(void)
+{
+	struct trace_buf *b;
+
+	pthread_once(&trace_buf_key_once, trace_buf_key_init);
+
+	mutex_lock(&trace_bufs_lock);
+	list_for_each_entry(b, &trace_bufs, list)
+		if (!b->in_use)
+			goto found;
+
+	b = malloc(sizeof(*b));
+	if (!b)
+		goto out;
+
+	b->head = b->tail = 0;
+	list_add_tail(&b->list, &trace_bufs);
+found:
+	b->in_use	= true;
+	b->tid		= syscall(SYS_gettid);
+	pthread_setspecific(trace_buf_key, b);
+	trace_buf = b;
+out:
+	mutex_unlock(&trace_bufs_lock);
+	return b;
+}
+
+static inline struct trace_entry *trace_buf_entry(struct trace_buf *b, u64 pos)
+{
+	return (void *) b->data + (pos & TRACE_BUF_MASK);
+}
+
+/* Drop the oldest entries until there's room for everything before @end: */
+static void trace_buf_make_room(struct trace_buf *b, u64 end)
+{
+	u64 tail = b->tail;
+
+	if (end - tail <= TRACE_BUF_SIZE)
+		return;
+
+	while (end - tail > TRACE_BUF_SIZE)
+		tail += trace_buf_entry(b, tail)->size;
+
+	WRITE_ONCE(b->tail, tail);
+	/* readers must see the new tail before we overwrite: */
+	smp_wmb();
+}
+
+void *trace_event_reserve(struct trace_event_call *event, unsigned size)
+{
+	struct trace_buf *b = trace_buf ?: trace_buf_get();
+	unsigned len = round_up(sizeof(struct trace_entry) + size,
+				TRACE_ENTRY_ALIGN);
+	struct trace_entry *e;
+	u64 head;
+
+	if (!b || len > TRACE_BUF_SIZE)
+		return NULL;
+
+	head = b->head;
+
+	if ((head & TRACE_BUF_MASK) + len > TRACE_BUF_SIZE) {
+		unsigned pad = TRACE_BUF_SIZE - (head & TRACE_BUF_MASK);
+
+		trace_buf_make_room(b, head + pad);
+		e = trace_buf_entry(b, head);
+		e->event	= NULL;
+		e->size		= pad;
+		head += pad;
+	}
+
+	trace_buf_make_room(b, head + len);
+
+	e = trace_buf_entry(b, head);
+	e->time		= local_clock();
+	e->event	= event;
+	e->size		= len;
+	e->tid		= b->tid;
+
+	b->reserved	= head + len;
+	return e->data;
+}
+
+void trace_event_commit(void *data)
+{
+	struct trace_buf *b = trace_buf;
+
+	smp_store_release(&b->head, b->reserved);
+}
+
+/* Formatting: */
+
+struct trace_out {
+	char		*pos;
+	char		*end;
+};
+
+static void trace_out_printf(struct trace_out *out, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, fmt);
+	n = vsnprintf(out->pos, out->end - out->pos, fmt, args);
+	va_end(args);
+
+	if (n > 0)
+		out->pos += min_t(size_t, n, out->end - out->pos - 1);
+}
+
+static void trace_out_uuid(struct trace_out *out, const u8 *u)
+{
+	trace_out_printf(out,
+		"%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x",
+		u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7],
+		u[8], u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+/*
+ * snprintf() that understands the kernel's %p extensions that tracepoints use:
+ * %pU prints a uuid, and %pf/%pF/%ps/%pS print the pointer (we don't have
+ * symbols to look up).
+ */
+int trace_snprintf(char *buf, size_t size, const char *fmt, ...)
+{
+	struct trace_out out = { buf, buf + size };
+	char spec[16];
+	va_list args;
+
+	if (!size)
+		return 0;
+
+	*buf = '\0';
+	va_start(args, fmt);
+
+	while (*fmt) {
+		const char *p;
+		unsigned len;
+		char conv;
+
+		if (*fmt != '%') {
+			p = strchrnul(fmt, '%');
+			trace_out_printf(&out, "%.*s", (int) (p - fmt), fmt);
+			fmt = p;
+			continue;
+		}
+
+		len = 1 + strspn(fmt + 1, "-+ #0123456789.hljzt");
+		conv = fmt[len];
+		if (!conv || len + 2 > sizeof(spec))
+			break;
+
+		memcpy(spec, fmt, len + 1);
+		spec[len + 1] = '\0';
+		fmt += len + 1;
+
+		switch (conv) {
+		case '%':
+			trace_out_printf(&out, "%%");
+			break;
+		case 'p': {
+			void *ptr = va_arg(args, void *);
+
+			switch (*fmt) {
+			case 'U':
+				fmt++;
+				trace_out_uuid(&out, ptr);
+				break;
+			case 'f':
+			case 'F':
+			case 's':
+			case 'S':
+				fmt++;
+				/* fallthrough */
+			default:
+				trace_out_printf(&out, spec, ptr);
+			}
+			break;
+		}
+		case 's':
+			trace_out_printf(&out, spec, va_arg(args, const char *));
+			break;
+		case 'c':
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			if (strstr(spec, "ll") || strchr(spec, 'j'))
+				trace_out_printf(&out, spec, va_arg(args, long long));
+			else if (strchr(spec, 'z'))
+				trace_out_printf(&out, spec, va_arg(args, size_t));
+			else if (strchr(spec, 't'))
+				trace_out_printf(&out, spec, va_arg(args, ptrdiff_t));
+			else if (strchr(spec, 'l'))
+				trace_out_printf(&out, spec, va_arg(args, long));
+			else
+				trace_out_printf(&out, spec, va_arg(args, int));
+			break;
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+			trace_out_printf(&out, spec, va_arg(args, double));
+			break;
+		default:
+			trace_out_printf(&out, "%s", spec);
+		}
+	}
+
+	va_end(args);
+	return out.pos - buf;
+}
+
+/* Enabling, listing and dumping events: */
+
+/* Enable or disable all events matching a glob; returns number matched: */
+int trace_events_enable(const char *pattern, bool enable)
+{
+	struct trace_event_call * const *e;
+	int nr = 0;
+
+	if (!strcmp(pattern, "all"))
+		pattern = "*";
+
+	for_each_trace_event(e)
+		if (!fnmatch(pattern, (*e)->name, 0)) {
+			WRITE_ONCE((*e)->enabled, enable);
+			nr++;
+		}
+
+	return nr;
+}
+
+static int trace_event_name_cmp(const void *_l, const void *_r)
+{
+	const struct trace_event_call * const *l = _l, * const *r = _r;
+
+	return strcmp((*l)->name, (*r)->name);
+}
+
+void trace_events_list(FILE *f)
+{
+	size_t i, nr = __stop__ftrace_events - __start__ftrace_events;
+	struct trace_event_call **events = malloc(nr * sizeof(*events) + 1);
+
+	if (!events)
+		return;
+
+	memcpy(events, __start__ftrace_events, nr * sizeof(*events));
+	sort(events, nr, sizeof(events[0]), trace_event_name_cmp, NULL);
+
+	for (i = 0; i < nr; i++)
+		fprintf(f, "%s%s\n", events[i]->name,
+			events[i]->enabled ? " [enabled]" : "");
+	free(events);
+}
+
+static int trace_entry_time_cmp(const void *_l, const void *_r)
+{
+	const struct trace_entry * const *l = _l, * const *r = _r;
+
+	return ((*l)->time > (*r)->time) - ((*l)->time < (*r)->time);
+}
+
+/* Copy out the live part of a buffer, and add its entries to @entries: */
+static void trace_buf_snapshot(struct trace_buf *b, char *data,
+				 struct trace_entry ***entries, size_t *nr,
+				 size_t *size)
+{
+	u64 head, tail, tail2, pos;
+
+	head = smp_load_acquire(&b->head);
+	tail = READ_ONCE(b->tail);
+	memcpy(data, b->data, TRACE_BUF_SIZE);
+	smp_rmb();
+	tail2 = READ_ONCE(b->tail);
+
+	/* anything before the writer's current tail may have been overwritten: */
+	for (pos = max(tail, tail2); pos < head;) {
+		struct trace_entry *e = (void *) data + (pos & TRACE_BUF_MASK);
+
+		pos += e->size;
+		if (!e->event)
+			continue;
+
+		if (*nr == *size) {
+			size_t new_size = max_t(size_t, *size * 2, 1024);
+			void *p = realloc(*entries, new_size * sizeof(**entries));
+
+			if (!p)
+				break;
+			*entries	= p;
+			*size		= new_size;
+		}
+
+		(*entries)[(*nr)++] = e;
+	}
+}
+
+/* Print all recorded events, from all threads, in timestamp order: */
+void trace_events_dump(FILE *f)
+{
+	struct trace_entry **entries = NULL;
+	struct trace_buf *b;
+	char *data = NULL, buf[1024];
+	size_t i, nr = 0, size = 0, nr_bufs = 0;
+
+	mutex_lock(&trace_bufs_lock);
+	list_for_each_entry(b, &trace_bufs, list)
+		nr_bufs++;
+
+	data = malloc(nr_bufs * TRACE_BUF_SIZE + 1);
+	if (!data) {
+		mutex_unlock(&trace_bufs_lock);
+		return;
+	}
+
+	i = 0;
+	list_for_each_entry(b, &trace_bufs, list)
+		trace_buf_snapshot(b, data + i++ * TRACE_BUF_SIZE,
+				   &entries, &nr, &size);
+	mutex_unlock(&trace_bufs_lock);
+
+	sort(entries, nr, sizeof(entries[0]), trace_entry_time_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct trace_entry *e = entries[i];
+
+		e->event->print(buf, sizeof(buf), e->data);
+		fprintf(f, "%7u %5llu.%09llu %s: %s\n",
+			e->tid,
+			e->time / NSEC_PER_SEC,
+			e->time % NSEC_PER_SEC,
+			e->event->name, buf);
+	}
+
+	free(entries);
+	free(data);
+}
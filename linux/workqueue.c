@@ -1,4 +1,5 @@
 #include <pthread.h>
+#include <sys/sysinfo.h>
 
 #include <linux/kthread.h>
 #include <linux/slab.h>
@@ -7,16 +8,28 @@
 static pthread_mutex_t	wq_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(wq_list);
 
+struct workqueue_worker {
+	struct workqueue_struct	*wq;
+	struct task_struct	*task;
+	struct work_struct	*current_work;
+};
+
+/*
+ * Unbound, unordered workqueues get a worker thread per cpu (up to
+ * max_active), so that work items on them actually run concurrently; everything
+ * else gets a single worker, and thus runs work items in order:
+ */
 struct workqueue_struct {
 	struct list_head	list;
 
-	struct work_struct	*current_work;
 	struct list_head	pending_work;
 
 	pthread_cond_t		work_finished;
 
-	struct task_struct	*worker;
 	char			name[24];
+
+	unsigned		nr_workers;
+	struct workqueue_worker	workers[];
 };
 
 enum {
@@ -33,6 +46,30 @@ static bool set_work_pending(struct work_struct *work)
 	return !test_and_set_bit(WORK_PENDING_BIT, work_data_bits(work));
 }
 
+static bool work_running(struct work_struct *work)
+{
+	struct workqueue_struct *wq;
+	unsigned i;
+
+	list_for_each_entry(wq, &wq_list, list)
+		for (i = 0; i < wq->nr_workers; i++)
+			if (wq->workers[i].current_work == work)
+				return true;
+
+	return false;
+}
+
+static void wq_wake_worker(struct workqueue_struct *wq)
+{
+	unsigned i;
+
+	for (i = 0; i < wq->nr_workers; i++)
+		if (!wq->workers[i].current_work) {
+			wake_up_process(wq->workers[i].task);
+			return;
+		}
+}
+
 static void __queue_work(struct workqueue_struct *wq,
 			 struct work_struct *work)
 {
@@ -40,7 +77,7 @@ static void __queue_work(struct workqueue_struct *wq,
 	BUG_ON(!list_empty(&work->entry));
 
 	list_add_tail(&work->entry, &wq->pending_work);
-	wake_up_process(wq->worker);
+	wq_wake_worker(wq);
 }
 
 bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
@@ -134,13 +171,15 @@ static bool __flush_work(struct work_struct *work)
 {
 	struct workqueue_struct *wq;
 	bool ret = false;
+	unsigned i;
 retry:
 	list_for_each_entry(wq, &wq_list, list)
-		if (wq->current_work == work) {
-			pthread_cond_wait(&wq->work_finished, &wq_lock);
-			ret = true;
-			goto retry;
-		}
+		for (i = 0; i < wq->nr_workers; i++)
+			if (wq->workers[i].current_work == work) {
+				pthread_cond_wait(&wq->work_finished, &wq_lock);
+				ret = true;
+				goto retry;
+			}
 
 	return ret;
 }
@@ -204,20 +243,36 @@ bool cancel_delayed_work_sync(struct delayed_work *dwork)
 	return ret;
 }
 
+/*
+ * Like the kernel, a work item is never run concurrently with itself: skip
+ * pending work that's still running on another worker (it'll be picked up when
+ * that worker finishes):
+ */
+static struct work_struct *wq_next_work(struct workqueue_struct *wq)
+{
+	struct work_struct *work;
+
+	list_for_each_entry(work, &wq->pending_work, entry)
+		if (wq->nr_workers == 1 || !work_running(work))
+			return work;
+
+	return NULL;
+}
+
 static int worker_thread(void *arg)
 {
-	struct workqueue_struct *wq = arg;
+	struct workqueue_worker *worker = arg;
+	struct workqueue_struct *wq = worker->wq;
 	struct work_struct *work;
 
 	pthread_mutex_lock(&wq_lock);
 	while (1) {
 		__set_current_state(TASK_INTERRUPTIBLE);
-		work = list_first_entry_or_null(&wq->pending_work,
-				struct work_struct, entry);
-		wq->current_work = work;
+		work = wq_next_work(wq);
+		worker->current_work = work;
 
 		if (kthread_should_stop()) {
-			BUG_ON(wq->current_work);
+			BUG_ON(worker->current_work);
 			break;
 		}
 
@@ -232,10 +287,16 @@ static int worker_thread(void *arg)
 		list_del_init(&work->entry);
 		clear_work_pending(work);
 
+		/* more work: start another idle worker on it */
+		if (wq->nr_workers > 1 &&
+		    !list_empty(&wq->pending_work))
+			wq_wake_worker(wq);
+
 		pthread_mutex_unlock(&wq_lock);
 		work->func(work);
 		pthread_mutex_lock(&wq_lock);
 
+		worker->current_work = NULL;
 		pthread_cond_broadcast(&wq->work_finished);
 	}
 	pthread_mutex_unlock(&wq_lock);
@@ -245,7 +306,10 @@ static int worker_thread(void *arg)
 
 void destroy_workqueue(struct workqueue_struct *wq)
 {
-	kthread_stop(wq->worker);
+	unsigned i;
+
+	for (i = 0; i < wq->nr_workers; i++)
+		kthread_stop(wq->workers[i].task);
 
 	pthread_mutex_lock(&wq_lock);
 	list_del(&wq->list);
@@ -261,8 +325,15 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 {
 	va_list args;
 	struct workqueue_struct *wq;
+	unsigned i, nr_workers = 1;
 
-	wq = kzalloc(sizeof(*wq), GFP_KERNEL);
+	if ((flags & WQ_UNBOUND) && !(flags & __WQ_ORDERED) &&
+	    max_active != 1)
+		nr_workers = clamp_t(int, get_nprocs(), 1,
+				     max_active ?: WQ_DFL_ACTIVE);
+
+	wq = kzalloc(sizeof(*wq) + nr_workers * sizeof(wq->workers[0]),
+		     GFP_KERNEL);
 	if (!wq)
 		return NULL;
 
@@ -275,10 +346,19 @@ struct workqueue_struct *alloc_workqueue(const char *fmt,
 	vsnprintf(wq->name, sizeof(wq->name), fmt, args);
 	va_end(args);
 
-	wq->worker = kthread_run(worker_thread, wq, "%s", wq->name);
-	if (IS_ERR(wq->worker)) {
-		kfree(wq);
-		return NULL;
+	for (i = 0; i < nr_workers; i++) {
+		struct workqueue_worker *worker = &wq->workers[i];
+
+		worker->wq	= wq;
+		worker->task	= kthread_run(worker_thread, worker,
+					      "%s", wq->name);
+		if (IS_ERR(worker->task)) {
+			while (i--)
+				kthread_stop(wq->workers[i].task);
+			kfree(wq);
+			return NULL;
+		}
+		wq->nr_workers++;
 	}
 
 	pthread_mutex_lock(&wq_lock);
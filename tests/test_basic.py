@@ -2,6 +2,7 @@
 #
 # Basic bcachefs functionality tests.
 
+import json
 import re
 import util
 
@@ -62,3 +63,61 @@ def test_list_dirent(tmpdir):
     # snap 0 len 0 ver 0: lost+found -> 4097
     last = ret.stdout.splitlines()[-1]
     assert re.match(r'^.*type dirent.*: lost\+found ->.*$', last)
+
+def test_bench(tmpdir):
+    dev = util.format_1g(tmpdir)
+    out = tmpdir / 'bench.json'
+
+    ret = util.run_bch('bench', '-n', '1000', '-t', '2', '-d', dev,
+                       '-j', out, 'rand_insert', 'rand_lookup')
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert "rand_insert:" in ret.stdout
+
+    results = json.loads(out.read_text())['results']
+    assert [r['test'] for r in results] == ['rand_insert', 'rand_lookup']
+    for r in results:
+        assert r['nr'] == 1000 and r['threads'] == 2
+        assert r['latency_ns']['p50'] <= r['latency_ns']['p999']
+
+    assert results[0]['ops']['insert']['nr'] == 1000
+    assert results[0]['phase_time_ns']['bset_insert'] > 0
+    assert results[1]['ops']['lookup']['nr'] == 1000
+
+def test_bench_crc32c():
+    ret = util.run_bch('bench', '-n', '100', 'crc32c')
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert re.search(r'^crc32c generic +1048576 bytes: +\d+ MB/s$',
+                     ret.stdout, re.M)
+
+def test_bench_crypto():
+    ret = util.run_bch('bench', '-n', '100', 'chacha20', 'poly1305')
+
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    for l in ['chacha20 contiguous', 'chacha20 scattered',
+              'poly1305 whole', 'poly1305 per-page']:
+        assert re.search('^' + l + r' +4096 bytes: +\d+ MB/s$',
+                         ret.stdout, re.M)
+
+def test_trace(tmpdir):
+    ret = util.run_bch('trace', '-l')
+    assert ret.returncode == 0
+    assert 'journal_write\n' in ret.stdout
+
+    dev = util.format_1g(tmpdir)
+    out = tmpdir / 'trace'
+
+    ret = util.run_bch('trace', '-e', 'journal_*,btree_write', '-o', out,
+                       'bench', '-n', '1000', '-d', dev, 'rand_insert')
+    assert ret.returncode == 0
+
+    lines = out.read_text().splitlines()
+    assert any(' journal_write: ' in l for l in lines)
+    assert not any(' btree_node_alloc: ' in l for l in lines)
+
+    times = [float(l.split()[1]) for l in lines]
+    assert times == sorted(times)
@@ -2,7 +2,9 @@
 #
 # Tests of the fuse mount functionality.
 
+import concurrent.futures
 import os
+import re
 import util
 
 def test_mount(bfuse):
@@ -219,3 +221,175 @@ def test_write(bfuse):
     assert ts.contains(post_st.st_mtime)
 
     assert path.read_bytes() == b'test'
+
+def test_threads(bfuse):
+    bfuse.args = ['-o', 'multithread', '-o', 'max_idle_threads=4']
+    bfuse.mount()
+
+    def worker(i):
+        path = bfuse.mnt / "file{}".format(i)
+        data = bytes([i]) * (1 << 16)
+
+        path.write_bytes(data)
+        return path.read_bytes() == data
+
+    with concurrent.futures.ThreadPoolExecutor(max_workers=8) as e:
+        assert all(e.map(worker, range(8)))
+
+    # 8 files plus lost+found
+    assert len(list(bfuse.mnt.iterdir())) == 9
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_read_sequential(bfuse):
+    bfuse.mount()
+
+    path = bfuse.mnt / "file"
+    data = bytes(i & 0xff for i in range(1 << 20))
+    path.write_bytes(data)
+
+    with open(path, 'rb', buffering=0) as f:
+        # Sequential reads get served from readahead:
+        assert f.read(1 << 19) == data[:1 << 19]
+
+        # A write must invalidate what has already been read ahead:
+        with open(path, 'r+b', buffering=0) as w:
+            w.seek((1 << 19) + 4096)
+            w.write(b'x' * 4096)
+
+        rest = data[1 << 19:]
+        rest = rest[:4096] + b'x' * 4096 + rest[8192:]
+        assert f.read() == rest
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_stat_cached(bfuse):
+    bfuse.mount()
+
+    path = bfuse.mnt / "file"
+    path.write_bytes(b'x' * 4096)
+
+    # Inode attributes are cached; every update must show up:
+    assert path.stat().st_size == 4096
+
+    with open(path, 'ab') as f:
+        f.write(b'y' * 100)
+    assert path.stat().st_size == 4196
+
+    os.truncate(path, 10)
+    assert path.stat().st_size == 10
+
+    path.chmod(0o640)
+    assert path.stat().st_mode & 0o777 == 0o640
+
+    os.link(path, bfuse.mnt / "link")
+    assert path.stat().st_nlink == 2
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_symlink(bfuse):
+    bfuse.mount()
+
+    target = bfuse.mnt / "target"
+    target.write_bytes(b'test')
+
+    link = bfuse.mnt / "link"
+    link.symlink_to("target")
+
+    assert link.is_symlink()
+    assert os.readlink(link) == "target"
+    assert link.read_bytes() == b'test'
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def test_readdirplus(bfuse):
+    bfuse.mount()
+
+    # Enough entries to take several readdirplus calls:
+    for i in range(200):
+        (bfuse.mnt / "file{}".format(i)).write_bytes(b'x' * i)
+
+    entries = {e.name: e.stat().st_size
+               for e in os.scandir(bfuse.mnt) if e.name.startswith('file')}
+    assert entries == {"file{}".format(i): i for i in range(200)}
+
+    bfuse.unmount()
+    bfuse.verify()
+
+def format_zstd(tmpdir):
+    dev = util.device_1g(tmpdir)
+    util.run_bch('format', '--compression=zstd', dev, check=True)
+    return dev
+
+def write_small_files(mnt, prefix, nr):
+    '''Write nr small, similar files - what a dictionary is good for.'''
+    files = {}
+
+    for i in range(nr):
+        name = "{}{}".format(prefix, i)
+        data = ''.join("{} {} line {}\n".format(prefix, i, j)
+                       for j in range(400)).encode()
+
+        (mnt / name).write_bytes(data)
+        files[name] = data
+
+    return files
+
+def test_train_dict(tmpdir):
+    dev = format_zstd(tmpdir)
+    mnt = util.mountpoint(tmpdir)
+
+    bf = util.BFuse(dev, mnt)
+    bf.mount()
+    write_small_files(mnt, "sample", 256)
+    bf.unmount()
+    bf.verify()
+
+    ret = util.run_bch('train-dict', '--dry-run', '--size=4k', dev)
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+    assert re.search(r'^sampled [1-9]\d* extents', ret.stdout, re.M)
+    assert re.search(r'^trained dictionary \d+, \d+ bytes$', ret.stdout, re.M)
+
+    # --dry-run didn't store it, so we can train again:
+    ret = util.run_bch('train-dict', '--size=4k', dev)
+    assert ret.returncode == 0
+
+    ret = util.run_bch('train-dict', dev)
+    assert ret.returncode != 0
+    assert "already has a compression dictionary" in ret.stderr
+
+def test_dict_round_trip(tmpdir):
+    dev = format_zstd(tmpdir)
+    mnt = util.mountpoint(tmpdir)
+
+    bf = util.BFuse(dev, mnt)
+    bf.mount()
+    files = write_small_files(mnt, "sample", 256)
+    bf.unmount()
+    bf.verify()
+
+    ret = util.run_bch('train-dict', '--size=4k', dev)
+    assert ret.returncode == 0
+
+    # Written with the dictionary:
+    bf = util.BFuse(dev, mnt)
+    bf.mount()
+    files.update(write_small_files(mnt, "dict", 256))
+    bf.unmount()
+    bf.verify()
+
+    ret = util.run_bch('fsck', dev)
+    assert ret.returncode == 0
+    assert len(ret.stderr) == 0
+
+    bf = util.BFuse(dev, mnt)
+    bf.mount()
+    for name, data in files.items():
+        assert (mnt / name).read_bytes() == data
+    bf.unmount()
+    bf.verify()
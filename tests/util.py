@@ -132,10 +132,11 @@ class BFuse(threading.Thread):
     bcachefs is run under valgrind by default, and is checked for errors.
     '''
 
-    def __init__(self, dev, mnt):
+    def __init__(self, dev, mnt, args=None):
         threading.Thread.__init__(self)
         self.dev = dev
         self.mnt = mnt
+        self.args = args or []
         self.ready = threading.Event()
         self.proc = None
         self.returncode = None
@@ -151,7 +152,7 @@ class BFuse(threading.Thread):
                 '--leak-check=full',
                 '--log-file={}'.format(vout.name),
                 BCH_PATH,
-                'fusemount', '-f', self.dev, self.mnt]
+                'fusemount', '-f', *self.args, self.dev, self.mnt]
 
         print("Running {}".format(cmd))
 
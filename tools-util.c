@@ -17,7 +17,12 @@
 #include <blkid.h>
 #include <uuid/uuid.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "libbcachefs/bcachefs_ioctl.h"
+#include "linux/compiler.h"
 #include "linux/sort.h"
 #include "tools-util.h"
 #include "libbcachefs/util.h"
@@ -491,7 +496,57 @@ static u32 crc32c_default(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
-#include <linux/compiler.h>
+/*
+ * crc32c is bit reflected, so polynomials are stored reflected too: bit 0 is
+ * the coefficient of x^31.
+ */
+#define CRC32C_POLY		0x82f63b78U
+
+static inline u32 crc32c_mulx(u32 a)
+{
+	return (a >> 1) ^ (a & 1 ? CRC32C_POLY : 0);
+}
+
+/* Multiply two polynomials mod P: */
+static u32 crc32c_mulmod(u32 a, u32 b)
+{
+	u32 r = 0;
+
+	while (b) {
+		if (b & (1U << 31))
+			r ^= a;
+		b <<= 1;
+		a = crc32c_mulx(a);
+	}
+
+	return r;
+}
+
+static u32 crc32c_xpow(unsigned n)
+{
+	u32 r = 1U << 31;
+
+	while (n--)
+		r = crc32c_mulx(r);
+	return r;
+}
+
+/*
+ * Extend a crc over @len zero bytes, i.e. multiply it by x^(8 * len) mod P, in
+ * O(log len) multiplications:
+ */
+u32 __crc32c_le_shift(u32 crc, size_t len)
+{
+	u32 p = crc32c_xpow(8);
+
+	for (; len; len >>= 1) {
+		if (len & 1)
+			crc = crc32c_mulmod(crc, p);
+		p = crc32c_mulmod(p, p);
+	}
+
+	return crc;
+}
 
 #ifdef __x86_64__
 
@@ -530,15 +585,230 @@ static u32 crc32c_sse42(u32 crc, const void *buf, size_t size)
 	return crc;
 }
 
-#endif
+/*
+ * clmul() of two reflected 32 bit polynomials gives their product times x, and
+ * crc32q of that multiplies by x^32: so a crc is shifted n bits (i.e. extended
+ * over n zero bits) by crc32q(0, clmul(crc, x^(n - 33))).
+ */
+static u64 crc32c_shift_k(unsigned bits)
+{
+	return crc32c_xpow(bits - 33);
+}
 
-static void *resolve_crc32c(void)
+/*
+ * Folding a 128 bit accumulator A = L * x^64 + H forward n bits, with L and H
+ * its low and high qwords (the low qword comes first in reflected order):
+ *
+ *	A * x^n = L * x^(n + 64) + H * x^n
+ *
+ * is clmul(L, x^(n + 31)) ^ clmul(H, x^(n - 33)), by the same reasoning.
+ */
+static void crc32c_fold_k(u64 k[2], unsigned bits)
+{
+	k[0] = crc32c_xpow(bits + 31);
+	k[1] = crc32c_xpow(bits - 33);
+}
+
+/*
+ * Three way interleaved crc32c: crc32q has a latency of three cycles but a
+ * throughput of one per cycle, so a single dependency chain only gets a third
+ * of it. Large buffers are split into three blocks that are checksummed
+ * independently and then recombined, by shifting the first two with a carry-
+ * less multiply:
+ */
+#define CRC32C_3WAY_LONG	2048
+#define CRC32C_3WAY_SHORT	256
+
+static struct {
+	u64		shift_long[2];
+	u64		shift_short[2];
+	u64		fold[5][2];
+	u64		fold_lanes[3][2];
+} crc32c_k;
+
+/*
+ * The implementations in crc32c_impls[] may be called directly (e.g. by
+ * bcachefs bench), not just via crc32c(), so the constants are computed at
+ * startup - before any threads exist - rather than by the resolver:
+ */
+__attribute__((constructor))
+static void crc32c_pclmul_init(void)
+{
+	unsigned i;
+
+	crc32c_k.shift_long[0]	= crc32c_shift_k(CRC32C_3WAY_LONG * 8);
+	crc32c_k.shift_long[1]	= crc32c_shift_k(CRC32C_3WAY_LONG * 16);
+	crc32c_k.shift_short[0]	= crc32c_shift_k(CRC32C_3WAY_SHORT * 8);
+	crc32c_k.shift_short[1]	= crc32c_shift_k(CRC32C_3WAY_SHORT * 16);
+
+	/* fold[i]: by 512 * i bits, for the 512 bit lanes: */
+	for (i = 1; i < ARRAY_SIZE(crc32c_k.fold); i++)
+		crc32c_fold_k(crc32c_k.fold[i], 512 * i);
+
+	/* fold_lanes[i]: by 128 * (3 - i) bits, within a 512 bit register: */
+	for (i = 0; i < ARRAY_SIZE(crc32c_k.fold_lanes); i++)
+		crc32c_fold_k(crc32c_k.fold_lanes[i], 128 * (3 - i));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static inline u32 crc32c_shift_pclmul(u32 crc, u64 k)
+{
+	__m128i p = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+					 _mm_cvtsi64_si128(k), 0x00);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(p));
+}
+
+__attribute__((target("sse4.2,pclmul"), always_inline))
+static inline u32 crc32c_3way_blocks(u32 crc, const void **buf, size_t *size,
+				     size_t block, const u64 k[2])
 {
+	while (*size >= block * 3) {
+		const u64 *d = *buf;
+		u64 c0 = crc, c1 = 0, c2 = 0;
+		size_t i;
+
+		for (i = 0; i < block / 8; i++) {
+			c0 = _mm_crc32_u64(c0, d[i]);
+			c1 = _mm_crc32_u64(c1, d[i + block / 8]);
+			c2 = _mm_crc32_u64(c2, d[i + block / 4]);
+		}
+
+		crc = crc32c_shift_pclmul(c0, k[1]) ^
+		      crc32c_shift_pclmul(c1, k[0]) ^ c2;
+
+		*buf	+= block * 3;
+		*size	-= block * 3;
+	}
+
+	return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static u32 crc32c_sse42_3way(u32 crc, const void *buf, size_t size)
+{
+	crc = crc32c_3way_blocks(crc, &buf, &size, CRC32C_3WAY_LONG,
+				 crc32c_k.shift_long);
+	crc = crc32c_3way_blocks(crc, &buf, &size, CRC32C_3WAY_SHORT,
+				 crc32c_k.shift_short);
+	return crc32c_sse42(crc, buf, size);
+}
+
+/*
+ * AVX-512 VPCLMULQDQ: fold four 512 bit accumulators forward 256 bytes at a
+ * time, then fold those into one, and then its four 128 bit lanes into one;
+ * the crc of the data is the crc of the final accumulator's 16 bytes.
+ */
+#define CRC32C_VPCLMUL_TARGET	"avx512f,vpclmulqdq,sse4.2,pclmul"
+
+__attribute__((target(CRC32C_VPCLMUL_TARGET)))
+static inline __m512i crc32c_fold512(__m512i a, const u64 k[2], __m512i b)
+{
+	__m512i kk = _mm512_broadcast_i32x4(_mm_set_epi64x(k[1], k[0]));
+
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(a, kk, 0x00),
+					 _mm512_clmulepi64_epi128(a, kk, 0x11),
+					 b, 0x96);
+}
+
+__attribute__((target(CRC32C_VPCLMUL_TARGET)))
+static inline __m128i crc32c_fold128(__m128i a, const u64 k[2], __m128i b)
+{
+	__m128i kk = _mm_set_epi64x(k[1], k[0]);
+
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, kk, 0x00),
+					   _mm_clmulepi64_si128(a, kk, 0x11)),
+			     b);
+}
+
+__attribute__((target(CRC32C_VPCLMUL_TARGET)))
+static u32 crc32c_vpclmul(u32 crc, const void *buf, size_t size)
+{
+	__m512i x0, x1, x2, x3;
+	__m128i a;
+
+	if (size < 256)
+		return crc32c_sse42_3way(crc, buf, size);
+
+	/* the initial crc is just xored into the first 32 bits of data: */
+	x0 = _mm512_xor_si512(_mm512_loadu_si512(buf),
+			      _mm512_castsi128_si512(_mm_cvtsi32_si128(crc)));
+	x1 = _mm512_loadu_si512(buf + 64);
+	x2 = _mm512_loadu_si512(buf + 128);
+	x3 = _mm512_loadu_si512(buf + 192);
+	buf	+= 256;
+	size	-= 256;
+
+	while (size >= 256) {
+		x0 = crc32c_fold512(x0, crc32c_k.fold[4], _mm512_loadu_si512(buf));
+		x1 = crc32c_fold512(x1, crc32c_k.fold[4], _mm512_loadu_si512(buf + 64));
+		x2 = crc32c_fold512(x2, crc32c_k.fold[4], _mm512_loadu_si512(buf + 128));
+		x3 = crc32c_fold512(x3, crc32c_k.fold[4], _mm512_loadu_si512(buf + 192));
+		buf	+= 256;
+		size	-= 256;
+	}
+
+	x0 = crc32c_fold512(x0, crc32c_k.fold[3],
+	     crc32c_fold512(x1, crc32c_k.fold[2],
+	     crc32c_fold512(x2, crc32c_k.fold[1], x3)));
+
+	while (size >= 64) {
+		x0 = crc32c_fold512(x0, crc32c_k.fold[1], _mm512_loadu_si512(buf));
+		buf	+= 64;
+		size	-= 64;
+	}
+
+	a = crc32c_fold128(_mm512_extracti32x4_epi32(x0, 0), crc32c_k.fold_lanes[0],
+	    crc32c_fold128(_mm512_extracti32x4_epi32(x0, 1), crc32c_k.fold_lanes[1],
+	    crc32c_fold128(_mm512_extracti32x4_epi32(x0, 2), crc32c_k.fold_lanes[2],
+			   _mm512_extracti32x4_epi32(x0, 3))));
+
+	crc = _mm_crc32_u64(0, _mm_cvtsi128_si64(a));
+	crc = _mm_crc32_u64(crc, _mm_extract_epi64(a, 1));
+
+	return crc32c_sse42(crc, buf, size);
+}
+
+static bool crc32c_sse42_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+static bool crc32c_pclmul_supported(void)
+{
+	return __builtin_cpu_supports("sse4.2") &&
+		__builtin_cpu_supports("pclmul");
+}
+
+static bool crc32c_vpclmul_supported(void)
+{
+	return crc32c_pclmul_supported() &&
+		__builtin_cpu_supports("avx512f") &&
+		__builtin_cpu_supports("vpclmulqdq");
+}
+
+#endif
+
+const struct crc32c_impl crc32c_impls[] = {
+	{ "generic",		crc32c_default,		NULL },
 #ifdef __x86_64__
-	if (__builtin_cpu_supports("sse4.2"))
-		return crc32c_sse42;
+	{ "sse4.2",		crc32c_sse42,		crc32c_sse42_supported },
+	{ "sse4.2-3way",	crc32c_sse42_3way,	crc32c_pclmul_supported },
+	{ "vpclmulqdq",		crc32c_vpclmul,		crc32c_vpclmul_supported },
 #endif
-	return crc32c_default;
+	{ NULL }
+};
+
+/* Returns the last, i.e. fastest, implementation this CPU supports: */
+static void *resolve_crc32c(void)
+{
+	const struct crc32c_impl *i, *best = crc32c_impls;
+
+	for (i = crc32c_impls; i->name; i++)
+		if (!i->supported || i->supported())
+			best = i;
+
+	return best->fn;
 }
 
 /*
@@ -549,8 +819,12 @@ static void *resolve_crc32c(void)
 static void *ifunc_resolve_crc32c(void)
 {
 	__builtin_cpu_init();
+#ifdef __x86_64__
+	/* ifunc resolvers run before constructors: */
+	crc32c_pclmul_init();
+#endif
 
-	return resolve_crc32c
+	return resolve_crc32c();
 }
 
 u32 crc32c(u32, const void *, size_t)
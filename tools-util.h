@@ -151,6 +151,26 @@ char *strcmp_prefix(char *, const char *);
 unsigned hatoi_validate(const char *, const char *);
 
 u32 crc32c(u32, const void *, size_t);
+u32 __crc32c_le_shift(u32, size_t);
+
+/*
+ * crc32c of two concatenated buffers, from the crc of the first (with the
+ * seed for the whole) and the crc of the second with a seed of 0:
+ */
+static inline u32 __crc32c_le_combine(u32 crc1, u32 crc2, size_t len2)
+{
+	return __crc32c_le_shift(crc1, len2) ^ crc2;
+}
+
+struct crc32c_impl {
+	const char	*name;
+	u32		(*fn)(u32, const void *, size_t);
+	/* NULL: always supported */
+	bool		(*supported)(void);
+};
+
+/* All crc32c implementations, in order of preference, NULL terminated: */
+extern const struct crc32c_impl crc32c_impls[];
 
 char *dev_to_name(dev_t);
 char *dev_to_path(dev_t);